@@ -34,11 +34,137 @@ void memory_leak(void)
     *str = 'b';
 }
 
-int main(void)
+/*
+ * Cases run on their own with "mctest <case>", each meant for one mode of
+ * libmemchk; "make check" runs them with their environment.
+ */
+
+/* MEMCHK_GUARD_SIZE or MEMCHK_GWP_RATE: the latest freed guarded block faults */
+void guard_use_after_free(void)
+{
+    char *ptr[16];
+
+    for (int i = 0; i < 16; i++)
+        ptr[i] = (char *)malloc(100);
+    for (int i = 0; i < 16; i++)
+        free(ptr[i]);
+    for (int i = 15; i >= 0; i--)
+        ptr[i][64] = 'a';
+}
+
+/* the old block is quarantined when realloc moves it */
+void realloc_stale_free(void)
+{
+    char *ptr = (char *)malloc(32);
+    char *new_ptr = (char *)realloc(ptr, 65536);
+
+    free(ptr);
+    free(new_ptr);
+}
+
+void realloc_freed(void)
+{
+    char *ptr = (char *)malloc(32);
+
+    free(ptr);
+    if (realloc(ptr, 64))
+        exit(1);
+}
+
+/* grows one buffer a byte at a time; it must not be copied on every step */
+void realloc_growth(void)
+{
+    char *ptr = NULL, *new_ptr;
+    int moves = 0;
+
+    for (int i = 0; i < (1 << 20); i++) {
+        new_ptr = (char *)realloc(ptr, i + 1);
+        if (!new_ptr)
+            exit(1);
+        if (new_ptr != ptr)
+            moves++;
+        ptr = new_ptr;
+        ptr[i] = (char)i;
+    }
+    for (int i = 0; i < (1 << 20); i++) {
+        if (ptr[i] != (char)i)
+            exit(1);
+    }
+    free(ptr);
+    printf("%d moves\n", moves);
+    if (moves > 64)
+        exit(1);
+}
+
+/* MEMCHK_SAMPLE_RATE: unsampled blocks pass through, a large block is sampled */
+void sampled_double_free(void)
+{
+    char *ptr;
+
+    for (int i = 0; i < 10000; i++)
+        free(malloc(64));
+    ptr = (char *)malloc(1 << 20);
+    free(ptr);
+    free(ptr);
+}
+
+/* MEMCHK_QUARANTINE_BYTES: older blocks are evicted, the latest is still held */
+void quarantine_budget(void)
+{
+    char *ptr = NULL;
+
+    for (int i = 0; i < 256; i++) {
+        ptr = (char *)malloc(4096);
+        free(ptr);
+    }
+    free(malloc(1 << 20));
+    free(ptr);
+}
+
+/* MEMCHK_SCRUB_RATE: the scrubber finds the write before the block is evicted */
+void scrub_freed_write(void)
+{
+    access_freed_area();
+    sleep(1);
+}
+
+static const struct {
+    const char *name;
+    void (*func)(void);
+} cases[] = {
+    { "access-freed-area", access_freed_area },
+    { "double-free", double_free },
+    { "memory-overrun", memory_overrun },
+    { "guard-use-after-free", guard_use_after_free },
+    { "realloc-stale-free", realloc_stale_free },
+    { "realloc-freed", realloc_freed },
+    { "realloc-growth", realloc_growth },
+    { "sampled-double-free", sampled_double_free },
+    { "quarantine-budget", quarantine_budget },
+    { "scrub-freed-write", scrub_freed_write },
+};
+
+static int run_case(const char *name)
+{
+    for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!strcmp(name, cases[i].name)) {
+            cases[i].func();
+            printf("%s returned\n", name);
+            return 0;
+        }
+    }
+    fprintf(stderr, "unknown case %s\n", name);
+    return -1;
+}
+
+int main(int argc, char *argv[])
 {
     char input[10];
     char *ptr1 = NULL, *ptr2, *ptr3 = NULL, *ptr4[2];
 
+    if (argc > 1)
+        return run_case(argv[1]) ? 1 : 0;
+
     printf("\n\nHit enter to start\n");
     if (!fgets(input, 10, stdin))
         return -1;
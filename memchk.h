@@ -3,7 +3,10 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <unistd.h>
+/* ENABLE_BFD is set by the makefile unless built with USE_BFD=0 */
+#ifdef ENABLE_BFD
 #include <bfd.h>
+#endif
 
 #define PAGE_SIZE 4096
 
@@ -24,7 +27,11 @@
 #endif
 
 #define MAX_CALLSTACK_DEPTH 32
-#define FREE_FIFO_SIZE 128
+/* default quarantine limits, see memchk_quarantine.c; FREE_FIFO_SIZE 0 disables it */
+#define FREE_FIFO_SIZE 65536
+#define FREE_FIFO_BYTES (64UL << 20)
+/* most room a block moved by realloc gets for further growth, see mc_realloc_memblk() */
+#define REALLOC_MAX_HEADROOM (1UL << 30)
 
 #define MAX_FILEMAPNAME_LEN    256
 #define MAX_SYMFUNCNAME_LEN    1024
@@ -44,7 +51,7 @@
             ((type *)(__mptr - offsetof(type, member))); })
 
 #define get_alloc_memblk_from_memptr(__memptr) container_of(container_of(__memptr, struct memblk, memptr), struct alloc_memblk, memblk)
-#define get_alloc_memblk_from_allocator(__allocator) container_of(__allocator, struct alloc_memblk, allocator)
+#define get_report_memblk_from_memptr(__memptr) container_of(get_alloc_memblk_from_memptr(__memptr), struct report_memblk, alloc_memblk)
 #define get_free_memblk_from_memptr(__memptr) container_of(container_of(__memptr, struct memblk, memptr), struct free_memblk, memblk)
 
 enum {
@@ -53,50 +60,113 @@ enum {
     LINK_MAX
 };
 
+/* hash, hash_next and depth come first so that a chain walk touches one cache line */
 struct callstack {
-    int depth;
-    void *trace[MAX_CALLSTACK_DEPTH];
+    uint64_t hash;
     struct callstack *hash_next;
-    struct alloc_memblk *same_callstack_group_next[LINK_MAX];
+    int depth;
+    int usage;          /* references from blocks and report copies */
+    int guard_site;     /* 0: not decided yet, 1: guarded site, -1: not */
+    uint32_t id;        /* index in the stack table, never 0 */
     int64_t total_size;
-    int usage;
+    struct report_memblk *same_callstack_group_next[LINK_MAX];
+    void *trace[MAX_CALLSTACK_DEPTH];
 };
 
+/* stack ids are 24 bits so that the stack table index fits in a small static array */
+#define STACK_ID_BITS 24
+
 struct memptr {
     void *ptr;
     struct memptr *hash_next;
 };
 
+#define MEMBLK_ZEROED    0x1   /* the user area was initialized by the original allocator */
+#define MEMBLK_GUARDED   0x2   /* pages of its own followed by a guard page */
+#define MEMBLK_GWP       0x4   /* a slot of the sampled guarded pool */
+#define MEMBLK_REALLOCED 0x8   /* moved by realloc, grown with headroom when it moves again */
+
+/*
+ * One of these is kept for every live block, so it is kept small: the
+ * buffer is described by the red zone sizes around the user area, and the
+ * allocation call stack by its id.  The user size is held in 32 bits, and
+ * the few bits above them that sizes over 4 GB need share a word with the
+ * leading red zone size.  Use mc_memblk_usrsize(), mc_memblk_buf() and
+ * mc_memblk_bufsize() rather than the fields.
+ */
+#define MEMBLK_LEAD_BITS 24
+#define MEMBLK_MAX_LEAD ((1UL << MEMBLK_LEAD_BITS) - 1)
+#define MEMBLK_MAX_USRSIZE ((1UL << (64 - MEMBLK_LEAD_BITS)) - 1)
+
 struct memblk {
-    void *buf;
-    size_t bufsize;
-    size_t usrsize;
     struct memptr memptr;
+    uint32_t usrsize;           /* low 32 bits of the user size */
+    uint32_t lead : MEMBLK_LEAD_BITS;   /* bytes from the buffer to the user area */
+    uint32_t usrsize_hi : 32 - MEMBLK_LEAD_BITS;
+    uint32_t tail;              /* bytes from the end of the user area to the end of the buffer */
+    uint32_t allocator_id : STACK_ID_BITS;  /* allocation call stack, 0 if none */
+    uint32_t flags : 32 - STACK_ID_BITS;
 };
 
 struct alloc_memblk {
     struct memblk memblk;
-    #ifdef ENABLE_CALLSTACK
-    struct callstack *allocator;
-    struct alloc_memblk *same_callstack_group_prev;
-    struct alloc_memblk *same_callstack_group_next;
-    #endif
 };
 
 struct free_memblk {
     struct memblk memblk;
+    struct free_memblk *quarantine_next;
     #ifdef ENABLE_CALLSTACK
-    struct callstack *allocator;
-    struct callstack *freer;
+    uint32_t freer_id;
     #endif
 };
 
+/*
+ * Copy of an allocated block taken for a report or a snapshot.  Only the
+ * copies are linked into the groups of their call stacks.
+ */
+struct report_memblk {
+    struct alloc_memblk alloc_memblk;
+    #ifdef ENABLE_CALLSTACK
+    struct report_memblk *same_callstack_group_prev;
+    struct report_memblk *same_callstack_group_next;
+    #endif
+};
+
+static inline size_t mc_memblk_usrsize(struct memblk *memblk)
+{
+    return (size_t)memblk->usrsize_hi << 32 | memblk->usrsize;
+}
+
+/* usrsize must not be over MEMBLK_MAX_USRSIZE */
+static inline void mc_memblk_set_usrsize(struct memblk *memblk, size_t usrsize)
+{
+    memblk->usrsize = (uint32_t)usrsize;
+    memblk->usrsize_hi = usrsize >> 32;
+}
+
+static inline void *mc_memblk_buf(struct memblk *memblk)
+{
+    return (uint8_t *)memblk->memptr.ptr - memblk->lead;
+}
+
+static inline size_t mc_memblk_bufsize(struct memblk *memblk)
+{
+    return memblk->lead + mc_memblk_usrsize(memblk) + memblk->tail;
+}
+
+#define MAX_BUILD_ID_LEN 20
+
 struct filemap {
     void *start_addr, *end_addr;
     off_t file_offset;
     char name[MAX_FILEMAPNAME_LEN];
+    void *load_base;            /* NULL if no loaded object covers the mapping */
+    char build_id[MAX_BUILD_ID_LEN * 2 + 1];
+    #ifdef ENABLE_BFD
     bfd *abfd;
     asymbol **symbols;
+    int no_symbols;
+    #endif
 };
 
 struct funcsymbol {
@@ -105,12 +175,46 @@ struct funcsymbol {
     int line;
 };
 
+/* a symbolized return address, see memchk_symbol.c */
+struct symcache_frame {
+    const char *funcname;
+    const char *srcfilename;
+    int line;
+};
+
+struct symcache_entry {
+    struct symcache_entry *next;
+    void *addr;
+    const char *filemapname;    /* NULL if addr is in no known module */
+    off_t offset;
+    int num_inline;             /* 0 if no symbol was found */
+    struct symcache_frame frame[];
+};
+
 struct pageregion {
     unsigned long start;
     unsigned long end;
     struct pageregion *next;
 };
 
+struct ptr_hashtable;
+
+/* position of an incremental walk over a pointer hashtable */
+struct ptr_hashtable_cursor {
+    int shard;
+    int t;
+    size_t idx;
+    struct memptr **table;      /* table[0] of the shard when the walk entered it */
+};
+
+/* position of an incremental check of all blocks */
+struct memblk_check_cursor {
+    int table;                  /* 0: allocated blocks, 1: freed blocks, 2: done */
+    struct ptr_hashtable_cursor pos;
+    size_t num_checked;
+    size_t num_errors;
+};
+
 struct vmarea {
     unsigned long start;
     unsigned long end;
@@ -118,6 +222,9 @@ struct vmarea {
     struct vmarea *next;
 };
 
+extern size_t mc_gwp_rate;
+extern __thread long mc_gwp_countdown __attribute__((tls_model("initial-exec")));
+
 extern void *(*mc_orig_malloc)(size_t size);
 extern void (*mc_orig_free)(void *ptr);
 extern void *(*mc_orig_realloc)(void *ptr, size_t size);
@@ -136,38 +243,57 @@ void mc_enable_hook(void);
 void mc_allocator_init(void *buf, size_t memblk_size);
 void *mc_allocator_alloc(void *buf, size_t memblk_size);
 void mc_allocator_free(void *buf, size_t memblk_size);
+void mc_allocator_release_empty_batches(void);
+void mc_allocator_get_status(void *buf, size_t *num_used, size_t *num_pages, size_t *num_released_batches);
 
 void mc_alloc_blk_init(void);
 struct alloc_memblk *mc_allocate_alloc_memblk(void);
 void mc_free_alloc_memblk(struct alloc_memblk *buf);
 struct free_memblk *mc_allocate_free_memblk(void);
 void mc_free_free_memblk(struct free_memblk *buf);
+struct report_memblk *mc_allocate_report_memblk(void);
+void mc_free_report_memblk(struct report_memblk *buf);
 struct callstack *mc_allocate_callstack(void);
 void mc_free_callstack(struct callstack *buf);
 struct pageregion *mc_allocate_pageregion(void);
 void mc_free_pageregion(struct pageregion *buf);
+void mc_print_alloc_blk_status(void);
 
-void mc_lock_ptr_hashtable(void);
-void mc_unlock_ptr_hashtable(void);
+void mc_lock_ptr_hashtable(struct ptr_hashtable *hashtable);
+void mc_unlock_ptr_hashtable(struct ptr_hashtable *hashtable);
 void mc_lock_callstack_hashtable(void);
 void mc_unlock_callstack_hashtable(void);
-void mc_add_ptr_hashtable(struct memptr *hashtable[], size_t size, struct memptr *memptr);
+void mc_add_ptr_hashtable(struct ptr_hashtable *hashtable, struct memptr *memptr);
+uint64_t mc_calc_callstack_hash(void *trace[], int depth);
 void mc_add_callstack_hashtable(struct callstack *hashtable[], size_t size, struct callstack *callstack);
-struct memptr *mc_remove_ptr_hashtable(struct memptr *hashtable[], size_t size, void *ptr);
+struct memptr *mc_remove_ptr_hashtable(struct ptr_hashtable *hashtable, void *ptr);
 struct callstack *mc_remove_callstack_hashtable(struct callstack *hashtable[], size_t size, struct callstack *callstack);
-struct memptr *mc_find_ptr_hashtable(struct memptr *hashtable[], size_t size, void *ptr);
+struct memptr *mc_find_ptr_hashtable(struct ptr_hashtable *hashtable, void *ptr);
 struct callstack *mc_find_callstack_hashtable(struct callstack *hashtable[], size_t size, struct callstack *callstack);
+void mc_clear_ptr_hashtable(struct ptr_hashtable *hashtable);
+size_t mc_count_ptr_hashtable(struct ptr_hashtable *hashtable);
+size_t mc_walk_ptr_hashtable(struct ptr_hashtable *hashtable, struct ptr_hashtable_cursor *cursor, size_t max_buckets, void (*fn)(struct memptr *memptr, void *arg), void *arg);
+void mc_print_ptr_hashtable_stat(const char *name, struct ptr_hashtable *hashtable);
+void mc_print_callstack_hashtable_stat(const char *name, struct callstack *hashtable[], size_t size);
 
-int mc_register_memblk(void *buf, void *usrptr, size_t bufsize, size_t usrsize);
+int mc_register_memblk(void *buf, void *usrptr, size_t bufsize, size_t usrsize, int flags, struct callstack *allocator);
 int mc_unregister_memblk(void *usrptr, void **buf_to_be_freed);
+int mc_realloc_memblk(void *usrptr, size_t size, void **newptr);
 size_t mc_handle_realloc_memblk(void *usrptr);
+void mc_report_illegal_realloc(void *usrptr);
+int mc_report_guard_fault(void *addr, int is_write, void *pc);
+int mc_check_memblk_step(struct memblk_check_cursor *cursor, size_t max_blocks);
 int mc_check_all_memblk(void);
 int mc_get_alloc_memblk_cnt(void);
 size_t mc_get_allocated_size(void);
 int mc_get_alloc_cnt(void);
 int mc_get_free_cnt(void);
+double mc_get_estimated_alloc_memblk_cnt(void);
+double mc_get_estimated_allocated_size(void);
+int mc_is_unsampled_memblk(void *usrptr);
 void mc_print_histogram_alloc_memblk(void);
-int __print_all_memblk_on_hashtable(struct memptr *hashtable[], size_t hash_size);
+void mc_print_hashtable_status(void);
+int __print_all_memblk_on_hashtable(struct ptr_hashtable *hashtable);
 int __print_all_memblk_per_callstack(int link_index);
 int mc_print_all_memblk(void);
 int mc_print_all_memblk_per_callstack(void);
@@ -180,12 +306,55 @@ uint64_t mc_get_virtual_memory_usage(void);
 
 int mc_match_callstack(struct callstack *cs1, struct callstack *cs2);
 struct callstack *mc_get_callstack(void);
-void mc_link_memblk_to_callstack(struct alloc_memblk *alloc_memblk, struct callstack *callstack, int link_index);
-void mc_unlink_memblk_from_callstack(struct alloc_memblk *alloc_memblk, struct callstack *callstack, int link_index);
-void mc_link_same_callstack_group(struct memptr *hashtable[], size_t size, int link_index);
+struct callstack *mc_get_callstack_by_id(uint32_t id);
+void mc_hold_callstack_id(uint32_t id);
+void mc_put_callstack(struct callstack *callstack);
+void mc_put_callstack_id(uint32_t id);
+void mc_reclaim_callstacks(void);
+void mc_print_callstack_status(void);
+void mc_link_memblk_to_callstack(struct report_memblk *report_memblk, struct callstack *callstack, int link_index);
+void mc_unlink_memblk_from_callstack(struct report_memblk *report_memblk, struct callstack *callstack, int link_index);
+void mc_link_same_callstack_group(struct ptr_hashtable *hashtable, int link_index);
 void mc_reset_same_callstack_group(struct callstack *hashtable[], size_t size, int link_index);
 void mc_print_callstack(int depth, void *trace[], int from);
+void mc_print_callstack_by_id(uint32_t id, int from);
 void mc_print_current_callstack(int from);
+void mc_print_signal_callstack(void *pc);
+
+void mc_sample_init(void);
+uint64_t mc_sample_random(void);
+int mc_is_sampling(void);
+size_t mc_get_sample_rate(void);
+int mc_sample_allocation(size_t size);
+double mc_sample_weight(size_t usrsize);
+int64_t mc_sample_estimate(size_t usrsize);
+void mc_sample_track(void *usrptr);
+void mc_sample_untrack(void *usrptr);
+int mc_sample_maybe_tracked(void *usrptr);
+
+void mc_quarantine_init(void);
+int mc_quarantine_accepts(size_t bufsize);
+struct free_memblk *mc_quarantine_put(struct free_memblk *free_memblk);
+void mc_print_quarantine_status(void);
+
+void mc_guard_init(void);
+int mc_guard_select(size_t size, struct callstack **allocator);
+void *mc_guard_alloc(size_t size, size_t alignment, int flags, struct callstack *allocator);
+void mc_guard_protect(struct memblk *memblk);
+void mc_guard_release(struct memblk *memblk);
+void mc_print_guard_status(void);
+void *mc_gwp_alloc(size_t size, size_t alignment, int flags);
+int mc_gwp_owns(void *ptr);
+void *mc_guard_find(void *addr);
+size_t mc_gwp_get_num_slots(void);
+
+void mc_scrub_init(void);
+void mc_print_scrub_status(void);
+
+void mc_unwind_init(void);
+int mc_unwind(void *trace[], int max_depth);
+int mc_unwind_signal(void *trace[], int max_depth, void *pc);
+void mc_print_unwinder_status(void);
 
 void mc_log_init(void);
 void mc_log_print(const char *format, ...);
@@ -196,21 +365,38 @@ void mc_signal_init(void);
 int mc_init_filemaps_from_file(char *file);
 int mc_init_filemaps_from_procmap(void);
 void mc_term_filemaps(void);
+#ifdef ENABLE_BFD
 struct filemap *mc_find_and_init_bfd_filemap(void *addr);
+int mc_open_bfd(const char *name, bfd **abfd, asymbol ***symbols);
+void mc_close_bfd(bfd *abfd, asymbol **symbols);
+#endif
 struct filemap *mc_find_filemap(void *addr);
 
 int mc_prepare_symbol(void);
+#ifdef ENABLE_BFD
 int mc_get_symbol_from_offset(bfd *abfd, asymbol **symbols, off_t offset, int do_demangle, struct funcsymbol funcsymbol[], int max_unwind_inline);
 int mc_get_symbol(void *addr, int do_demangle, char *filemapname, int max_name_len, off_t *offset, struct funcsymbol funcsymbol[], int max_unwind_inline);
+#endif
 int mc_get_symbol_offset(void *addr, char *filemapname, int max_name_len, off_t *offset);
 void mc_finish_symbol(void);
-
-int mc_duplicate_all_alloc_memblk(struct memptr *dest_hashtable[], size_t dest_size, struct memptr *src_hashtable[], size_t src_size);
-void mc_destroy_all_alloc_memblk(struct memptr *hashtable[], size_t size);
-int mc_compare_snapshot_and_current_alloc_memblk(struct memptr *current_hashtable[], size_t current_size, struct memptr *snapshot_hashtable[], size_t snapshot_size);
-int mc_compare_snapshot_and_current_alloc_memblk_per_callstack(struct memptr *current_hashtable[], size_t current_size, struct memptr *snapshot_hashtable[], size_t snapshot_size);
-
+void mc_symbol_init(void);
+const struct symcache_entry *mc_lookup_symbol(void *addr);
+void mc_resolve_symbols(void *addrs[], size_t num);
+void mc_resolve_callstack_symbols(struct callstack *callstack_array[], int num, int from);
+void mc_flush_symbol_cache(void);
+void mc_release_symbol_cache(void);
+void mc_print_symbol_status(void);
+int mc_is_offline_symbol(void);
+
+int mc_duplicate_all_alloc_memblk(struct ptr_hashtable *dest_hashtable, struct ptr_hashtable *src_hashtable);
+void mc_destroy_all_alloc_memblk(struct ptr_hashtable *hashtable);
+int mc_compare_snapshot_and_current_alloc_memblk(struct ptr_hashtable *current_hashtable, struct ptr_hashtable *snapshot_hashtable);
+int mc_compare_snapshot_and_current_alloc_memblk_per_callstack(struct ptr_hashtable *current_hashtable, struct ptr_hashtable *snapshot_hashtable);
+
+void mc_buffer_init(void);
 void mc_set_allocated_buffer(struct alloc_memblk *alloc_memblk, int init_usrptr);
+void mc_resize_allocated_buffer(struct alloc_memblk *alloc_memblk, size_t old_usrsize);
+int mc_check_resized_buffer(struct alloc_memblk *alloc_memblk, size_t usrsize);
 int mc_check_allocated_buffer(struct alloc_memblk *alloc_memblk, int freeing_now);
 void mc_set_freed_buffer(struct free_memblk *free_memblk);
 int mc_check_freed_buffer(struct free_memblk *free_memblk);
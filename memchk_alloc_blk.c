@@ -3,9 +3,10 @@
 #include "memchk.h"
 #include "memchk_alloc.h"
 
-static ssize_t alloc_memblk_size, free_memblk_size, callstack_size, pageregion_size;
+static ssize_t alloc_memblk_size, free_memblk_size, report_memblk_size, callstack_size, pageregion_size;
 static uint8_t __attribute__((aligned(PAGE_SIZE))) alloc_memblk_pool_head[PAGE_SIZE];
 static uint8_t __attribute__((aligned(PAGE_SIZE))) free_memblk_pool_head[PAGE_SIZE];
+static uint8_t __attribute__((aligned(PAGE_SIZE))) report_memblk_pool_head[PAGE_SIZE];
 static uint8_t __attribute__((aligned(PAGE_SIZE))) callstack_pool_head[PAGE_SIZE];
 static uint8_t __attribute__((aligned(PAGE_SIZE))) pageregion_pool_head[PAGE_SIZE];
 
@@ -17,6 +18,9 @@ void mc_alloc_blk_init(void)
     free_memblk_size = __get_aligned_size(sizeof(struct free_memblk), ALIGNMENT_SIZE);
     mc_allocator_init(free_memblk_pool_head, free_memblk_size);
 
+    report_memblk_size = __get_aligned_size(sizeof(struct report_memblk), ALIGNMENT_SIZE);
+    mc_allocator_init(report_memblk_pool_head, report_memblk_size);
+
     callstack_size = __get_aligned_size(sizeof(struct callstack), ALIGNMENT_SIZE);
     mc_allocator_init(callstack_pool_head, callstack_size);
 
@@ -44,6 +48,16 @@ void mc_free_free_memblk(struct free_memblk *buf)
     mc_allocator_free((void *)buf, free_memblk_size);
 }
 
+struct report_memblk *mc_allocate_report_memblk(void)
+{
+    return (struct report_memblk *)mc_allocator_alloc(report_memblk_pool_head, report_memblk_size);
+}
+
+void mc_free_report_memblk(struct report_memblk *buf)
+{
+    mc_allocator_free((void *)buf, report_memblk_size);
+}
+
 struct callstack *mc_allocate_callstack(void)
 {
     return (struct callstack *)mc_allocator_alloc(callstack_pool_head, callstack_size);
@@ -63,3 +77,32 @@ void mc_free_pageregion(struct pageregion *buf)
 {
     mc_allocator_free((void *)buf, pageregion_size);
 }
+
+static size_t __print_pool_status(const char *name, void *pool_head, size_t memblk_size)
+{
+    size_t num_used, num_pages, num_released_batches, mapped;
+    char unit[3];
+    float val;
+
+    mc_allocator_get_status(pool_head, &num_used, &num_pages, &num_released_batches);
+    mapped = num_pages * PAGE_SIZE;
+    val = mc_change_unit(mapped, unit);
+    mc_log_print("  %-13s: %lu objects x %lu bytes, %lu pages (%.2f %s), %lu batches released\n", name, num_used, memblk_size, num_pages, val, unit, num_released_batches);
+    return mapped;
+}
+
+void mc_print_alloc_blk_status(void)
+{
+    size_t total = 0;
+    char unit[3];
+    float val;
+
+    mc_log_print("metadata:\n");
+    total += __print_pool_status("alloc_memblk", alloc_memblk_pool_head, alloc_memblk_size);
+    total += __print_pool_status("free_memblk", free_memblk_pool_head, free_memblk_size);
+    total += __print_pool_status("report_memblk", report_memblk_pool_head, report_memblk_size);
+    total += __print_pool_status("callstack", callstack_pool_head, callstack_size);
+    total += __print_pool_status("pageregion", pageregion_pool_head, pageregion_size);
+    val = mc_change_unit(total, unit);
+    mc_log_print("  total        : %lu bytes (%.2f %s)\n", total, val, unit);
+}
@@ -1,4 +1,7 @@
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
 #include <pthread.h>
 #include <sys/mman.h>
 #include "memchk.h"
@@ -7,44 +10,176 @@
 #define ALLOC_LOCK() pthread_mutex_lock(&__mtx)
 #define ALLOC_UNLOCK() pthread_mutex_unlock(&__mtx)
 
+#define MAX_POOLS 8
+
+/*
+ * Each thread keeps a magazine of free slots per pool.  Allocation and free
+ * only touch the magazine; it is refilled from or flushed to the shared pools
+ * MAGAZINE_BATCH slots at a time under ALLOC_LOCK.  A slot freed by another
+ * thread than the one which allocated it simply goes to the freeing thread's
+ * magazine.
+ */
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+
+struct magazine {
+    int cnt;
+    void *slot[MAGAZINE_SIZE];
+};
+
+/* a batch of pages that has been entirely free for this long is unmapped */
+#define BATCH_RELEASE_DELAY_MS 1000
+
+/*
+ * Every pool page starts with this header followed by the slots.  The bitmap
+ * of free slots is sized to the number of slots that fit in the page.  Pages
+ * with at least one free slot are linked on the free pool list of their pool,
+ * so a free slot is found without looking at full pages.
+ */
 struct memblk_pool_header {
     int size;
     int num_memblk_in_pool;
     int num_free;
-    uint64_t seqno;
-    uint64_t bitmap[3];
-    struct memblk_pool_header *top;
-    struct memblk_pool_header *prev_pool_link, *next_pool_link;
-    struct memblk_pool_header *next_available_pool; /* only used in first pool header */
+    int num_empty_pages;    /* only used in the first page of a batch */
+    struct memblk_pool *pool;
+    struct memblk_pool_header *batch;   /* first page of the mmap()ed batch, NULL for the static first page */
+    struct memblk_pool_header *prev_free_pool, *next_free_pool;
+    /* only used in the first page of a batch */
+    uint64_t empty_since;
+    struct memblk_pool_header *prev_empty_batch, *next_empty_batch;
+    uint64_t bitmap[];
+};
+
+struct memblk_pool {
+    size_t memblk_size;
+    struct memblk_pool_header *free_pool_list;
+    /* batches with no slot in use, oldest first */
+    struct memblk_pool_header *empty_batch_head, *empty_batch_tail;
+    size_t num_pages;
+    size_t num_used;
+    size_t num_released_batches;
 };
 
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
 static pthread_mutex_t __mtx = PTHREAD_MUTEX_INITIALIZER;
 
-static void __init_header(struct memblk_pool_header *header, size_t memblk_size, struct memblk_pool_header **prev)
-{
-    header->size = __get_aligned_size(sizeof(struct memblk_pool_header), ALIGNMENT_SIZE);
-    header->num_memblk_in_pool = (PAGE_SIZE - header->size) / memblk_size;
-    header->num_free = header->num_memblk_in_pool;
-    header->bitmap[0] = (uint64_t)-1;
-    header->bitmap[1] = (uint64_t)-1;
-    header->bitmap[2] = (uint64_t)-1;
-
-    if (prev) {
-        header->top = (*prev)->top;
-        header->prev_pool_link = *prev;
-        header->next_pool_link = (*prev)->next_pool_link;
-        (*prev)->next_pool_link = header;
-        header->seqno = header->top->seqno++;
-    } else {
-        header->top = header;
-        header->prev_pool_link = NULL;
-        header->next_pool_link = NULL;
-        header->seqno = 0;
-    }
+static int __num_pools;
+static struct memblk_pool __pools[MAX_POOLS];
+
+static pthread_key_t __magazine_key;
+static pthread_once_t __magazine_key_once = PTHREAD_ONCE_INIT;
 
-    header->top->next_available_pool = header;
+static __thread struct magazine __magazines[MAX_POOLS] __attribute__((tls_model("initial-exec")));
+static __thread int __magazine_registered __attribute__((tls_model("initial-exec")));
 
-    dbg_print("%s: header = %p, memblk_size = %lu, prev = %p, *prev= %p, header size = %d, num_memblk_in_pool = %d\n", __func__, header, memblk_size, prev, prev ? *prev : NULL, header->size, header->num_memblk_in_pool);
+static uint64_t __get_msec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void __link_free_pool(struct memblk_pool_header *header)
+{
+    struct memblk_pool *pool = header->pool;
+
+    header->prev_free_pool = NULL;
+    header->next_free_pool = pool->free_pool_list;
+    if (pool->free_pool_list)
+        pool->free_pool_list->prev_free_pool = header;
+    pool->free_pool_list = header;
+}
+
+static void __unlink_free_pool(struct memblk_pool_header *header)
+{
+    struct memblk_pool *pool = header->pool;
+
+    if (header->prev_free_pool)
+        header->prev_free_pool->next_free_pool = header->next_free_pool;
+    else
+        pool->free_pool_list = header->next_free_pool;
+    if (header->next_free_pool)
+        header->next_free_pool->prev_free_pool = header->prev_free_pool;
+}
+
+static void __link_empty_batch(struct memblk_pool_header *batch)
+{
+    struct memblk_pool *pool = batch->pool;
+
+    batch->empty_since = __get_msec();
+    batch->next_empty_batch = NULL;
+    batch->prev_empty_batch = pool->empty_batch_tail;
+    if (pool->empty_batch_tail)
+        pool->empty_batch_tail->next_empty_batch = batch;
+    else
+        pool->empty_batch_head = batch;
+    pool->empty_batch_tail = batch;
+}
+
+static void __unlink_empty_batch(struct memblk_pool_header *batch)
+{
+    struct memblk_pool *pool = batch->pool;
+
+    if (batch->prev_empty_batch)
+        batch->prev_empty_batch->next_empty_batch = batch->next_empty_batch;
+    else
+        pool->empty_batch_head = batch->next_empty_batch;
+    if (batch->next_empty_batch)
+        batch->next_empty_batch->prev_empty_batch = batch->prev_empty_batch;
+    else
+        pool->empty_batch_tail = batch->prev_empty_batch;
+    batch->empty_since = 0;
+}
+
+/* must be called with ALLOC_LOCK held */
+static void __release_empty_batches(struct memblk_pool *pool)
+{
+    struct memblk_pool_header *batch;
+    uint64_t now;
+    int i;
+
+    if (!pool->empty_batch_head)
+        return;
+
+    now = __get_msec();
+    while ((batch = pool->empty_batch_head) && now - batch->empty_since >= BATCH_RELEASE_DELAY_MS) {
+        __unlink_empty_batch(batch);
+        for (i = 0; i < MMAP_BATCH_PAGE_NUM; i++)
+            __unlink_free_pool((struct memblk_pool_header *)((uint8_t *)batch + PAGE_SIZE * i));
+        munmap(batch, PAGE_SIZE * MMAP_BATCH_PAGE_NUM);
+        pool->num_pages -= MMAP_BATCH_PAGE_NUM;
+        pool->num_released_batches++;
+    }
+}
+
+static void __init_header(struct memblk_pool_header *header, struct memblk_pool *pool, struct memblk_pool_header *batch)
+{
+    size_t memblk_size = pool->memblk_size;
+    int num, i;
+
+    /* as many slots as fit together with their bitmap */
+    num = (PAGE_SIZE - sizeof(struct memblk_pool_header)) / memblk_size;
+    while (__get_aligned_size(sizeof(struct memblk_pool_header) + BITMAP_WORDS(num) * sizeof(uint64_t), ALIGNMENT_SIZE) + num * memblk_size > PAGE_SIZE)
+        num--;
+
+    header->size = __get_aligned_size(sizeof(struct memblk_pool_header) + BITMAP_WORDS(num) * sizeof(uint64_t), ALIGNMENT_SIZE);
+    header->num_memblk_in_pool = num;
+    header->num_free = num;
+    for (i = 0; i < BITMAP_WORDS(num); i++)
+        header->bitmap[i] = (uint64_t)-1;
+    if (num % 64)
+        header->bitmap[i - 1] = (1UL << (num % 64)) - 1;
+
+    header->pool = pool;
+    header->batch = batch;
+    header->num_empty_pages = MMAP_BATCH_PAGE_NUM;
+    header->empty_since = 0;
+    pool->num_pages++;
+    __link_free_pool(header);
+
+    dbg_print("%s: header = %p, memblk_size = %lu, batch = %p, header size = %d, num_memblk_in_pool = %d\n", __func__, header, memblk_size, header->batch, header->size, header->num_memblk_in_pool);
 }
 
 static int __get_index(struct memblk_pool_header *header, void *memblk, size_t memblk_size)
@@ -59,131 +194,209 @@ static void *__get_bufaddr(struct memblk_pool_header *header, int index, size_t
 
 static void __set_bitmap(struct memblk_pool_header *header, int index)
 {
-    if (index < sizeof(uint64_t) * 8)
-        header->bitmap[0] |= (1UL << index);
-    else if (index < sizeof(uint64_t) * 16)
-        header->bitmap[1] |= (1UL << (index - sizeof(uint64_t) * 8));
-    else
-        header->bitmap[2] |= (1UL << (index - sizeof(uint64_t) * 16));
+    header->bitmap[index / 64] |= (1UL << (index % 64));
 }
 
 static void __clear_bitmap(struct memblk_pool_header *header, int index)
 {
-    if (index < sizeof(uint64_t) * 8)
-        header->bitmap[0] &= ~(1UL << index);
-    else if (index < sizeof(uint64_t) * 16)
-        header->bitmap[1] &= ~(1UL << (index - sizeof(uint64_t) * 8));
-    else
-        header->bitmap[2] &= ~(1UL << (index - sizeof(uint64_t) * 16));
+    header->bitmap[index / 64] &= ~(1UL << (index % 64));
 }
 
 static int __get_lowest_bit(struct memblk_pool_header *header)
 {
-    int ret = __builtin_ffsl(header->bitmap[0]);
-
-    if (!ret) {
-        if (header->num_memblk_in_pool <= sizeof(uint64_t) * 8)
-            return -1;
-
-        ret = __builtin_ffsl(header->bitmap[1]);
-        if (!ret) {
-            if (header->num_memblk_in_pool <= sizeof(uint64_t) * 16)
-                return -1;
-
-            ret = __builtin_ffsl(header->bitmap[2]);
-            if (ret + sizeof(uint64_t) * 16 <= header->num_memblk_in_pool)
-                return ret + sizeof(uint64_t) * 16 - 1;
-            else
-                return -1;
-        } else {
-            if (ret + sizeof(uint64_t) * 8 <= header->num_memblk_in_pool)
-                return ret + sizeof(uint64_t) * 8 - 1;
-            else
-                return -1;
-        }
-    } else {
-        if (ret <= header->num_memblk_in_pool)
-            return ret - 1;
-        else
-            return -1;
-    }
-}
-
-void mc_allocator_init(void *buf, size_t memblk_size)
-{
-    struct memblk_pool_header *header = (struct memblk_pool_header *)buf;
+    int i;
 
-    __init_header(header, memblk_size, NULL);
+    for (i = 0; i < BITMAP_WORDS(header->num_memblk_in_pool); i++) {
+        if (header->bitmap[i])
+            return i * 64 + __builtin_ctzl(header->bitmap[i]);
+    }
+    return -1;
 }
 
-void *mc_allocator_alloc(void *buf, size_t memblk_size)
+/* must be called with ALLOC_LOCK held */
+static void *__alloc_slot(struct memblk_pool *pool)
 {
     int index;
     void *ret;
-    struct memblk_pool_header *top = (struct memblk_pool_header *)buf;
-    struct memblk_pool_header *header, *prev = NULL;
+    struct memblk_pool_header *header;
+    size_t memblk_size = pool->memblk_size;
+
+    header = pool->free_pool_list;
+    if (!header) {
+        header = (struct memblk_pool_header *)mmap(NULL, PAGE_SIZE * MMAP_BATCH_PAGE_NUM, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (header == (struct memblk_pool_header *)MAP_FAILED)
+            return NULL;
+
+        dbg_print("%s: new buffer %p is allocated\n", __func__, header);
+        for (int i = MMAP_BATCH_PAGE_NUM - 1; i >= 0; i--)
+            __init_header((struct memblk_pool_header *)((uint8_t *)header + PAGE_SIZE * i), pool, header);
+    }
 
-    ALLOC_LOCK();
+    /* the page and maybe its whole batch is no longer empty */
+    if (header->num_free == header->num_memblk_in_pool && header->batch) {
+        if (header->batch->num_empty_pages-- == MMAP_BATCH_PAGE_NUM && header->batch->empty_since)
+            __unlink_empty_batch(header->batch);
+    }
 
-    header = top->next_available_pool;
     index = __get_lowest_bit(header);
 
     dbg_print("%s: header = %p, index = %d\n", __func__, header, index);
 
-    if (index == -1) {
-        while (header && !header->num_free) {
-            prev = header;
-            header = header->next_pool_link;
-        }
-        if (!header) {
-            header = (struct memblk_pool_header *)mmap(NULL, PAGE_SIZE * MMAP_BATCH_PAGE_NUM, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-            if (header == (struct memblk_pool_header *)MAP_FAILED) {
-                ALLOC_UNLOCK();
-                return NULL;
-            }
-
-            dbg_print("%s: new buffer %p is allocated\n", __func__, header);
-            struct memblk_pool_header *tmp = header;
-            for (int i = 0; i < MMAP_BATCH_PAGE_NUM; i++) {
-                __init_header(tmp, memblk_size, &prev);
-                prev = tmp;
-                tmp = (struct memblk_pool_header *)((uint8_t *)tmp + PAGE_SIZE);
-            }
-        }
-        index = __get_lowest_bit(header);
-        top->next_available_pool = header;
-
-        dbg_print("%s: new header = %p, index = %d\n", __func__, header, index);
-    }
     ret = __get_bufaddr(header, index, memblk_size);
     __clear_bitmap(header, index);
-    header->num_free--;
+    if (!--header->num_free)
+        __unlink_free_pool(header);
+    pool->num_used++;
 
     dbg_print("%s: ret = %p, num_free = %d\n", __func__, ret, header->num_free);
 
-    ALLOC_UNLOCK();
-
     return ret;
 }
 
-void mc_allocator_free(void *buf, size_t memblk_size)
+/* must be called with ALLOC_LOCK held */
+static void __free_slot(void *buf)
 {
     int index;
     struct memblk_pool_header *header = (struct memblk_pool_header *)((uint64_t)buf & ~(PAGE_SIZE - 1));
-    struct memblk_pool_header *top = header->top;
+
+    index = __get_index(header, buf, header->pool->memblk_size);
+    __set_bitmap(header, index);
+    if (!header->num_free++)
+        __link_free_pool(header);
+    header->pool->num_used--;
+
+    if (header->num_free == header->num_memblk_in_pool && header->batch) {
+        if (++header->batch->num_empty_pages == MMAP_BATCH_PAGE_NUM)
+            __link_empty_batch(header->batch);
+    }
+
+    dbg_print("%s: buf = %p, header = %p, index = %d, batch = %p, num_free = %d\n", __func__, buf, header, index, header->batch, header->num_free);
+}
+
+/* return the oldest num slots of a magazine to the shared pool */
+static void __flush_magazine(struct magazine *mag, int num, struct memblk_pool *pool)
+{
+    int i;
+
+    if (num > mag->cnt)
+        num = mag->cnt;
 
     ALLOC_LOCK();
+    for (i = 0; i < num; i++)
+        __free_slot(mag->slot[i]);
+    __release_empty_batches(pool);
+    ALLOC_UNLOCK();
 
-    index = __get_index(header, buf, memblk_size);
-    __set_bitmap(header, index);
-    header->num_free++;
+    mag->cnt -= num;
+    memmove(mag->slot, mag->slot + num, sizeof(void *) * mag->cnt);
+}
+
+static int __refill_magazine(struct magazine *mag, struct memblk_pool *pool)
+{
+    void *slot;
+
+    ALLOC_LOCK();
+    __release_empty_batches(pool);
+    while (mag->cnt < MAGAZINE_BATCH) {
+        slot = __alloc_slot(pool);
+        if (!slot)
+            break;
+        mag->slot[mag->cnt++] = slot;
+    }
+    ALLOC_UNLOCK();
+
+    return mag->cnt ? 0 : -1;
+}
+
+/* thread exit: give the slots cached by the thread back to the shared pools */
+static void __release_magazines(void *data)
+{
+    int i;
+
+    __magazine_registered = 0;
+    for (i = 0; i < __num_pools; i++)
+        __flush_magazine(&__magazines[i], MAGAZINE_SIZE, &__pools[i]);
+}
+
+static void __create_magazine_key(void)
+{
+    pthread_key_create(&__magazine_key, __release_magazines);
+}
+
+static void __register_magazines(void)
+{
+    __magazine_registered = 1;
+
+    /* pthread_setspecific() may allocate */
+    mc_disable_hook();
+    pthread_once(&__magazine_key_once, __create_magazine_key);
+    pthread_setspecific(__magazine_key, __magazines);
+    mc_enable_hook();
+}
 
-    dbg_print("%s: buf = %p, header = %p, index = %d, top = %p, num_free = %d\n", __func__, buf, header, index, top, header->num_free);
+static int __get_pool_id(struct memblk_pool *pool)
+{
+    return pool - __pools;
+}
+
+/* buf is the static first page of the pool, which is never released */
+void mc_allocator_init(void *buf, size_t memblk_size)
+{
+    struct memblk_pool_header *header = (struct memblk_pool_header *)buf;
+    struct memblk_pool *pool;
+
+    assert(__num_pools < MAX_POOLS);
+    pool = &__pools[__num_pools++];
+    pool->memblk_size = memblk_size;
+    __init_header(header, pool, NULL);
+}
+
+void *mc_allocator_alloc(void *buf, size_t memblk_size)
+{
+    struct memblk_pool *pool = ((struct memblk_pool_header *)buf)->pool;
+    struct magazine *mag = &__magazines[__get_pool_id(pool)];
+
+    if (!__magazine_registered)
+        __register_magazines();
+
+    if (!mag->cnt && __refill_magazine(mag, pool))
+        return NULL;
+
+    return mag->slot[--mag->cnt];
+}
+
+void mc_allocator_free(void *buf, size_t memblk_size)
+{
+    struct memblk_pool_header *header = (struct memblk_pool_header *)((uint64_t)buf & ~(PAGE_SIZE - 1));
+    struct memblk_pool *pool = header->pool;
+    struct magazine *mag = &__magazines[__get_pool_id(pool)];
+
+    if (!__magazine_registered)
+        __register_magazines();
+
+    if (mag->cnt == MAGAZINE_SIZE)
+        __flush_magazine(mag, MAGAZINE_BATCH, pool);
 
-    if (header->num_free > top->next_available_pool->num_free)
-        top->next_available_pool = header;
+    mag->slot[mag->cnt++] = buf;
+}
 
-    dbg_print("%s: next_available_pool = %p\n", __func__, top->next_available_pool);
+/* called periodically so that batches are released even when the pools are idle */
+void mc_allocator_release_empty_batches(void)
+{
+    int i;
 
+    ALLOC_LOCK();
+    for (i = 0; i < __num_pools; i++)
+        __release_empty_batches(&__pools[i]);
     ALLOC_UNLOCK();
 }
+
+/* slots handed out (including the ones cached by threads) and pages mapped by a pool */
+void mc_allocator_get_status(void *buf, size_t *num_used, size_t *num_pages, size_t *num_released_batches)
+{
+    struct memblk_pool *pool = ((struct memblk_pool_header *)buf)->pool;
+
+    *num_used = pool->num_used;
+    *num_pages = pool->num_pages;
+    *num_released_batches = pool->num_released_batches;
+}
@@ -1,46 +1,279 @@
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include "memchk.h"
 
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Fill policy for big blocks.  Blocks larger than MEMCHK_FILL_THRESHOLD bytes
+ * (0: no limit) only get the first and last MEMCHK_FILL_EDGE bytes filled.
+ * Freed big blocks additionally get one cache line filled in every
+ * MEMCHK_FREED_FILL_STRIDE bytes (0: none), at an offset derived from the
+ * buffer address so that the check visits the same lines.
+ */
+static size_t __fill_threshold;
+static size_t __fill_edge = 4096;
+static size_t __freed_fill_stride = 4096;
+
+/*
+ * Pattern scanners: return the offset of the first byte in ptr[0..len) that
+ * differs from pattern, or len if there is none.  The vector versions compare
+ * a cache line per iteration and only locate the byte once a line differs.
+ */
+static size_t __find_mismatch_generic(const uint8_t *ptr, size_t len, uint8_t pattern)
+{
+    uint64_t word = 0x0101010101010101UL * pattern, val;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&val, ptr + i, 8);
+        if (val != word)
+            break;
+    }
+    for (; i < len; i++)
+        if (ptr[i] != pattern)
+            break;
+    return i;
+}
+
+#ifdef __x86_64__
+static size_t __find_mismatch_sse2(const uint8_t *ptr, size_t len, uint8_t pattern)
+{
+    __m128i pat = _mm_set1_epi8(pattern);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + i)), pat);
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + i + 16)), pat);
+        __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + i + 32)), pat);
+        __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + i + 48)), pat);
+
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3))) != 0xffff)
+            break;
+    }
+    for (; i + 16 <= len; i += 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(ptr + i)), pat));
+
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + __find_mismatch_generic(ptr + i, len - i, pattern);
+}
+
+static __attribute__((target("avx2"))) size_t __find_mismatch_avx2(const uint8_t *ptr, size_t len, uint8_t pattern)
+{
+    __m256i pat = _mm256_set1_epi8(pattern);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(ptr + i)), pat);
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(ptr + i + 32)), pat);
+
+        if ((unsigned int)_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)) != 0xffffffff)
+            break;
+    }
+    for (; i + 32 <= len; i += 32) {
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(ptr + i)), pat));
+
+        if (mask != 0xffffffff)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + __find_mismatch_generic(ptr + i, len - i, pattern);
+}
+
+static __attribute__((target("avx512f,avx512bw"))) size_t __find_mismatch_avx512(const uint8_t *ptr, size_t len, uint8_t pattern)
+{
+    __m512i pat = _mm512_set1_epi8(pattern);
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        uint64_t mask = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512((const void *)(ptr + i)), pat);
+
+        if (mask)
+            return i + __builtin_ctzl(mask);
+    }
+    if (i < len) {
+        __mmask64 tail = (1UL << (len - i)) - 1;
+        uint64_t mask = _mm512_mask_cmpneq_epi8_mask(tail, _mm512_maskz_loadu_epi8(tail, ptr + i), pat);
+
+        if (mask)
+            return i + __builtin_ctzl(mask);
+    }
+    return len;
+}
+#endif
+
+static size_t (*__find_mismatch)(const uint8_t *ptr, size_t len, uint8_t pattern) = __find_mismatch_generic;
+static const char *__scanner_name = "generic";
+
+static void __select_scanner(void)
+{
+    #ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        __find_mismatch = __find_mismatch_avx512;
+        __scanner_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        __find_mismatch = __find_mismatch_avx2;
+        __scanner_name = "avx2";
+    } else {
+        __find_mismatch = __find_mismatch_sse2;
+        __scanner_name = "sse2";
+    }
+    #endif
+}
+
+void mc_buffer_init(void)
+{
+    char *env;
+
+    if ((env = getenv("MEMCHK_FILL_THRESHOLD")))
+        __fill_threshold = strtoul(env, NULL, 0);
+    if ((env = getenv("MEMCHK_FILL_EDGE")))
+        __fill_edge = strtoul(env, NULL, 0);
+    if ((env = getenv("MEMCHK_FREED_FILL_STRIDE")))
+        __freed_fill_stride = strtoul(env, NULL, 0);
+    if (__freed_fill_stride && __freed_fill_stride < CACHE_LINE_SIZE)
+        __freed_fill_stride = CACHE_LINE_SIZE;
+
+    __select_scanner();
+    mc_log_print("buffer scanner = %s\n", __scanner_name);
+
+    if (__fill_threshold)
+        mc_log_print("fill above %lu bytes: %lu bytes at each end, 1 line per %lu bytes when freed\n",
+                     __fill_threshold, __fill_edge, __freed_fill_stride);
+}
+
+static int __is_partially_filled(size_t size)
+{
+    return __fill_threshold && size > __fill_threshold;
+}
+
+static void __fill_usrbuf(uint8_t *ptr, size_t size)
+{
+    if (!__is_partially_filled(size) || size <= __fill_edge * 2) {
+        memset(ptr, INITBUF_PATTERN, size);
+        return;
+    }
+    memset(ptr, INITBUF_PATTERN, __fill_edge);
+    memset(ptr + size - __fill_edge, INITBUF_PATTERN, __fill_edge);
+}
+
+/*
+ * idx-th range of a freed buffer that is filled: the leading edge, one
+ * cache line per stride, then the trailing edge.  Returns 0 past the end.
+ */
+static int __get_freed_range(uint8_t *buf, size_t bufsize, size_t idx, size_t *off, size_t *len)
+{
+    size_t edge = __fill_edge, start, end, nr_strides, line;
+
+    if (!__is_partially_filled(bufsize) || bufsize <= edge * 2) {
+        *off = 0;
+        *len = bufsize;
+        return idx == 0;
+    }
+
+    start = edge;
+    end = bufsize - edge;
+    nr_strides = __freed_fill_stride ? (end - start + __freed_fill_stride - 1) / __freed_fill_stride : 0;
+
+    if (idx == 0) {
+        *off = 0;
+        *len = edge;
+    } else if (idx <= nr_strides) {
+        start += (idx - 1) * __freed_fill_stride;
+        line = (((uintptr_t)buf ^ idx) * 0x9e3779b97f4a7c15UL) >> 32;
+        *off = start + (line % (__freed_fill_stride / CACHE_LINE_SIZE)) * CACHE_LINE_SIZE;
+        if (*off >= end)
+            *off = start;
+        *len = end - *off < CACHE_LINE_SIZE ? end - *off : CACHE_LINE_SIZE;
+    } else if (idx == nr_strides + 1) {
+        *off = end;
+        *len = edge;
+    } else
+        return 0;
+
+    return 1;
+}
+
 void mc_set_allocated_buffer(struct alloc_memblk *alloc_memblk, int init_usrptr)
 {
-    void *buf = alloc_memblk->memblk.buf;
+    void *buf = mc_memblk_buf(&alloc_memblk->memblk);
     void *usrptr = alloc_memblk->memblk.memptr.ptr;
-    size_t bufsize = alloc_memblk->memblk.bufsize;
-    size_t usrsize = alloc_memblk->memblk.usrsize;
+    size_t bufsize = mc_memblk_bufsize(&alloc_memblk->memblk);
+    size_t usrsize = mc_memblk_usrsize(&alloc_memblk->memblk);
     uint8_t *ptr = (uint8_t *)buf;
     size_t leading_redzone_size = (uint8_t *)usrptr - (uint8_t *)buf;
     size_t trailing_redzone_size = bufsize - leading_redzone_size - usrsize;
 
     memset(ptr, REDZONE_PATTERN, leading_redzone_size);
     if (init_usrptr)
-        memset(ptr + leading_redzone_size, INITBUF_PATTERN, usrsize);
+        __fill_usrbuf(ptr + leading_redzone_size, usrsize);
     memset(ptr + leading_redzone_size + usrsize, REDZONE_PATTERN, trailing_redzone_size);
 }
 
+/*
+ * Follows an in-place resize from old_usrsize: fills the part grown beyond
+ * it, or gives the part cut off back to the trailing red zone.  The rest
+ * of the trailing red zone is left as it is.
+ */
+void mc_resize_allocated_buffer(struct alloc_memblk *alloc_memblk, size_t old_usrsize)
+{
+    uint8_t *usrptr = (uint8_t *)alloc_memblk->memblk.memptr.ptr;
+    size_t usrsize = mc_memblk_usrsize(&alloc_memblk->memblk);
+
+    if (usrsize > old_usrsize)
+        __fill_usrbuf(usrptr + old_usrsize, usrsize - old_usrsize);
+    else
+        memset(usrptr + usrsize, REDZONE_PATTERN, old_usrsize - usrsize);
+}
+
+/*
+ * Checks a block about to be resized in place to usrsize: the leading red
+ * zone and the start of the trailing one, as far as it becomes user area
+ * but at least REDZONE_SIZE bytes.  The whole block is checked and reported
+ * only if these were overrun.
+ */
+int mc_check_resized_buffer(struct alloc_memblk *alloc_memblk, size_t usrsize)
+{
+    uint8_t *usrptr = (uint8_t *)alloc_memblk->memblk.memptr.ptr;
+    size_t old_usrsize = mc_memblk_usrsize(&alloc_memblk->memblk);
+    size_t lead = alloc_memblk->memblk.lead, tail = alloc_memblk->memblk.tail;
+    size_t len = usrsize > old_usrsize + REDZONE_SIZE ? usrsize - old_usrsize : REDZONE_SIZE;
+
+    if (len > tail)
+        len = tail;
+    if (__find_mismatch(usrptr - lead, lead, REDZONE_PATTERN) == lead &&
+        __find_mismatch(usrptr + old_usrsize, len, REDZONE_PATTERN) == len)
+        return 0;
+    return mc_check_allocated_buffer(alloc_memblk, 1);
+}
+
 int mc_check_allocated_buffer(struct alloc_memblk *alloc_memblk, int freeing_now)
 {
     int i, ret = 0;
-    void *buf = alloc_memblk->memblk.buf;
+    void *buf = mc_memblk_buf(&alloc_memblk->memblk);
     void *usrptr = alloc_memblk->memblk.memptr.ptr;
-    size_t bufsize = alloc_memblk->memblk.bufsize;
-    size_t usrsize = alloc_memblk->memblk.usrsize;
+    size_t bufsize = mc_memblk_bufsize(&alloc_memblk->memblk);
+    size_t usrsize = mc_memblk_usrsize(&alloc_memblk->memblk);
     uint8_t *ptr = (uint8_t *)buf;
     int leading_redzone_size = (uint8_t *)usrptr - (uint8_t *)buf;
     int trailing_redzone_size = bufsize - leading_redzone_size - usrsize;
     int underrun_error = 0, overrun_error = 0;
 
-    for (i = 0; i < leading_redzone_size; i++) {
-        if (ptr[i] != REDZONE_PATTERN) {
-            underrun_error = 1;
-            mc_log_print("\n-------------------------------------------------\n");
-            if (i == 0)
-                mc_log_print("UNDER-RUN at least %d bytes (%p:%lu)\n", leading_redzone_size, usrptr, usrsize);
-            else
-                mc_log_print("UNDER-RUN %d bytes (%p:%lu)\n", leading_redzone_size - i, usrptr, usrsize);
-            break;
-        }
+    i = __find_mismatch(ptr, leading_redzone_size, REDZONE_PATTERN);
+    if (i < leading_redzone_size) {
+        underrun_error = 1;
+        mc_log_print("\n-------------------------------------------------\n");
+        if (i == 0)
+            mc_log_print("UNDER-RUN at least %d bytes (%p:%lu)\n", leading_redzone_size, usrptr, usrsize);
+        else
+            mc_log_print("UNDER-RUN %d bytes (%p:%lu)\n", leading_redzone_size - i, usrptr, usrsize);
     }
     if (underrun_error) {
         mc_log_print("\nbuffer contents:\n");
@@ -49,7 +282,12 @@ int mc_check_allocated_buffer(struct alloc_memblk *alloc_memblk, int freeing_now
         mc_log_print("\n\n\n");
     }
 
-    for (i = trailing_redzone_size - 1; i >= 0; i--) {
+    /* the scan only tells whether the zone is intact, the report wants the last bad byte */
+    if (__find_mismatch(ptr + leading_redzone_size + usrsize, trailing_redzone_size, REDZONE_PATTERN) == trailing_redzone_size)
+        i = -1;
+    else
+        i = trailing_redzone_size - 1;
+    for (; i >= 0; i--) {
         if (ptr[leading_redzone_size + usrsize + i] != REDZONE_PATTERN) {
             overrun_error = 1;
             if (!underrun_error)
@@ -75,7 +313,7 @@ int mc_check_allocated_buffer(struct alloc_memblk *alloc_memblk, int freeing_now
         mc_enable_hook();
 
         mc_log_print("This memory block was allocated from:\n");
-        mc_print_callstack(alloc_memblk->allocator->depth, alloc_memblk->allocator->trace, 2);
+        mc_print_callstack_by_id(alloc_memblk->memblk.allocator_id, 2);
         if (freeing_now) {
             mc_log_print("\nand is being freed from:\n");
             mc_print_current_callstack(3);
@@ -94,52 +332,67 @@ int mc_check_allocated_buffer(struct alloc_memblk *alloc_memblk, int freeing_now
 
 void mc_set_freed_buffer(struct free_memblk *free_memblk)
 {
-    void *buf = free_memblk->memblk.buf;
-    size_t bufsize = free_memblk->memblk.bufsize;
-    memset(buf, FREEDBUF_PATTERN, bufsize);
+    uint8_t *buf = (uint8_t *)mc_memblk_buf(&free_memblk->memblk);
+    size_t bufsize = mc_memblk_bufsize(&free_memblk->memblk);
+    size_t idx, off, len;
+
+    if (free_memblk->memblk.flags & MEMBLK_GUARDED) {
+        mc_guard_protect(&free_memblk->memblk);
+        return;
+    }
+
+    for (idx = 0; __get_freed_range(buf, bufsize, idx, &off, &len); idx++)
+        memset(buf + off, FREEDBUF_PATTERN, len);
 }
 
 int mc_check_freed_buffer(struct free_memblk *free_memblk)
 {
-    int i, ret = 0;
-    void *buf = free_memblk->memblk.buf;
+    int ret = 0;
+    size_t i, idx, off, len;
+    void *buf = mc_memblk_buf(&free_memblk->memblk);
     void *usrptr = free_memblk->memblk.memptr.ptr;
-    size_t bufsize = free_memblk->memblk.bufsize;
-    size_t usrsize = free_memblk->memblk.usrsize;
+    size_t bufsize = mc_memblk_bufsize(&free_memblk->memblk);
+    size_t usrsize = mc_memblk_usrsize(&free_memblk->memblk);
     uint8_t *ptr = (uint8_t *)buf;
     int leading_redzone_size = (uint8_t *)usrptr - (uint8_t *)buf;
     int trailing_redzone_size = bufsize - leading_redzone_size - usrsize;
     struct timeval tv;
     struct tm tm;
 
-    for (i = 0; i < bufsize; i++) {
-        if (ptr[i] != FREEDBUF_PATTERN) {
-            mc_log_print("\n-------------------------------------------------\n");
-            mc_log_print("FREED area (%p:%ld) was write-accessed!!\n", usrptr, usrsize);
-            mc_disable_hook();
-            #ifdef ENABLE_CALLSTACK
-            mc_init_filemaps_from_procmap();
-            #endif
-            gettimeofday(&tv, NULL);
-            localtime_r(&tv.tv_sec, &tm);
-            mc_enable_hook();
-
-            mc_log_print(" current time = %d/%02d/%02d/%02d:%02d:%02d.%06d\n", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int)tv.tv_usec);
-            mc_log_print(" checked area = %d + %ld + %d bytes (leading red zone + user buffer + trailing red zone)\n", leading_redzone_size, usrsize, trailing_redzone_size);
-            mc_log_print(" write-access was detected at offset %d from the top of the leading red zone\n\n", i);
-            #ifdef ENABLE_CALLSTACK
-            mc_log_print("This memory block was allocated from:\n");
-            mc_print_callstack(free_memblk->allocator->depth, free_memblk->allocator->trace, 2);
-            mc_log_print("\nand freed from:\n");
-            mc_print_callstack(free_memblk->freer->depth, free_memblk->freer->trace, 2);
-
-            mc_disable_hook();
-            mc_term_filemaps();
-            mc_enable_hook();
-            #endif
-
-            ret = -1;
-            break;
+    /* not accessible, a write would have faulted */
+    if (free_memblk->memblk.flags & MEMBLK_GUARDED)
+        return 0;
+
+    for (idx = 0; !ret && __get_freed_range(ptr, bufsize, idx, &off, &len); idx++) {
+        for (i = off + __find_mismatch(ptr + off, len, FREEDBUF_PATTERN); i < off + len; i++) {
+            if (ptr[i] != FREEDBUF_PATTERN) {
+                mc_log_print("\n-------------------------------------------------\n");
+                mc_log_print("FREED area (%p:%ld) was write-accessed!!\n", usrptr, usrsize);
+                mc_disable_hook();
+                #ifdef ENABLE_CALLSTACK
+                mc_init_filemaps_from_procmap();
+                #endif
+                gettimeofday(&tv, NULL);
+                localtime_r(&tv.tv_sec, &tm);
+                mc_enable_hook();
+
+                mc_log_print(" current time = %d/%02d/%02d/%02d:%02d:%02d.%06d\n", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int)tv.tv_usec);
+                mc_log_print(" checked area = %d + %ld + %d bytes (leading red zone + user buffer + trailing red zone)\n", leading_redzone_size, usrsize, trailing_redzone_size);
+                mc_log_print(" write-access was detected at offset %lu from the top of the leading red zone\n\n", i);
+                #ifdef ENABLE_CALLSTACK
+                mc_log_print("This memory block was allocated from:\n");
+                mc_print_callstack_by_id(free_memblk->memblk.allocator_id, 2);
+                mc_log_print("\nand freed from:\n");
+                mc_print_callstack_by_id(free_memblk->freer_id, 2);
+
+                mc_disable_hook();
+                mc_term_filemaps();
+                mc_enable_hook();
+                #endif
+
+                ret = -1;
+                break;
+            }
         }
     }
 
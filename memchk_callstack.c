@@ -1,8 +1,9 @@
 #include <string.h>
 #include <pthread.h>
-#include <execinfo.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include "memchk.h"
+#include "memchk_alloc.h"
 #include "memchk_hashtable.h"
 
 #ifdef ENABLE_CALLSTACK
@@ -11,11 +12,156 @@ struct callstack *mc_callstack_hashtable[CALLSTACK_HASHTABLE_SIZE];
 #define CALLSTACK_LOCK() pthread_mutex_lock(&__mtx)
 #define CALLSTACK_UNLOCK() pthread_mutex_unlock(&__mtx)
 
+/*
+ * Blocks refer to their call stacks by a dense id.  The stack table maps
+ * an id to its callstack through chunks of STACK_TABLE_CHUNK entries that
+ * are mapped as ids are handed out.  An entry does not change while a
+ * block holds a reference to its callstack, so lookups take no lock.  The
+ * entries of reclaimed ids hold the next free id, tagged with bit 0.
+ */
+#define STACK_TABLE_CHUNK_BITS 12
+#define STACK_TABLE_CHUNK (1 << STACK_TABLE_CHUNK_BITS)
+#define STACK_TABLE_CHUNKS (1 << (STACK_ID_BITS - STACK_TABLE_CHUNK_BITS))
+
+/* callstack hashtable buckets scanned per lock while reclaiming */
+#define RECLAIM_BUCKETS 4096
+
 static pthread_mutex_t __mtx = PTHREAD_MUTEX_INITIALIZER;
 
+static struct callstack **__stack_table[STACK_TABLE_CHUNKS];
+static uint32_t __next_stack_id = 1;
+static uint32_t __free_stack_id;
+
+static size_t __num_callstacks, __num_retired, __num_reclaimed;
+static int __reclaim_pending;
+
+static struct callstack **__get_stack_table_entry(uint32_t id)
+{
+    struct callstack **chunk = __stack_table[(id >> STACK_TABLE_CHUNK_BITS) & (STACK_TABLE_CHUNKS - 1)];
+
+    return chunk ? &chunk[id & (STACK_TABLE_CHUNK - 1)] : NULL;
+}
+
+/* caller holds CALLSTACK_LOCK */
+static int __assign_stack_id(struct callstack *callstack)
+{
+    uint32_t id = __free_stack_id;
+    struct callstack ***chunk;
+    void *ret;
+
+    if (id) {
+        __free_stack_id = (uintptr_t)*__get_stack_table_entry(id) >> 1;
+    } else {
+        id = __next_stack_id;
+        if (id >> STACK_ID_BITS)
+            return -1;
+        chunk = &__stack_table[id >> STACK_TABLE_CHUNK_BITS];
+        if (!*chunk) {
+            ret = mmap(NULL, sizeof(struct callstack *) * STACK_TABLE_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ret == MAP_FAILED)
+                return -1;
+            *chunk = (struct callstack **)ret;
+        }
+        __next_stack_id++;
+    }
+
+    callstack->id = id;
+    __atomic_store_n(__get_stack_table_entry(id), callstack, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* caller holds CALLSTACK_LOCK */
+static void __release_stack_id(uint32_t id)
+{
+    __atomic_store_n(__get_stack_table_entry(id), (struct callstack *)(((uintptr_t)__free_stack_id << 1) | 1), __ATOMIC_RELEASE);
+    __free_stack_id = id;
+}
+
+struct callstack *mc_get_callstack_by_id(uint32_t id)
+{
+    struct callstack **entry = __get_stack_table_entry(id);
+    struct callstack *callstack;
+
+    if (!id || !entry)
+        return NULL;
+    callstack = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    return ((uintptr_t)callstack & 1) ? NULL : callstack;
+}
+
+/* takes another reference to a callstack the caller already holds one to */
+void mc_hold_callstack_id(uint32_t id)
+{
+    struct callstack *callstack = mc_get_callstack_by_id(id);
+
+    if (callstack)
+        __atomic_fetch_add(&callstack->usage, 1, __ATOMIC_RELAXED);
+}
+
+/* drops a reference; the callstack is reclaimed later by the work thread */
+void mc_put_callstack(struct callstack *callstack)
+{
+    if (callstack && __atomic_sub_fetch(&callstack->usage, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_fetch_add(&__num_retired, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&__reclaim_pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void mc_put_callstack_id(uint32_t id)
+{
+    mc_put_callstack(mc_get_callstack_by_id(id));
+}
+
+/*
+ * Frees the callstacks that no block refers to any more and puts their ids
+ * back for reuse.  Called by the work thread; the locks are taken for
+ * RECLAIM_BUCKETS buckets at a time.  A callstack only gets a reference
+ * from zero in mc_get_callstack(), under the same locks.
+ */
+void mc_reclaim_callstacks(void)
+{
+    struct callstack **prev, *callstack;
+    size_t i, end;
+
+    if (!__atomic_exchange_n(&__reclaim_pending, 0, __ATOMIC_ACQ_REL))
+        return;
+
+    for (i = 0; i < CALLSTACK_HASHTABLE_SIZE; i = end) {
+        end = i + RECLAIM_BUCKETS;
+
+        CALLSTACK_LOCK();
+        mc_lock_callstack_hashtable();
+        for (; i < end; i++) {
+            prev = &mc_callstack_hashtable[i];
+            while ((callstack = *prev)) {
+                if (__atomic_load_n(&callstack->usage, __ATOMIC_ACQUIRE)) {
+                    prev = &callstack->hash_next;
+                    continue;
+                }
+                *prev = callstack->hash_next;
+                __release_stack_id(callstack->id);
+                mc_free_callstack(callstack);
+                __num_callstacks--;
+                __num_reclaimed++;
+                __atomic_fetch_sub(&__num_retired, 1, __ATOMIC_RELAXED);
+            }
+        }
+        mc_unlock_callstack_hashtable();
+        CALLSTACK_UNLOCK();
+    }
+}
+
+void mc_print_callstack_status(void)
+{
+    size_t num_retired = __atomic_load_n(&__num_retired, __ATOMIC_RELAXED);
+
+    mc_log_print("callstacks: %lu live, %lu retired, %lu reclaimed\n", __num_callstacks - num_retired, num_retired, __num_reclaimed);
+}
+
 int mc_match_callstack(struct callstack *cs1, struct callstack *cs2)
 {
-    if (cs1->depth != cs2->depth)
+    if (cs1 == cs2)
+        return 0;
+    if (cs1->hash != cs2->hash || cs1->depth != cs2->depth)
         return -1;
 
     return memcmp(cs1->trace, cs2->trace, sizeof(void *) * cs1->depth);
@@ -26,14 +172,17 @@ struct callstack *mc_get_callstack(void)
     struct callstack callstack, *p_callstack;
 
     mc_disable_hook();
-    callstack.depth = backtrace(callstack.trace, MAX_CALLSTACK_DEPTH);
+    callstack.depth = mc_unwind(callstack.trace, MAX_CALLSTACK_DEPTH);
     mc_enable_hook();
+    callstack.hash = mc_calc_callstack_hash(callstack.trace, callstack.depth);
 
     CALLSTACK_LOCK();
 
     p_callstack = mc_find_callstack_hashtable(mc_callstack_hashtable, CALLSTACK_HASHTABLE_SIZE, &callstack);
     if (p_callstack) {
-        p_callstack->usage++;
+        /* revives a retired callstack that has not been reclaimed yet */
+        if (__atomic_fetch_add(&p_callstack->usage, 1, __ATOMIC_ACQ_REL) == 0)
+            __atomic_fetch_sub(&__num_retired, 1, __ATOMIC_RELAXED);
         CALLSTACK_UNLOCK();
         return p_callstack;
     }
@@ -43,69 +192,87 @@ struct callstack *mc_get_callstack(void)
         CALLSTACK_UNLOCK();
         return NULL;
     }
+    if (__assign_stack_id(p_callstack)) {
+        mc_free_callstack(p_callstack);
+        CALLSTACK_UNLOCK();
+        return NULL;
+    }
 
-    memcpy(p_callstack, &callstack, sizeof(struct callstack));
+    p_callstack->hash = callstack.hash;
+    p_callstack->depth = callstack.depth;
+    memcpy(p_callstack->trace, callstack.trace, sizeof(void *) * callstack.depth);
+    p_callstack->total_size = 0;
     p_callstack->usage = 1;
+    p_callstack->guard_site = 0;
     for (int i = 0; i < LINK_MAX; i++) {
         p_callstack->same_callstack_group_next[i] = NULL;
     }
     mc_add_callstack_hashtable(mc_callstack_hashtable, CALLSTACK_HASHTABLE_SIZE, p_callstack);
+    __num_callstacks++;
     CALLSTACK_UNLOCK();
 
     return p_callstack;
 }
 
-static void __link_memblk_to_callstack(struct alloc_memblk *alloc_memblk, struct alloc_memblk **callstack_same_callstack_group_next)
+static void __link_memblk_to_callstack(struct report_memblk *report_memblk, struct report_memblk **callstack_same_callstack_group_next)
 {
-    alloc_memblk->same_callstack_group_prev = NULL;
-    alloc_memblk->same_callstack_group_next = *callstack_same_callstack_group_next;
+    report_memblk->same_callstack_group_prev = NULL;
+    report_memblk->same_callstack_group_next = *callstack_same_callstack_group_next;
     if (*callstack_same_callstack_group_next)
-        (*callstack_same_callstack_group_next)->same_callstack_group_prev = alloc_memblk;
-    *callstack_same_callstack_group_next = alloc_memblk;
+        (*callstack_same_callstack_group_next)->same_callstack_group_prev = report_memblk;
+    *callstack_same_callstack_group_next = report_memblk;
 }
 
-void mc_link_memblk_to_callstack(struct alloc_memblk *alloc_memblk, struct callstack *callstack, int link_index)
+void mc_link_memblk_to_callstack(struct report_memblk *report_memblk, struct callstack *callstack, int link_index)
 {
     assert(link_index >= 0 && link_index < LINK_MAX);
 
     CALLSTACK_LOCK();
-    __link_memblk_to_callstack(alloc_memblk, &callstack->same_callstack_group_next[link_index]);
+    __link_memblk_to_callstack(report_memblk, &callstack->same_callstack_group_next[link_index]);
     CALLSTACK_UNLOCK();
 }
 
-static void __unlink_memblk_from_callstack(struct alloc_memblk *alloc_memblk, struct alloc_memblk **callstack_same_callstack_group_next)
+static void __unlink_memblk_from_callstack(struct report_memblk *report_memblk, struct report_memblk **callstack_same_callstack_group_next)
 {
-    if (alloc_memblk->same_callstack_group_prev == NULL) {
-        *callstack_same_callstack_group_next = alloc_memblk->same_callstack_group_next;
-        if (alloc_memblk->same_callstack_group_next)
-            alloc_memblk->same_callstack_group_next->same_callstack_group_prev = NULL;
+    if (report_memblk->same_callstack_group_prev == NULL) {
+        *callstack_same_callstack_group_next = report_memblk->same_callstack_group_next;
+        if (report_memblk->same_callstack_group_next)
+            report_memblk->same_callstack_group_next->same_callstack_group_prev = NULL;
     } else {
-        alloc_memblk->same_callstack_group_prev->same_callstack_group_next = alloc_memblk->same_callstack_group_next;
-        if (alloc_memblk->same_callstack_group_next)
-            alloc_memblk->same_callstack_group_next->same_callstack_group_prev = alloc_memblk->same_callstack_group_prev;
+        report_memblk->same_callstack_group_prev->same_callstack_group_next = report_memblk->same_callstack_group_next;
+        if (report_memblk->same_callstack_group_next)
+            report_memblk->same_callstack_group_next->same_callstack_group_prev = report_memblk->same_callstack_group_prev;
     }
 }
 
-void mc_unlink_memblk_from_callstack(struct alloc_memblk *alloc_memblk, struct callstack *callstack, int link_index)
+void mc_unlink_memblk_from_callstack(struct report_memblk *report_memblk, struct callstack *callstack, int link_index)
 {
     assert(link_index >= 0 && link_index < LINK_MAX);
 
     CALLSTACK_LOCK();
-    __unlink_memblk_from_callstack(alloc_memblk, &callstack->same_callstack_group_next[link_index]);
+    __unlink_memblk_from_callstack(report_memblk, &callstack->same_callstack_group_next[link_index]);
     CALLSTACK_UNLOCK();
 }
 
-void mc_link_same_callstack_group(struct memptr *hashtable[], size_t size, int link_index)
+/* hashtable must hold report_memblk copies */
+void mc_link_same_callstack_group(struct ptr_hashtable *hashtable, int link_index)
 {
     struct memptr *memptr;
-    struct alloc_memblk *alloc_memblk;
+    struct report_memblk *report_memblk;
+    struct callstack *callstack;
 
     assert(link_index >= 0 && link_index < LINK_MAX);
 
-    for_each_hashnode(memptr, hashtable, size) {
-        alloc_memblk = get_alloc_memblk_from_memptr(memptr);
-        mc_link_memblk_to_callstack(alloc_memblk, alloc_memblk->allocator, link_index);
+    mc_lock_ptr_hashtable(hashtable);
+
+    for_each_ptr_hashnode(memptr, hashtable) {
+        report_memblk = get_report_memblk_from_memptr(memptr);
+        callstack = mc_get_callstack_by_id(report_memblk->alloc_memblk.memblk.allocator_id);
+        if (callstack)
+            mc_link_memblk_to_callstack(report_memblk, callstack, link_index);
     }
+
+    mc_unlock_ptr_hashtable(hashtable);
 }
 
 void mc_reset_same_callstack_group(struct callstack *hashtable[], size_t size, int link_index)
@@ -123,44 +290,104 @@ void mc_reset_same_callstack_group(struct callstack *hashtable[], size_t size, i
     mc_unlock_callstack_hashtable();
 }
 
+/* resolve the frames of the callstacks to be printed from frame from up front */
+void mc_resolve_callstack_symbols(struct callstack *callstack_array[], int num, int from)
+{
+    size_t size = __get_aligned_size((size_t)num * MAX_CALLSTACK_DEPTH * sizeof(void *), PAGE_SIZE), n = 0;
+    void **addrs;
+    int i, j;
+
+    if (mc_is_offline_symbol() || num <= 0)
+        return;
+
+    addrs = (void **)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addrs == MAP_FAILED)
+        return;
+
+    for (i = 0; i < num; i++) {
+        for (j = from; j < callstack_array[i]->depth; j++)
+            addrs[n++] = callstack_array[i]->trace[j];
+    }
+    mc_resolve_symbols(addrs, n);
+
+    munmap(addrs, size);
+}
+
 void mc_print_callstack(int depth, void *trace[], int from)
 {
-    int i, j, num_inline;
-    off_t offset;
-    char filemapname[MAX_FILEMAPNAME_LEN];
-    struct funcsymbol funcsymbol[10];
+    int i, j;
+    const struct symcache_entry *entry;
+    struct filemap *filemap;
+
+    if (mc_is_offline_symbol()) {
+        for (i = from; i < depth; i++) {
+            filemap = mc_find_filemap(trace[i]);
+            if (filemap)
+                mc_log_print("#PC %p %s+%lx\n", trace[i], filemap->name, (off_t)(trace[i] - filemap->start_addr) + filemap->file_offset);
+            else
+                mc_log_print("#PC %p\n", trace[i]);
+        }
+        return;
+    }
 
     for (i = from; i < depth; i++) {
         mc_disable_hook();
-        num_inline = mc_get_symbol(trace[i], 1, filemapname, MAX_FILEMAPNAME_LEN, &offset, funcsymbol, sizeof(funcsymbol) / sizeof(funcsymbol[0]));
+        entry = mc_lookup_symbol(trace[i]);
         mc_enable_hook();
 
-        if (num_inline < 0)
+        if (!entry)
+            mc_log_print("UNKNOWN SYMBOL [%p]\n", trace[i]);
+        else if (!entry->filemapname)
             mc_log_print("UNKNOWN FILE\n");
+        else if (!entry->num_inline)
+            mc_log_print("UNKNOWN SYMBOL [%p (%lx)]\n", trace[i], entry->offset);
         else {
-            if (!num_inline)
-                mc_log_print("UNKNOWN SYMBOL [%p (%lx)]\n", trace[i], offset);
-            else {
-                mc_log_print("%s @ %s [%p (%lx)]\n", funcsymbol[0].funcname, filemapname, trace[i], offset);
-                for (j = 0; j < num_inline; j++) {
-                    if (funcsymbol[j].srcfilename[0] && funcsymbol[j].line)
-                        mc_log_print("  |- %s in %s:%d\n", funcsymbol[j].funcname, funcsymbol[j].srcfilename, funcsymbol[j].line);
-                }
+            mc_log_print("%s @ %s [%p (%lx)]\n", entry->frame[0].funcname, entry->filemapname, trace[i], entry->offset);
+            for (j = 0; j < entry->num_inline; j++) {
+                if (entry->frame[j].srcfilename[0] && entry->frame[j].line)
+                    mc_log_print("  |- %s in %s:%d\n", entry->frame[j].funcname, entry->frame[j].srcfilename, entry->frame[j].line);
             }
         }
     }
 }
 
+void mc_print_callstack_by_id(uint32_t id, int from)
+{
+    struct callstack *callstack = mc_get_callstack_by_id(id);
+
+    if (callstack)
+        mc_print_callstack(callstack->depth, callstack->trace, from);
+    else
+        mc_log_print("NO CALLSTACK\n");
+}
+
 void mc_print_current_callstack(int from)
 {
     int depth;
     void *trace[MAX_CALLSTACK_DEPTH];
 
     mc_disable_hook();
-    depth = backtrace(trace, MAX_CALLSTACK_DEPTH);
+    depth = mc_unwind(trace, MAX_CALLSTACK_DEPTH);
     mc_enable_hook();
 
     mc_print_callstack(depth, trace, from);
 }
 
+/* prints the stack of the frame that took a signal at pc, not the handler's */
+void mc_print_signal_callstack(void *pc)
+{
+    int depth;
+    void *trace[MAX_CALLSTACK_DEPTH];
+
+    mc_disable_hook();
+    depth = mc_unwind_signal(trace, MAX_CALLSTACK_DEPTH, pc);
+    mc_enable_hook();
+
+    /* otherwise skip this function, the fault handler and the signal trampoline */
+    if (depth)
+        mc_print_callstack(depth, trace, 0);
+    else
+        mc_print_current_callstack(5);
+}
+
 #endif
@@ -106,6 +106,11 @@ int get_virtual_memory_status(int pid)
     return send_signal(pid, SIGRTMIN + 9);
 }
 
+int get_hashtable_status(int pid)
+{
+    return send_signal(pid, SIGRTMIN + 10);
+}
+
 void auto_update_settings(void)
 {
     FILE *fp;
@@ -142,7 +147,7 @@ void remove_all_logs(void)
 
 void print_usage(void)
 {
-    printf("memcheck -[a|A|b|c|C|d|g|p|m|M|s|u|l]\n");
+    printf("memcheck -[a|A|b|c|C|d|g|p|m|M|s|t|u|l]\n");
     printf("          a [pid]: get All memblk\n");
     printf("          A [pid]: get All memblk per callstack group\n");
     printf("          b [pid]: check all memBlk\n");
@@ -154,6 +159,7 @@ void print_usage(void)
     printf("          m [pid]: get status\n");
     printf("          M [pid]: get virtual memory status\n");
     printf("          s [pid]: create Snapshot\n");
+    printf("          t [pid]: get hashTable status\n");
     printf("          u: Update target\n");
     printf("          l: remove all logs\n");
 }
@@ -161,7 +167,7 @@ void print_usage(void)
 int main(int argc, char *argv[])
 {
     int c, pid;
-    const char *optstring = "a:A:b:s:c:C:p:m:M:uhlg:";
+    const char *optstring = "a:A:b:s:c:C:p:m:M:uhlg:t:";
 
     opterr = 0;
 
@@ -227,6 +233,10 @@ int main(int argc, char *argv[])
             pid = atoi(optarg);
             get_histogram_memblk(pid);
             break;
+        case 't':
+            pid = atoi(optarg);
+            get_hashtable_status(pid);
+            break;
         default:
             pid = get_settings();
             if (pid == -1)
@@ -262,6 +272,9 @@ int main(int argc, char *argv[])
             case 'g':
                 get_histogram_memblk(pid);
                 break;
+            case 't':
+                get_hashtable_status(pid);
+                break;
             default:
                 break;
             }
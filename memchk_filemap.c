@@ -1,4 +1,9 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
+#include <string.h>
+#include <link.h>
 #include <pthread.h>
 #include <sys/mman.h>
 #include "memchk.h"
@@ -7,189 +12,398 @@
 #define FILEMAP_LOCK() pthread_mutex_lock(&__mtx)
 #define FILEMAP_UNLOCK() pthread_mutex_unlock(&__mtx)
 
+/*
+ * The table of executable mappings outlives a report.  It is reloaded from
+ * /proc/self/maps only when the dynamic loader reports that objects were
+ * loaded or unloaded, and only while no report is using it.  Modules that
+ * survive a reload keep their BFD handle and symbol table, so reports on a
+ * stable process neither re-read the maps nor reopen any object.
+ */
 static struct filemap *__filemap;
 static int __cnt, __usage_cnt;
 static size_t __size;
+static unsigned long long __generation;
+static int __last_hit;
 
 static pthread_mutex_t __mtx = PTHREAD_MUTEX_INITIALIZER;
 
-static int __alloc_filemaps(void)
+static int __alloc_filemaps(struct filemap **filemap, int cnt, size_t *size)
 {
-    __size = __get_aligned_size(sizeof(struct filemap) * __cnt, PAGE_SIZE);
-    __filemap = (struct filemap *)mmap(NULL, __size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (__filemap == (struct filemap *)MAP_FAILED)
+    *size = __get_aligned_size(sizeof(struct filemap) * (cnt ? cnt : 1), PAGE_SIZE);
+    *filemap = (struct filemap *)mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (*filemap == (struct filemap *)MAP_FAILED)
         return -1;
     else
         return 0;
 }
 
-static void __add_filemap(int idx, void *start_addr, void *end_addr, off_t offset, char *name)
+static void __add_filemap(struct filemap *filemap, void *start_addr, void *end_addr, off_t offset, char *name)
 {
-    __filemap[idx].start_addr = start_addr;
-    __filemap[idx].end_addr = end_addr;
-    __filemap[idx].file_offset = offset;
-    strncpy(__filemap[idx].name, name, MAX_FILEMAPNAME_LEN - 1);
-    __filemap[idx].abfd = NULL;
-    __filemap[idx].symbols = NULL;
+    filemap->start_addr = start_addr;
+    filemap->end_addr = end_addr;
+    filemap->file_offset = offset;
+    strncpy(filemap->name, name, MAX_FILEMAPNAME_LEN - 1);
+    filemap->load_base = NULL;
+    filemap->build_id[0] = 0;
+    #ifdef ENABLE_BFD
+    filemap->abfd = NULL;
+    filemap->symbols = NULL;
+    filemap->no_symbols = 0;
+    #endif
+}
+
+#ifdef ENABLE_BFD
+static void __term_bfd_filemap(struct filemap *filemap);
+#endif
+
+static int __search_filemap(struct filemap *filemap, int cnt, void *addr)
+{
+    int lo = 0, hi = cnt - 1, mid;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (addr < filemap[mid].start_addr)
+            hi = mid - 1;
+        else if (addr >= filemap[mid].end_addr)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return -1;
+}
+
+/* hand the BFD state of modules that are still mapped over to the new table */
+static void __replace_filemaps(struct filemap *filemap, int cnt, size_t size)
+{
+    #ifdef ENABLE_BFD
+    int i, j;
+
+    for (i = 0; i < cnt; i++) {
+        j = __search_filemap(__filemap, __cnt, filemap[i].start_addr);
+        if (j >= 0 && (__filemap[j].abfd || __filemap[j].no_symbols) && __filemap[j].start_addr == filemap[i].start_addr &&
+            __filemap[j].end_addr == filemap[i].end_addr && __filemap[j].file_offset == filemap[i].file_offset &&
+            !strcmp(__filemap[j].name, filemap[i].name)) {
+            filemap[i].abfd = __filemap[j].abfd;
+            filemap[i].symbols = __filemap[j].symbols;
+            filemap[i].no_symbols = __filemap[j].no_symbols;
+            __filemap[j].abfd = NULL;
+            __filemap[j].symbols = NULL;
+        }
+    }
+
+    if (__filemap) {
+        for (j = 0; j < __cnt; j++)
+            __term_bfd_filemap(&__filemap[j]);
+    }
+    #endif
+
+    if (__filemap)
+        munmap(__filemap, __size);
+
+    mc_flush_symbol_cache();
+
+    __filemap = filemap;
+    __cnt = cnt;
+    __size = size;
+    __last_hit = 0;
 }
 
 static int __init_filemaps(FILE *fp)
 {
-    int i = 0;
+    int i = 0, cnt = 0;
     char buf[1024], tmp[512], caddr[40], cperm[8], coffset[10], cfile[512];
     uint64_t start_addr, end_addr;
     off_t offset;
+    struct filemap *filemap, tmpmap;
+    size_t size;
+    int j, k;
 
-    if (__usage_cnt) {
-        __usage_cnt++;
-        return 0;
-    }
-
-     __cnt = 0;
-     while (fgets(buf, sizeof(buf), fp)) {
+    while (fgets(buf, sizeof(buf), fp)) {
         sscanf(buf, "%s %s %s", caddr, cperm, tmp);
         if (cperm[2] == 'x')
-            __cnt++;
+            cnt++;
     };
 
-    if (__alloc_filemaps() < 0)
+    if (__alloc_filemaps(&filemap, cnt, &size) < 0)
         return - 1;
 
     rewind(fp);
-    while (fgets(buf, sizeof(buf), fp)) {
-        sscanf(buf, "%s %s %s %s %s %s", caddr, cperm, coffset, tmp, tmp, cfile);
+    while (fgets(buf, sizeof(buf), fp) && i < cnt) {
+        if (sscanf(buf, "%s %s %s %s %s %s", caddr, cperm, coffset, tmp, tmp, cfile) < 6)
+            cfile[0] = 0;
         if (cperm[2] == 'x') {
             sscanf(caddr, "%lx-%lx", &start_addr, &end_addr);
             sscanf(coffset, "%lx", &offset);
-            __add_filemap(i++, (void *)start_addr, (void *)end_addr, offset, cfile);
+            __add_filemap(&filemap[i++], (void *)start_addr, (void *)end_addr, offset, cfile);
         }
     };
 
-    __usage_cnt++;
+    /* the kernel lists mappings in address order, a maps file may not */
+    for (j = 1; j < i; j++) {
+        tmpmap = filemap[j];
+        for (k = j; k > 0 && filemap[k - 1].start_addr > tmpmap.start_addr; k--)
+            filemap[k] = filemap[k - 1];
+        filemap[k] = tmpmap;
+    }
+
+    __replace_filemaps(filemap, i, size);
 
     return 0;
 }
 
-static int __init_bfd_filemap(int i)
+static int __count_loaded_objects(struct dl_phdr_info *info, size_t size, void *data)
+{
+    unsigned long long *generation = (unsigned long long *)data;
+
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+        *generation = info->dlpi_adds + info->dlpi_subs;
+    return 1;
+}
+
+static void __get_build_id(struct dl_phdr_info *info, char *build_id)
+{
+    const ElfW(Phdr) *phdr;
+    const ElfW(Nhdr) *nhdr;
+    const uint8_t *note, *end, *desc;
+    size_t i, len;
+
+    for (phdr = info->dlpi_phdr; phdr < info->dlpi_phdr + info->dlpi_phnum; phdr++) {
+        if (phdr->p_type != PT_NOTE)
+            continue;
+        note = (const uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+        end = note + phdr->p_memsz;
+        while (note + sizeof(*nhdr) <= end) {
+            nhdr = (const ElfW(Nhdr) *)note;
+            desc = note + sizeof(*nhdr) + __get_aligned_size(nhdr->n_namesz, 4);
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && !memcmp(note + sizeof(*nhdr), "GNU", 4)) {
+                len = nhdr->n_descsz < MAX_BUILD_ID_LEN ? nhdr->n_descsz : MAX_BUILD_ID_LEN;
+                for (i = 0; i < len; i++)
+                    sprintf(build_id + i * 2, "%02x", desc[i]);
+                return;
+            }
+            note = desc + __get_aligned_size(nhdr->n_descsz, 4);
+        }
+    }
+}
+
+/* fill in the load base and build-id of the mappings of a loaded object */
+static int __identify_loaded_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+    const ElfW(Phdr) *phdr;
+    char build_id[MAX_BUILD_ID_LEN * 2 + 1] = "";
+    void *start, *end;
+    int i;
+
+    __get_build_id(info, build_id);
+
+    for (phdr = info->dlpi_phdr; phdr < info->dlpi_phdr + info->dlpi_phnum; phdr++) {
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X))
+            continue;
+        start = (void *)((info->dlpi_addr + phdr->p_vaddr) & ~(PAGE_SIZE - 1));
+        end = (void *)(info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz);
+        for (i = __search_filemap(__filemap, __cnt, start); i >= 0 && i < __cnt && __filemap[i].start_addr < end; i++) {
+            __filemap[i].load_base = (void *)info->dlpi_addr;
+            strcpy(__filemap[i].build_id, build_id);
+        }
+    }
+    return 0;
+}
+
+/*
+ * In offline mode reports carry raw return addresses, and the module map
+ * needed to resolve them is logged whenever it changes.
+ */
+static void __print_filemaps(void)
+{
+    int i;
+
+    mc_log_print("#MODULES %d\n", __cnt);
+    for (i = 0; i < __cnt; i++) {
+        if (__filemap[i].load_base || __filemap[i].build_id[0])
+            mc_log_print("#MODULE %p-%p %lx 0x%lx %s %s\n", __filemap[i].start_addr, __filemap[i].end_addr, __filemap[i].file_offset,
+                         (unsigned long)__filemap[i].load_base, __filemap[i].build_id[0] ? __filemap[i].build_id : "-", __filemap[i].name);
+        else
+            mc_log_print("#MODULE %p-%p %lx - - %s\n", __filemap[i].start_addr, __filemap[i].end_addr, __filemap[i].file_offset,
+                         __filemap[i].name);
+    }
+}
+
+/* changes whenever an object is loaded or unloaded, 0 if unknown */
+static unsigned long long __get_generation(void)
+{
+    unsigned long long generation = 0;
+
+    dl_iterate_phdr(__count_loaded_objects, &generation);
+    return generation;
+}
+
+#ifdef ENABLE_BFD
+/*
+ * Opens name and loads its symbol table.  A BFD may only be used by one
+ * thread at a time, so threads resolving in parallel open their own.
+ */
+int mc_open_bfd(const char *name, bfd **abfd, asymbol ***symbols)
 {
     long storage, num_sym;
     bool dynamic = FALSE;
 
-    __filemap[i].abfd = bfd_openr(__filemap[i].name, NULL);
-    __filemap[i].abfd->flags |= BFD_DECOMPRESS;
-    bfd_check_format(__filemap[i].abfd, bfd_object);
+    *symbols = NULL;
+    *abfd = bfd_openr(name, NULL);
+    if (!*abfd)
+        return -1;
+    (*abfd)->flags |= BFD_DECOMPRESS;
+    bfd_check_format(*abfd, bfd_object);
 
-    storage = bfd_get_symtab_upper_bound(__filemap[i].abfd);
+    storage = bfd_get_symtab_upper_bound(*abfd);
     if (storage == 0) {
-        storage = bfd_get_dynamic_symtab_upper_bound(__filemap[i].abfd);
+        storage = bfd_get_dynamic_symtab_upper_bound(*abfd);
         dynamic = TRUE;
     }
     if (storage < 0)
-        return -1;
+        goto err;
 
-    __filemap[i].symbols = (asymbol **)mc_orig_malloc(storage);
-    if (!__filemap[i].symbols)
-        return -1;
+    *symbols = (asymbol **)mc_orig_malloc(storage);
+    if (!*symbols)
+        goto err;
 
     if (dynamic)
-        num_sym = bfd_canonicalize_dynamic_symtab(__filemap[i].abfd, __filemap[i].symbols);
+        num_sym = bfd_canonicalize_dynamic_symtab(*abfd, *symbols);
     else
-        num_sym = bfd_canonicalize_symtab(__filemap[i].abfd, __filemap[i].symbols);
+        num_sym = bfd_canonicalize_symtab(*abfd, *symbols);
 
-    if (num_sym < 0) {
-        mc_orig_free(__filemap[i].symbols);
-        return -1;
-    }
+    if (num_sym < 0)
+        goto err;
 
-    if (num_sym == 0 && !dynamic && (storage = bfd_get_dynamic_symtab_upper_bound(__filemap[i].abfd)) > 0) {
-        mc_orig_free(__filemap[i].symbols);
-        __filemap[i].symbols = mc_orig_malloc(storage);
-        num_sym = bfd_canonicalize_dynamic_symtab(__filemap[i].abfd, __filemap[i].symbols);
+    if (num_sym == 0 && !dynamic && (storage = bfd_get_dynamic_symtab_upper_bound(*abfd)) > 0) {
+        mc_orig_free(*symbols);
+        *symbols = mc_orig_malloc(storage);
+        if (!*symbols)
+            goto err;
+        num_sym = bfd_canonicalize_dynamic_symtab(*abfd, *symbols);
     }
     return 0;
+
+err:
+    mc_close_bfd(*abfd, *symbols);
+    *abfd = NULL;
+    *symbols = NULL;
+    return -1;
 }
 
-static void __term_bfd_filemap(int i)
+void mc_close_bfd(bfd *abfd, asymbol **symbols)
 {
-    if (__filemap[i].abfd) {
-        bfd_close(__filemap[i].abfd);
-        __filemap[i].abfd = NULL;
-    }
+    if (abfd)
+        bfd_close(abfd);
+    if (symbols)
+        mc_orig_free(symbols);
+}
 
-    if (__filemap[i].symbols) {
-        mc_orig_free(__filemap[i].symbols);
-        __filemap[i].symbols = NULL;
-    }
+static void __term_bfd_filemap(struct filemap *filemap)
+{
+    mc_close_bfd(filemap->abfd, filemap->symbols);
+    filemap->abfd = NULL;
+    filemap->symbols = NULL;
 }
+#endif
 
 int mc_init_filemaps_from_file(char *file)
 {
-    int ret;
-    FILE *fp = fopen(file, "r");
+    int ret = 0;
+    FILE *fp;
 
     FILEMAP_LOCK();
-    ret = __init_filemaps(fp);
+    if (!__usage_cnt) {
+        if ((fp = fopen(file, "r"))) {
+            ret = __init_filemaps(fp);
+            fclose(fp);
+        } else
+            ret = -1;
+        __generation = 0;
+    }
+    __usage_cnt++;
     FILEMAP_UNLOCK();
-    fclose(fp);
 
     return ret;
 }
 
 int mc_init_filemaps_from_procmap(void)
 {
-    int ret;
-    FILE *fp = fopen("/proc/self/maps", "r");
+    int ret = 0;
+    unsigned long long generation = __get_generation();
+    FILE *fp;
 
     FILEMAP_LOCK();
-    ret = __init_filemaps(fp);
+    if (!__usage_cnt && (!__filemap || !generation || generation != __generation)) {
+        if ((fp = fopen("/proc/self/maps", "r"))) {
+            ret = __init_filemaps(fp);
+            fclose(fp);
+        } else
+            ret = -1;
+        __generation = ret ? 0 : generation;
+        if (!ret) {
+            dl_iterate_phdr(__identify_loaded_object, NULL);
+            if (mc_is_offline_symbol())
+                __print_filemaps();
+        }
+    }
+    __usage_cnt++;
     FILEMAP_UNLOCK();
-    fclose(fp);
 
     return ret;
 }
 
+/* the table and the open BFDs are kept for the next report */
 void mc_term_filemaps(void)
 {
-    int i;
-
     FILEMAP_LOCK();
-    __usage_cnt--;
-    if (!__usage_cnt) {
-        for (i = 0; i < __cnt; i++)
-            __term_bfd_filemap(i);
-        munmap(__filemap, __size);
-    }
+    if (__usage_cnt && !--__usage_cnt)
+        mc_release_symbol_cache();
     FILEMAP_UNLOCK();
 }
 
+/*
+ * The table is sorted by start address.  Consecutive frames mostly fall
+ * into the same module, so the last hit is tried before the binary search.
+ */
+static int __lookup_filemap(void *addr)
+{
+    int i = __atomic_load_n(&__last_hit, __ATOMIC_RELAXED);
+
+    if (i < __cnt && __filemap[i].start_addr <= addr && addr < __filemap[i].end_addr)
+        return i;
+
+    i = __search_filemap(__filemap, __cnt, addr);
+    if (i >= 0)
+        __atomic_store_n(&__last_hit, i, __ATOMIC_RELAXED);
+    return i;
+}
+
+#ifdef ENABLE_BFD
 struct filemap *mc_find_and_init_bfd_filemap(void *addr)
 {
-    int i;
+    int i = __lookup_filemap(addr);
 
-    for (i = 0; i < __cnt; i++) {
-        if (__filemap[i].start_addr <= addr && addr < __filemap[i].end_addr) {
-            //FILEMAP_LOCK();
-            if (!__filemap[i].abfd) {
-                if (__init_bfd_filemap(i) < 0) {
-                    //FILEMAP_UNLOCK();
-                    return NULL;
-                }
-            }
-            //FILEMAP_UNLOCK();
-            return &__filemap[i];
-        }
-    }
+    if (i < 0)
+        return NULL;
 
-    return NULL;
+    FILEMAP_LOCK();
+    if (!__filemap[i].abfd && !__filemap[i].no_symbols) {
+        /* do not retry the open on every frame */
+        if (mc_open_bfd(__filemap[i].name, &__filemap[i].abfd, &__filemap[i].symbols) < 0)
+            __filemap[i].no_symbols = 1;
+    }
+    if (__filemap[i].no_symbols) {
+        FILEMAP_UNLOCK();
+        return NULL;
+    }
+    FILEMAP_UNLOCK();
+    return &__filemap[i];
 }
+#endif
 
 struct filemap *mc_find_filemap(void *addr)
 {
-    int i;
+    int i = __lookup_filemap(addr);
 
-    for (i = 0; i < __cnt; i++) {
-        if (__filemap[i].start_addr <= addr && addr < __filemap[i].end_addr)
-            return &__filemap[i];
-    }
-    return NULL;
+    return i < 0 ? NULL : &__filemap[i];
 }
@@ -0,0 +1,551 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "memchk.h"
+
+/*
+ * Guard page mode.  Blocks whose size is within MEMCHK_GUARD_SIZE
+ * ("<min>-<max>", "<min>-" or "<size>") and, if MEMCHK_GUARD_SITE is set,
+ * whose allocation callstack has one of its sites get pages of their own,
+ * placed so that the block ends right before a PROT_NONE guard page.
+ * Freed guarded blocks are made PROT_NONE as a whole while quarantined.
+ * A SIGSEGV handler reports accesses to either of them.
+ *
+ * A site is an exported function name ("foo") or a return address as shown
+ * in the reports ("libfoo.so:0x1234").
+ *
+ * Blocks are aligned to MEMCHK_GUARD_ALIGNMENT bytes (default 16), so up to
+ * alignment - 1 bytes between the end of a block and the guard page are only
+ * covered by the red zone check.  1 catches every overrun at the cost of
+ * unaligned blocks.
+ *
+ * Sampled pool mode (MEMCHK_GWP_RATE=<n>), for always-on use.  One
+ * allocation in n on average goes to a page-sized slot of a fixed pool of
+ * MEMCHK_GWP_SLOTS slots, each between two guard pages; every other
+ * allocation goes to the original allocator without any bookkeeping.  A
+ * block is put at the start or at the end of its slot at random, to catch
+ * underruns or overruns.  Freed
+ * slots stay PROT_NONE in the quarantine, which holds half of the slots by
+ * default, and return to the pool when evicted.
+ *
+ * Every page of a guarded block, guard page included, is entered in a
+ * page index that is read without locking, and every GWP slot remembers
+ * its block, so that the SIGSEGV handler finds the block of a faulting
+ * address without taking any lock.  Writers to the index are serialized,
+ * so that runs of deleted entries ending at an empty one can be emptied
+ * and lookups of missing pages stay short.
+ */
+#define MAX_GUARD_SITES 16
+#define MAX_GUARD_SITE_LEN 128
+#define DEFAULT_GUARD_ALIGNMENT 16
+#define DEFAULT_GWP_SLOTS 256
+
+#define GUARD_INDEX_BITS 20
+#define GUARD_INDEX_SIZE (1UL << GUARD_INDEX_BITS)
+#define GUARD_INDEX_EMPTY 0
+#define GUARD_INDEX_DELETED 1
+
+#define GWP_LOCK() pthread_mutex_lock(&__gwp_mtx)
+#define GWP_UNLOCK() pthread_mutex_unlock(&__gwp_mtx)
+#define GUARD_INDEX_LOCK() pthread_mutex_lock(&__guard_index_mtx)
+#define GUARD_INDEX_UNLOCK() pthread_mutex_unlock(&__guard_index_mtx)
+
+struct guard_site {
+    char name[MAX_GUARD_SITE_LEN];
+    unsigned long offset;       /* 0 for a function name */
+};
+
+static int __guarding;
+static size_t __min_size, __max_size = SIZE_MAX;
+static size_t __alignment = DEFAULT_GUARD_ALIGNMENT;
+static struct guard_site __sites[MAX_GUARD_SITES];
+static int __num_sites;
+
+/* open addressing; usrptr is NULL while an entry is being filled or emptied */
+struct guard_index_entry {
+    uintptr_t page;
+    void *usrptr;
+};
+
+static size_t __num_guarded, __num_guarded_pages, __num_faults;
+static struct guard_index_entry *__guard_index;
+static pthread_mutex_t __guard_index_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction __old_segv_action;
+
+/* slot i is the page at __gwp_pool + (2 * i + 1) * PAGE_SIZE */
+size_t mc_gwp_rate;
+__thread long mc_gwp_countdown __attribute__((tls_model("initial-exec")));
+static uint8_t *__gwp_pool, *__gwp_pool_end;
+static size_t __gwp_num_slots;
+static size_t *__gwp_free_slots;    /* stack of free slot numbers */
+static void **__gwp_slot_usrptrs;   /* block of each slot, NULL if free */
+static size_t __gwp_num_free_slots;
+static size_t __gwp_num_sampled, __gwp_num_skipped;
+static pthread_mutex_t __gwp_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread int __gwp_started __attribute__((tls_model("initial-exec")));
+
+static void __parse_sites(char *env)
+{
+    char *save, *tok, *colon;
+
+    for (tok = strtok_r(env, ",", &save); tok && __num_sites < MAX_GUARD_SITES; tok = strtok_r(NULL, ",", &save)) {
+        struct guard_site *site = &__sites[__num_sites++];
+
+        colon = strrchr(tok, ':');
+        if (colon) {
+            *colon = 0;
+            site->offset = strtoul(colon + 1, NULL, 16);
+        }
+        strncpy(site->name, tok, MAX_GUARD_SITE_LEN - 1);
+    }
+}
+
+static int __is_write_fault(void *ctx)
+{
+    #ifdef __x86_64__
+    return (((ucontext_t *)ctx)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+    #else
+    return -1;
+    #endif
+}
+
+static void *__get_fault_pc(void *ctx)
+{
+    #ifdef __x86_64__
+    return (void *)((ucontext_t *)ctx)->uc_mcontext.gregs[REG_RIP];
+    #else
+    return NULL;
+    #endif
+}
+
+static void __segv_handler(int sig, siginfo_t *si, void *ctx)
+{
+    if (!mc_report_guard_fault(si->si_addr, __is_write_fault(ctx), __get_fault_pc(ctx)))
+        __num_faults++;
+    mc_flush_log_print();
+
+    /* the access faults again and gets the previous disposition */
+    sigaction(SIGSEGV, &__old_segv_action, NULL);
+}
+
+static void __gwp_init(void)
+{
+    char *env = getenv("MEMCHK_GWP_RATE");
+    size_t pool_size, i;
+
+    if (!env || !(mc_gwp_rate = strtoul(env, NULL, 0)))
+        return;
+
+    __gwp_num_slots = DEFAULT_GWP_SLOTS;
+    if ((env = getenv("MEMCHK_GWP_SLOTS")) && strtoul(env, NULL, 0))
+        __gwp_num_slots = strtoul(env, NULL, 0);
+
+    pool_size = (__gwp_num_slots * 2 + 1) * PAGE_SIZE;
+    __gwp_pool = mmap(NULL, pool_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    __gwp_free_slots = mmap(NULL, __gwp_num_slots * sizeof(size_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    __gwp_slot_usrptrs = mmap(NULL, __gwp_num_slots * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (__gwp_pool == MAP_FAILED || __gwp_free_slots == MAP_FAILED || __gwp_slot_usrptrs == MAP_FAILED) {
+        mc_log_print("gwp: failed to map a pool of %lu slots\n", __gwp_num_slots);
+        mc_gwp_rate = 0;
+        return;
+    }
+    __gwp_pool_end = __gwp_pool + pool_size;
+
+    /* lowest slots first */
+    for (i = 0; i < __gwp_num_slots; i++)
+        __gwp_free_slots[i] = __gwp_num_slots - 1 - i;
+    __gwp_num_free_slots = __gwp_num_slots;
+}
+
+void mc_guard_init(void)
+{
+    struct sigaction sa;
+    char *env, *dash;
+
+    __gwp_init();
+    if (mc_gwp_rate)
+        __guarding = 1;
+
+    if (!mc_gwp_rate && (env = getenv("MEMCHK_GUARD_SIZE"))) {
+        __guarding = 1;
+        __min_size = strtoul(env, &dash, 0);
+        if (*dash != '-')
+            __max_size = __min_size;
+        else if (dash[1])
+            __max_size = strtoul(dash + 1, NULL, 0);
+    }
+    if (!mc_gwp_rate && (env = getenv("MEMCHK_GUARD_SITE"))) {
+        __guarding = 1;
+        mc_disable_hook();
+        env = strdup(env);
+        mc_enable_hook();
+        if (env)
+            __parse_sites(env);
+    }
+    if (!__guarding)
+        return;
+    if ((env = getenv("MEMCHK_GUARD_ALIGNMENT")))
+        __alignment = strtoul(env, NULL, 0);
+    if (!__alignment || (__alignment & (__alignment - 1)))
+        __alignment = DEFAULT_GUARD_ALIGNMENT;
+
+    if (!mc_gwp_rate) {
+        __guard_index = mmap(NULL, GUARD_INDEX_SIZE * sizeof(struct guard_index_entry), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (__guard_index == MAP_FAILED) {
+            mc_log_print("guard pages: failed to map the page index\n");
+            __guard_index = NULL;
+            __guarding = 0;
+            return;
+        }
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = __segv_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &__old_segv_action);
+
+    if (mc_gwp_rate) {
+        mc_log_print("gwp: 1 in %lu allocations to %lu guarded slots aligned to %lu\n", mc_gwp_rate, __gwp_num_slots, __alignment);
+        return;
+    }
+
+    mc_log_print("guard pages for blocks of %lu - %lu bytes aligned to %lu", __min_size, __max_size, __alignment);
+    for (int i = 0; i < __num_sites; i++) {
+        if (__sites[i].offset)
+            mc_log_print("%s %s:0x%lx", i ? "," : " from", __sites[i].name, __sites[i].offset);
+        else
+            mc_log_print("%s %s", i ? "," : " from", __sites[i].name);
+    }
+    mc_log_print("\n");
+}
+
+static size_t __hash_page(uintptr_t page)
+{
+    return (page / PAGE_SIZE * 0x9e3779b97f4a7c15UL) >> (64 - GUARD_INDEX_BITS);
+}
+
+/* called with GUARD_INDEX_LOCK() held */
+static int __index_page(uintptr_t page, void *usrptr)
+{
+    struct guard_index_entry *entry;
+    uintptr_t old;
+    size_t i, n;
+
+    for (i = __hash_page(page), n = 0; n < GUARD_INDEX_SIZE; i = (i + 1) & (GUARD_INDEX_SIZE - 1), n++) {
+        entry = &__guard_index[i];
+        old = __atomic_load_n(&entry->page, __ATOMIC_RELAXED);
+        if (old != GUARD_INDEX_EMPTY && old != GUARD_INDEX_DELETED)
+            continue;
+        __atomic_store_n(&entry->page, page, __ATOMIC_RELEASE);
+        __atomic_store_n(&entry->usrptr, usrptr, __ATOMIC_RELEASE);
+        return 0;
+    }
+    return -1;
+}
+
+static struct guard_index_entry *__find_page(uintptr_t page)
+{
+    struct guard_index_entry *entry;
+    uintptr_t cur;
+    size_t i, n;
+
+    for (i = __hash_page(page), n = 0; n < GUARD_INDEX_SIZE; i = (i + 1) & (GUARD_INDEX_SIZE - 1), n++) {
+        entry = &__guard_index[i];
+        cur = __atomic_load_n(&entry->page, __ATOMIC_ACQUIRE);
+        if (cur == GUARD_INDEX_EMPTY)
+            break;
+        if (cur == page)
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+ * Called with GUARD_INDEX_LOCK() held.  No probe chain goes past an empty
+ * entry, so the deleted entries right before one are emptied as well.
+ */
+static void __unindex_pages(uint8_t *buf, size_t num_pages)
+{
+    struct guard_index_entry *entry;
+    size_t j;
+
+    for (size_t i = 0; i < num_pages; i++) {
+        entry = __find_page((uintptr_t)buf + i * PAGE_SIZE);
+        if (!entry)
+            continue;
+        __atomic_store_n(&entry->usrptr, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&entry->page, GUARD_INDEX_DELETED, __ATOMIC_RELEASE);
+
+        j = entry - __guard_index;
+        if (__atomic_load_n(&__guard_index[(j + 1) & (GUARD_INDEX_SIZE - 1)].page, __ATOMIC_RELAXED) != GUARD_INDEX_EMPTY)
+            continue;
+        while (__atomic_load_n(&__guard_index[j].page, __ATOMIC_RELAXED) == GUARD_INDEX_DELETED) {
+            __atomic_store_n(&__guard_index[j].page, GUARD_INDEX_EMPTY, __ATOMIC_RELEASE);
+            j = (j - 1) & (GUARD_INDEX_SIZE - 1);
+        }
+    }
+}
+
+static void *__gwp_slot_usrptr(size_t slot_num)
+{
+    return slot_num < __gwp_num_slots ? __atomic_load_n(&__gwp_slot_usrptrs[slot_num], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/* a guard page between two slots goes to the block placed against it */
+static void *__gwp_find(uint8_t *addr)
+{
+    size_t page_num = (addr - __gwp_pool) / PAGE_SIZE;
+    uint8_t *below, *above;
+
+    if (page_num & 1)
+        return __gwp_slot_usrptr(page_num / 2);
+
+    below = page_num ? __gwp_slot_usrptr(page_num / 2 - 1) : NULL;
+    above = __gwp_slot_usrptr(page_num / 2);
+    if (below && below != __gwp_pool + (page_num - 1) * PAGE_SIZE)
+        return below;
+    if (above && above == __gwp_pool + (page_num + 1) * PAGE_SIZE)
+        return above;
+    return below ? below : above;
+}
+
+/*
+ * Called from the SIGSEGV handler without any lock.  Returns the user
+ * pointer of the guarded block whose pages, or the page right after them,
+ * hold addr, or NULL.
+ */
+void *mc_guard_find(void *addr)
+{
+    uintptr_t page = (uintptr_t)addr & ~(PAGE_SIZE - 1);
+    struct guard_index_entry *entry;
+
+    if (mc_gwp_owns(addr))
+        return __gwp_find(addr);
+    if (!__guard_index)
+        return NULL;
+    /* an underrun faults in the page before the block's pages */
+    if (!(entry = __find_page(page)) && !(entry = __find_page(page + PAGE_SIZE)))
+        return NULL;
+    return __atomic_load_n(&entry->usrptr, __ATOMIC_ACQUIRE);
+}
+
+#ifdef ENABLE_CALLSTACK
+static int __match_site(struct callstack *callstack)
+{
+    Dl_info info;
+    const char *base;
+    int found;
+
+    for (int i = 0; i < callstack->depth; i++) {
+        mc_disable_hook();
+        found = dladdr(callstack->trace[i], &info);
+        mc_enable_hook();
+        if (!found)
+            continue;
+
+        base = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+        base = base ? base + 1 : info.dli_fname;
+        for (int j = 0; j < __num_sites; j++) {
+            struct guard_site *site = &__sites[j];
+
+            if (site->offset) {
+                if (base && !strcmp(base, site->name) && (unsigned long)callstack->trace[i] - (unsigned long)info.dli_fbase == site->offset)
+                    return 1;
+            } else if (info.dli_sname && !strcmp(info.dli_sname, site->name))
+                return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Returns 1 if a block of size bytes is to be guarded.  The allocation
+ * callstack may be captured on the way; it is returned in *allocator so
+ * that it is not captured again.
+ */
+int mc_guard_select(size_t size, struct callstack **allocator)
+{
+    if (mc_gwp_rate || !__guarding || size < __min_size || size > __max_size)
+        return 0;
+    if (!__num_sites)
+        return 1;
+
+    #ifdef ENABLE_CALLSTACK
+    *allocator = mc_get_callstack();
+    if (!*allocator)
+        return 0;
+    /* decided once per callstack */
+    if (!(*allocator)->guard_site)
+        (*allocator)->guard_site = __match_site(*allocator) ? 1 : -1;
+    return (*allocator)->guard_site > 0;
+    #else
+    return 0;
+    #endif
+}
+
+void *mc_guard_alloc(size_t size, size_t alignment, int flags, struct callstack *allocator)
+{
+    size_t num_pages, bufsize;
+    uint8_t *buf, *guard, *usrptr;
+
+    if (alignment < __alignment)
+        alignment = __alignment;
+    if (size > SIZE_MAX - alignment - PAGE_SIZE * 2)
+        return NULL;
+
+    num_pages = (size + alignment - 1 + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (!num_pages)
+        num_pages = 1;
+    bufsize = num_pages * PAGE_SIZE;
+
+    buf = mmap(NULL, bufsize + PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    guard = buf + bufsize;
+    if (mprotect(guard, PAGE_SIZE, PROT_NONE)) {
+        munmap(buf, bufsize + PAGE_SIZE);
+        return NULL;
+    }
+
+    usrptr = (uint8_t *)((uintptr_t)(guard - size) & ~(alignment - 1));
+    GUARD_INDEX_LOCK();
+    for (size_t i = 0; i <= num_pages; i++) {
+        if (__index_page((uintptr_t)buf + i * PAGE_SIZE, usrptr)) {
+            __unindex_pages(buf, i);
+            GUARD_INDEX_UNLOCK();
+            munmap(buf, bufsize + PAGE_SIZE);
+            return NULL;
+        }
+    }
+    GUARD_INDEX_UNLOCK();
+    if (mc_register_memblk(buf, usrptr, bufsize, size, flags | MEMBLK_GUARDED, allocator)) {
+        GUARD_INDEX_LOCK();
+        __unindex_pages(buf, num_pages + 1);
+        GUARD_INDEX_UNLOCK();
+        munmap(buf, bufsize + PAGE_SIZE);
+        return NULL;
+    }
+
+    __atomic_fetch_add(&__num_guarded, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&__num_guarded_pages, num_pages + 1, __ATOMIC_RELAXED);
+
+    return usrptr;
+}
+
+/*
+ * Called when mc_gwp_countdown runs out.  Returns NULL if the allocation
+ * does not fit in a slot or all slots are in use; the caller then uses the
+ * original allocator.
+ */
+void *mc_gwp_alloc(size_t size, size_t alignment, int flags)
+{
+    uint8_t *slot, *usrptr;
+    size_t slot_num;
+    uint64_t rnd = mc_sample_random();
+
+    /* uniform in [1, 2 * rate] */
+    mc_gwp_countdown = rnd % (mc_gwp_rate * 2) + 1;
+    /* the countdown of a new thread starts at 0; its first allocation is not a sample */
+    if (!__gwp_started) {
+        __gwp_started = 1;
+        return NULL;
+    }
+
+    if (alignment < __alignment)
+        alignment = __alignment;
+    if (size > PAGE_SIZE || alignment > PAGE_SIZE)
+        return NULL;
+
+    GWP_LOCK();
+    if (!__gwp_num_free_slots) {
+        __gwp_num_skipped++;
+        GWP_UNLOCK();
+        return NULL;
+    }
+    slot_num = __gwp_free_slots[--__gwp_num_free_slots];
+    __gwp_num_sampled++;
+    GWP_UNLOCK();
+
+    slot = __gwp_pool + (slot_num * 2 + 1) * PAGE_SIZE;
+    mprotect(slot, PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+    /* released slots are zero-filled again by MADV_DONTNEED; an empty block at the end would point at the guard page */
+    if (!size || ((rnd >> 32) & 1))
+        usrptr = slot;
+    else
+        usrptr = (uint8_t *)((uintptr_t)(slot + PAGE_SIZE - size) & ~(alignment - 1));
+    __atomic_store_n(&__gwp_slot_usrptrs[slot_num], usrptr, __ATOMIC_RELEASE);
+    if (mc_register_memblk(slot, usrptr, PAGE_SIZE, size, flags | MEMBLK_GUARDED | MEMBLK_GWP, NULL)) {
+        mc_guard_release(&(struct memblk){ .memptr.ptr = slot, .tail = PAGE_SIZE, .flags = MEMBLK_GWP });
+        return NULL;
+    }
+
+    return usrptr;
+}
+
+int mc_gwp_owns(void *ptr)
+{
+    return (uint8_t *)ptr >= __gwp_pool && (uint8_t *)ptr < __gwp_pool_end;
+}
+
+size_t mc_gwp_get_num_slots(void)
+{
+    return __gwp_num_slots;
+}
+
+/* makes a freed guarded block inaccessible while it is quarantined */
+void mc_guard_protect(struct memblk *memblk)
+{
+    mprotect(mc_memblk_buf(memblk), mc_memblk_bufsize(memblk), PROT_NONE);
+}
+
+void mc_guard_release(struct memblk *memblk)
+{
+    uint8_t *buf = (uint8_t *)mc_memblk_buf(memblk);
+    size_t bufsize = mc_memblk_bufsize(memblk);
+    size_t slot_num;
+
+    if (memblk->flags & MEMBLK_GWP) {
+        mprotect(buf, PAGE_SIZE, PROT_NONE);
+        madvise(buf, PAGE_SIZE, MADV_DONTNEED);
+        slot_num = (buf - __gwp_pool) / PAGE_SIZE / 2;
+        __atomic_store_n(&__gwp_slot_usrptrs[slot_num], NULL, __ATOMIC_RELEASE);
+
+        GWP_LOCK();
+        __gwp_free_slots[__gwp_num_free_slots++] = slot_num;
+        GWP_UNLOCK();
+        return;
+    }
+
+    /* before unmapping, so that a new mapping at the same address does not lose its entries */
+    GUARD_INDEX_LOCK();
+    __unindex_pages(buf, bufsize / PAGE_SIZE + 1);
+    GUARD_INDEX_UNLOCK();
+    munmap(buf, bufsize + PAGE_SIZE);
+
+    __atomic_fetch_sub(&__num_guarded, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&__num_guarded_pages, bufsize / PAGE_SIZE + 1, __ATOMIC_RELAXED);
+}
+
+void mc_print_guard_status(void)
+{
+    if (mc_gwp_rate) {
+        mc_log_print("gwp: %lu of %lu slots in use or quarantined, %lu sampled, %lu skipped with no free slot, %lu faults caught\n",
+                     __gwp_num_slots - __gwp_num_free_slots, __gwp_num_slots, __gwp_num_sampled, __gwp_num_skipped, __num_faults);
+        return;
+    }
+    if (!__guarding)
+        return;
+    mc_log_print("guarded blocks: %lu (%lu pages including freed ones), %lu faults caught\n", __num_guarded, __num_guarded_pages, __num_faults);
+}
@@ -4,41 +4,195 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include "memchk.h"
+#include "memchk_hashtable.h"
 
-#define PTR_HASHTABLE_LOCK()   pthread_mutex_lock(&__ptr_mtx);
-#define PTR_HASHTABLE_UNLOCK() pthread_mutex_unlock(&__ptr_mtx);
+#define PTR_HASHTABLE_LOCK(shard)   pthread_mutex_lock(&(shard)->mtx)
+#define PTR_HASHTABLE_UNLOCK(shard) pthread_mutex_unlock(&(shard)->mtx)
 
 #define CALLSTACK_HASHTABLE_LOCK()   pthread_mutex_lock(&__callstack_mtx);
 #define CALLSTACK_HASHTABLE_UNLOCK() pthread_mutex_unlock(&__callstack_mtx);
 
-static pthread_mutex_t __ptr_mtx = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 static pthread_mutex_t __callstack_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-static int __calc_ptr_hash(void *ptr, size_t size)
+/*
+ * Fibonacci hashing: multiplying by 2^64 / phi spreads the aligned and
+ * clustered heap pointers over the upper bits of the product.  The top
+ * PTR_HASHTABLE_SHARD_BITS bits select the shard and the bits right below
+ * them select the bucket, so no division is needed.
+ */
+static uint64_t __mix_ptr(void *ptr)
 {
-    return (uint64_t)ptr % size;
+    return (uint64_t)ptr * 0x9e3779b97f4a7c15UL;
 }
 
-static int __calc_callstack_hash(struct callstack *callstack, size_t size)
+static size_t __calc_ptr_hash(void *ptr, size_t size)
+{
+    return (__mix_ptr(ptr) << PTR_HASHTABLE_SHARD_BITS) >> (64 - __builtin_ctzl(size));
+}
+
+static struct ptr_hashtable_shard *__get_ptr_shard(struct ptr_hashtable *hashtable, void *ptr)
+{
+    struct ptr_hashtable_shard *shard = &hashtable->shard[__mix_ptr(ptr) >> (64 - PTR_HASHTABLE_SHARD_BITS)];
+
+    PTR_HASHTABLE_LOCK(shard);
+    if (!shard->table[0]) {
+        shard->table[0] = shard->init_table;
+        shard->size[0] = PTR_HASHTABLE_INIT_SIZE;
+    }
+    return shard;
+}
+
+static size_t __get_ptr_table_bytes(size_t size)
+{
+    return (sizeof(struct memptr *) * size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static struct memptr **__alloc_ptr_table(size_t size)
+{
+    void *ret = mmap(NULL, __get_ptr_table_bytes(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ret == MAP_FAILED)
+        return NULL;
+    return (struct memptr **)ret;
+}
+
+static void __free_ptr_table(struct ptr_hashtable_shard *shard, struct memptr **table, size_t size)
+{
+    if (table != shard->init_table)
+        munmap(table, __get_ptr_table_bytes(size));
+}
+
+static void __rehash_ptr_shard(struct ptr_hashtable_shard *shard)
+{
+    int moved = 0, empty_visits = PTR_HASHTABLE_REHASH_STEP * 10;
+    struct memptr *node, *next;
+    size_t hash;
+
+    if (!shard->table[1] || shard->paused)
+        return;
+
+    while (moved < PTR_HASHTABLE_REHASH_STEP && shard->rehash_idx < shard->size[0]) {
+        node = shard->table[0][shard->rehash_idx];
+        if (!node) {
+            shard->rehash_idx++;
+            if (--empty_visits == 0)
+                break;
+            continue;
+        }
+        while (node) {
+            next = node->hash_next;
+            hash = __calc_ptr_hash(node->ptr, shard->size[1]);
+            node->hash_next = shard->table[1][hash];
+            shard->table[1][hash] = node;
+            node = next;
+        }
+        shard->table[0][shard->rehash_idx++] = NULL;
+        moved++;
+    }
+
+    if (shard->rehash_idx == shard->size[0]) {
+        __free_ptr_table(shard, shard->table[0], shard->size[0]);
+        shard->table[0] = shard->table[1];
+        shard->size[0] = shard->size[1];
+        shard->table[1] = NULL;
+        shard->size[1] = 0;
+        shard->rehash_idx = 0;
+    }
+}
+
+static void __expand_ptr_shard(struct ptr_hashtable_shard *shard)
+{
+    struct memptr **table;
+    size_t size;
+
+    if (shard->table[1] || shard->paused || shard->cnt <= shard->size[0])
+        return;
+    if (shard->size[0] >= PTR_HASHTABLE_MAX_SIZE)
+        return;
+
+    /* the first allocated array fills a whole page */
+    size = shard->size[0] * 2;
+    if (size < PAGE_SIZE / sizeof(struct memptr *))
+        size = PAGE_SIZE / sizeof(struct memptr *);
+    table = __alloc_ptr_table(size);
+    if (!table)
+        return;
+
+    shard->table[1] = table;
+    shard->size[1] = size;
+    shard->rehash_idx = 0;
+}
+
+static struct memptr *__find_ptr_shard(struct ptr_hashtable_shard *shard, void *ptr, struct memptr ***pprev)
+{
+    struct memptr **prev, *node;
+    int t;
+
+    for (t = 0; t < 2; t++) {
+        if (!shard->table[t])
+            break;
+        prev = &shard->table[t][__calc_ptr_hash(ptr, shard->size[t])];
+        for (node = *prev; node; prev = &node->hash_next, node = node->hash_next) {
+            if (node->ptr == ptr) {
+                if (pprev)
+                    *pprev = prev;
+                return node;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Order sensitive hash of the return addresses.  It is computed once when a
+ * callstack is captured and kept in struct callstack, so that the lookup can
+ * reject a different stack without comparing the frames.
+ */
+uint64_t mc_calc_callstack_hash(void *trace[], int depth)
 {
     int i;
-    uint64_t val = 0;
+    uint64_t val = depth;
+
+    for (i = 0; i < depth; i++) {
+        val = (val << 5 | val >> 59) ^ (uint64_t)trace[i];
+        val *= 0x9e3779b97f4a7c15UL;
+    }
 
-    for (i = 0; i < callstack->depth; i++)
-        val += (uint64_t)callstack->trace[i];
+    /* murmur3 finalizer */
+    val ^= val >> 33;
+    val *= 0xff51afd7ed558ccdUL;
+    val ^= val >> 33;
+    val *= 0xc4ceb9fe1a85ec53UL;
+    val ^= val >> 33;
 
-    return val % size;
+    return val;
 }
 
-void mc_lock_ptr_hashtable(void)
+static size_t __calc_callstack_hash(struct callstack *callstack, size_t size)
 {
-    PTR_HASHTABLE_LOCK();
+    return callstack->hash & (size - 1);
 }
 
-void mc_unlock_ptr_hashtable(void)
+void mc_lock_ptr_hashtable(struct ptr_hashtable *hashtable)
 {
-    PTR_HASHTABLE_UNLOCK();
+    int i;
+
+    for (i = 0; i < PTR_HASHTABLE_SHARDS; i++) {
+        PTR_HASHTABLE_LOCK(&hashtable->shard[i]);
+        hashtable->shard[i].paused++;
+    }
+}
+
+void mc_unlock_ptr_hashtable(struct ptr_hashtable *hashtable)
+{
+    int i;
+
+    for (i = PTR_HASHTABLE_SHARDS - 1; i >= 0; i--) {
+        hashtable->shard[i].paused--;
+        PTR_HASHTABLE_UNLOCK(&hashtable->shard[i]);
+    }
 }
 
 void mc_lock_callstack_hashtable(void)
@@ -51,21 +205,28 @@ void mc_unlock_callstack_hashtable(void)
     CALLSTACK_HASHTABLE_UNLOCK();
 }
 
-void mc_add_ptr_hashtable(struct memptr *hashtable[], size_t size, struct memptr *memptr)
+void mc_add_ptr_hashtable(struct ptr_hashtable *hashtable, struct memptr *memptr)
 {
-    int hash = __calc_ptr_hash(memptr->ptr, size);
+    struct ptr_hashtable_shard *shard = __get_ptr_shard(hashtable, memptr->ptr);
+    size_t hash;
+    int t;
 
-    PTR_HASHTABLE_LOCK();
+    __rehash_ptr_shard(shard);
 
-    memptr->hash_next = hashtable[hash];
-    hashtable[hash] = memptr;
+    t = shard->table[1] ? 1 : 0;
+    hash = __calc_ptr_hash(memptr->ptr, shard->size[t]);
+    memptr->hash_next = shard->table[t][hash];
+    shard->table[t][hash] = memptr;
+    shard->cnt++;
 
-    PTR_HASHTABLE_UNLOCK();
+    __expand_ptr_shard(shard);
+
+    PTR_HASHTABLE_UNLOCK(shard);
 }
 
 void mc_add_callstack_hashtable(struct callstack *hashtable[], size_t size, struct callstack *callstack)
 {
-    int hash = __calc_callstack_hash(callstack, size);
+    size_t hash = __calc_callstack_hash(callstack, size);
 
     CALLSTACK_HASHTABLE_LOCK();
 
@@ -75,42 +236,27 @@ void mc_add_callstack_hashtable(struct callstack *hashtable[], size_t size, stru
     CALLSTACK_HASHTABLE_UNLOCK();
 }
 
-struct memptr *mc_remove_ptr_hashtable(struct memptr *hashtable[], size_t size, void *ptr)
+struct memptr *mc_remove_ptr_hashtable(struct ptr_hashtable *hashtable, void *ptr)
 {
-    int hash = __calc_ptr_hash(ptr, size);
-    struct memptr *node, *prev = NULL;
+    struct ptr_hashtable_shard *shard = __get_ptr_shard(hashtable, ptr);
+    struct memptr *node, **prev;
 
-    PTR_HASHTABLE_LOCK();
+    __rehash_ptr_shard(shard);
 
-    node = hashtable[hash];
-    while (node) {
-        #if 0
-        mc_disable_hook();
-        printf(" node->ptr = %p\n", node->ptr);
-        mc_enable_hook();
-        #endif
-        if (node->ptr == ptr)
-            break;
-        prev = node;
-        node = node->hash_next;
-    }
-    if (!node) {
-        PTR_HASHTABLE_UNLOCK();
-        return NULL;
+    node = __find_ptr_shard(shard, ptr, &prev);
+    if (node) {
+        *prev = node->hash_next;
+        shard->cnt--;
     }
-    if (prev)
-        prev->hash_next = node->hash_next;
-    else
-        hashtable[hash] = node->hash_next;
 
-    PTR_HASHTABLE_UNLOCK();
+    PTR_HASHTABLE_UNLOCK(shard);
 
     return node;
 }
 
 struct callstack *mc_remove_callstack_hashtable(struct callstack *hashtable[], size_t size, struct callstack *callstack)
 {
-    int hash = __calc_callstack_hash(callstack, size);
+    size_t hash = __calc_callstack_hash(callstack, size);
     struct callstack *node, *prev = NULL;
 
     CALLSTACK_HASHTABLE_LOCK();
@@ -136,28 +282,104 @@ struct callstack *mc_remove_callstack_hashtable(struct callstack *hashtable[], s
     return node;
 }
 
-struct memptr *mc_find_ptr_hashtable(struct memptr *hashtable[], size_t size, void *ptr)
+struct memptr *mc_find_ptr_hashtable(struct ptr_hashtable *hashtable, void *ptr)
 {
-    int hash = __calc_ptr_hash(ptr, size);
+    struct ptr_hashtable_shard *shard = __get_ptr_shard(hashtable, ptr);
     struct memptr *node;
 
-    PTR_HASHTABLE_LOCK();
+    __rehash_ptr_shard(shard);
 
-    node = hashtable[hash];
-    while (node) {
-        if (node->ptr == ptr)
-            break;
-        node = node->hash_next;
-    }
+    node = __find_ptr_shard(shard, ptr, NULL);
 
-    PTR_HASHTABLE_UNLOCK();
+    PTR_HASHTABLE_UNLOCK(shard);
 
     return node;
 }
 
+void mc_clear_ptr_hashtable(struct ptr_hashtable *hashtable)
+{
+    struct ptr_hashtable_shard *shard;
+    int i;
+
+    for (i = 0; i < PTR_HASHTABLE_SHARDS; i++) {
+        shard = &hashtable->shard[i];
+        PTR_HASHTABLE_LOCK(shard);
+        if (shard->table[1])
+            __free_ptr_table(shard, shard->table[1], shard->size[1]);
+        if (shard->table[0])
+            __free_ptr_table(shard, shard->table[0], shard->size[0]);
+        memset(shard->init_table, 0, sizeof(shard->init_table));
+        shard->table[0] = shard->table[1] = NULL;
+        shard->size[0] = shard->size[1] = 0;
+        shard->rehash_idx = 0;
+        shard->cnt = 0;
+        PTR_HASHTABLE_UNLOCK(shard);
+    }
+}
+
+size_t mc_count_ptr_hashtable(struct ptr_hashtable *hashtable)
+{
+    size_t ret = 0;
+    int i;
+
+    for (i = 0; i < PTR_HASHTABLE_SHARDS; i++)
+        ret += hashtable->shard[i].cnt;
+    return ret;
+}
+
+/*
+ * Calls fn on the entries of up to max_buckets buckets of one shard from
+ * cursor, under the lock of that shard only, and advances cursor.  Returns
+ * the number of entries visited; cursor->shard is PTR_HASHTABLE_SHARDS at
+ * the end of the table.  Entries moved by rehashing are still visited, and
+ * a shard whose rehashing finished in the meantime is walked again from
+ * the start.  fn must not add or remove entries.
+ */
+size_t mc_walk_ptr_hashtable(struct ptr_hashtable *hashtable, struct ptr_hashtable_cursor *cursor, size_t max_buckets, void (*fn)(struct memptr *memptr, void *arg), void *arg)
+{
+    struct ptr_hashtable_shard *shard;
+    struct memptr *node;
+    size_t visited = 0;
+
+    if (cursor->shard >= PTR_HASHTABLE_SHARDS)
+        return 0;
+
+    shard = &hashtable->shard[cursor->shard];
+    PTR_HASHTABLE_LOCK(shard);
+
+    if (shard->table[0] != cursor->table) {
+        cursor->table = shard->table[0];
+        cursor->t = 0;
+        cursor->idx = 0;
+    }
+    /* table[1] gets the buckets of table[0] not walked yet, so it comes last */
+    while (cursor->t < 2 && max_buckets > 0) {
+        if (cursor->idx >= shard->size[cursor->t]) {
+            cursor->t++;
+            cursor->idx = 0;
+            continue;
+        }
+        for (node = shard->table[cursor->t][cursor->idx++]; node; node = node->hash_next) {
+            fn(node, arg);
+            visited++;
+        }
+        max_buckets--;
+    }
+    if (cursor->t == 2) {
+        cursor->shard++;
+        cursor->t = 0;
+        cursor->idx = 0;
+        cursor->table = NULL;
+    }
+
+    PTR_HASHTABLE_UNLOCK(shard);
+
+    return visited;
+}
+
 struct callstack *mc_find_callstack_hashtable(struct callstack *hashtable[], size_t size, struct callstack *callstack)
 {
-    int hash = __calc_callstack_hash(callstack, size);
+    size_t hash = __calc_callstack_hash(callstack, size);
     struct callstack *node;
 
     CALLSTACK_HASHTABLE_LOCK();
@@ -173,3 +395,105 @@ struct callstack *mc_find_callstack_hashtable(struct callstack *hashtable[], siz
 
     return node;
 }
+
+/*
+ * chain length histogram for the bucket occupancy statistics:
+ * 0, 1, 2, 3, 4 - 7, 8 -
+ */
+#define CHAIN_HISTO_BINS 6
+
+struct hashtable_stat {
+    size_t entries;
+    size_t buckets;
+    size_t used_buckets;
+    size_t max_chain;
+    size_t histogram[CHAIN_HISTO_BINS];
+    int rehashing;
+};
+
+static void __add_chain_stat(struct hashtable_stat *stat, size_t len)
+{
+    int bin;
+
+    if (len < 4)
+        bin = len;
+    else if (len < 8)
+        bin = 4;
+    else
+        bin = 5;
+
+    stat->histogram[bin]++;
+    stat->buckets++;
+    stat->entries += len;
+    if (len) {
+        stat->used_buckets++;
+        if (len > stat->max_chain)
+            stat->max_chain = len;
+    }
+}
+
+static void __print_hashtable_stat(const char *name, struct hashtable_stat *stat)
+{
+    static const char *bin_name[CHAIN_HISTO_BINS] = { "0", "1", "2", "3", "4 - 7", "8 -" };
+    int i;
+
+    mc_log_print("%s: %lu entries in %lu buckets", name, stat->entries, stat->buckets);
+    if (stat->rehashing)
+        mc_log_print(" (%d shards rehashing)", stat->rehashing);
+    mc_log_print("\n");
+    mc_log_print("  used buckets: %lu (%.2f%%)\n", stat->used_buckets, stat->buckets ? (float)stat->used_buckets * 100 / stat->buckets : 0.0f);
+    mc_log_print("  average chain (used buckets): %.2f, max chain: %lu\n", stat->used_buckets ? (float)stat->entries / stat->used_buckets : 0.0f, stat->max_chain);
+    for (i = 0; i < CHAIN_HISTO_BINS; i++)
+        mc_log_print("  chain length (%s): %lu\n", bin_name[i], stat->histogram[i]);
+    mc_log_print("\n");
+}
+
+void mc_print_ptr_hashtable_stat(const char *name, struct ptr_hashtable *hashtable)
+{
+    struct hashtable_stat stat;
+    struct ptr_hashtable_shard *shard;
+    struct memptr *node;
+    size_t i, len;
+    int s, t;
+
+    memset(&stat, 0, sizeof(stat));
+
+    /* one shard at a time so that allocating threads are only briefly held up */
+    for (s = 0; s < PTR_HASHTABLE_SHARDS; s++) {
+        shard = &hashtable->shard[s];
+        PTR_HASHTABLE_LOCK(shard);
+        if (shard->table[1])
+            stat.rehashing++;
+        for (t = 0; t < 2; t++) {
+            for (i = 0; i < shard->size[t]; i++) {
+                len = 0;
+                for (node = shard->table[t][i]; node; node = node->hash_next)
+                    len++;
+                __add_chain_stat(&stat, len);
+            }
+        }
+        PTR_HASHTABLE_UNLOCK(shard);
+    }
+
+    __print_hashtable_stat(name, &stat);
+}
+
+void mc_print_callstack_hashtable_stat(const char *name, struct callstack *hashtable[], size_t size)
+{
+    struct hashtable_stat stat;
+    struct callstack *node;
+    size_t i, len;
+
+    memset(&stat, 0, sizeof(stat));
+
+    CALLSTACK_HASHTABLE_LOCK();
+    for (i = 0; i < size; i++) {
+        len = 0;
+        for (node = hashtable[i]; node; node = node->hash_next)
+            len++;
+        __add_chain_stat(&stat, len);
+    }
+    CALLSTACK_HASHTABLE_UNLOCK();
+
+    __print_hashtable_stat(name, &stat);
+}
@@ -1,9 +1,57 @@
 #pragma once
 
-#define ALLOC_MEMPTR_HASHTABLE_SIZE   416963
-#define FREE_MEMPTR_HASHTABLE_SIZE 521
-#define CALLSTACK_HASHTABLE_SIZE 104729
+#include <pthread.h>
+#include "memchk.h"
+
+#define CALLSTACK_HASHTABLE_SIZE (1 << 17)    /* must be a power of two */
+
+/*
+ * A pointer hashtable is split into PTR_HASHTABLE_SHARDS independent shards,
+ * each with its own lock and its own power-of-two bucket array.  A shard
+ * starts with the small inline bucket array and doubles when it holds more
+ * entries than buckets.  Growing is incremental: the new array is filled by
+ * moving a few buckets of the old one on every operation, so no single call
+ * pays for rehashing the whole shard.
+ */
+#define PTR_HASHTABLE_SHARD_BITS 6
+#define PTR_HASHTABLE_SHARDS (1 << PTR_HASHTABLE_SHARD_BITS)
+#define PTR_HASHTABLE_INIT_SIZE 16
+#define PTR_HASHTABLE_MAX_SIZE (1UL << 28)
+#define PTR_HASHTABLE_REHASH_STEP 4
+
+struct ptr_hashtable_shard {
+    pthread_mutex_t mtx;
+    struct memptr **table[2];   /* table[1] is only used while rehashing */
+    size_t size[2];
+    size_t rehash_idx;          /* next bucket of table[0] to be moved */
+    size_t cnt;
+    int paused;                 /* rehashing is paused while being iterated */
+    struct memptr *init_table[PTR_HASHTABLE_INIT_SIZE];
+} __attribute__((aligned(64)));
+
+struct ptr_hashtable {
+    struct ptr_hashtable_shard shard[PTR_HASHTABLE_SHARDS];
+};
+
+#define PTR_HASHTABLE_INITIALIZER {                                             \
+        .shard = {                                                              \
+            [0 ... PTR_HASHTABLE_SHARDS - 1] = {                                \
+                .mtx = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,                  \
+            }                                                                   \
+        }                                                                       \
+    }
 
 #define for_each_hashnode(n, hash, size)        \
     for (int __i = 0; __i < size; __i++)              \
         for (n = hash[__i]; n; n = n->hash_next)
+
+/*
+ * Walk every entry of a pointer hashtable.  The caller must hold
+ * mc_lock_ptr_hashtable() on it so that no rehashing moves entries around
+ * during the walk.
+ */
+#define for_each_ptr_hashnode(n, hashtable)                                     \
+    for (int __s = 0; __s < PTR_HASHTABLE_SHARDS; __s++)                        \
+        for (int __t = 0; __t < 2; __t++)                                       \
+            for (size_t __i = 0; __i < (hashtable)->shard[__s].size[__t]; __i++) \
+                for (n = (hashtable)->shard[__s].table[__t][__i]; n; n = n->hash_next)
@@ -5,57 +5,104 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
-#include <pthread.h>
+#include <malloc.h>
 #include "memchk.h"
 
 #define INITBUF_SIZE 16384
 
-#define HOOK_LOCK() pthread_mutex_lock(&__mtx)
-#define HOOK_UNLOCK() pthread_mutex_unlock(&__mtx)
-
-static int do_not_hook;
-
-static pthread_mutex_t __mtx = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+/*
+ * Nesting count of mc_disable_hook() for the calling thread.  Allocations
+ * made by memchk itself (backtrace, bfd, stdio, ...) go straight to the
+ * original allocator while it is non-zero, without involving other threads.
+ */
+static __thread int do_not_hook __attribute__((tls_model("initial-exec")));
 
 void mc_disable_hook(void)
 {
-    HOOK_LOCK();
     do_not_hook++;
 }
 
 void mc_enable_hook(void)
 {
     do_not_hook--;
-    HOOK_UNLOCK();
 }
 
-void *malloc(size_t size)
+/*
+ * Sampled pool mode: all but about one allocation in mc_gwp_rate go to the
+ * original allocator after a single countdown.
+ */
+#define GWP_SKIP() (mc_gwp_rate && (--mc_gwp_countdown > 0 || do_not_hook))
+
+/* the helpers are inlined so that they add no frame to allocation callstacks */
+static inline __attribute__((always_inline)) void *__tracked_malloc(size_t size)
 {
     void *buf, *usrptr;
     size_t bufsize = size + REDZONE_SIZE * 2;
+    struct callstack *allocator = NULL;
 
-    mc_init();
-
-    HOOK_LOCK();
+    if (mc_guard_select(size, &allocator) && (usrptr = mc_guard_alloc(size, 0, 0, allocator)))
+        return usrptr;
 
-    if (do_not_hook) {
-        HOOK_UNLOCK();
-        return mc_orig_malloc(size);
+    buf = mc_orig_malloc(bufsize);
+    if (!buf) {
+        mc_put_callstack(allocator);
+        return NULL;
     }
 
-    HOOK_UNLOCK();
+    usrptr = (void *)((uint8_t *)buf + REDZONE_SIZE);
+
+    if (mc_register_memblk(buf, usrptr, bufsize, size, 0, allocator))
+        mc_put_callstack(allocator);
 
-    buf = mc_orig_malloc(bufsize);
-    if (!buf)
+    return usrptr;
+}
+
+/*
+ * The original calloc zeroes the whole buffer (or skips it for fresh mmap()ed
+ * chunks), so only the red zones are written here.
+ */
+static inline __attribute__((always_inline)) void *__tracked_calloc(size_t size)
+{
+    void *buf, *usrptr;
+    size_t bufsize = size + REDZONE_SIZE * 2;
+    struct callstack *allocator = NULL;
+
+    /* fresh anonymous pages are zero */
+    if (mc_guard_select(size, &allocator) && (usrptr = mc_guard_alloc(size, 0, MEMBLK_ZEROED, allocator)))
+        return usrptr;
+
+    buf = mc_orig_calloc(1, bufsize);
+    if (!buf) {
+        mc_put_callstack(allocator);
         return NULL;
+    }
 
     usrptr = (void *)((uint8_t *)buf + REDZONE_SIZE);
 
-    mc_register_memblk(buf, usrptr, bufsize, size);
+    if (mc_register_memblk(buf, usrptr, bufsize, size, MEMBLK_ZEROED, allocator))
+        mc_put_callstack(allocator);
 
     return usrptr;
 }
 
+void *malloc(size_t size)
+{
+    void *usrptr;
+
+    if (GWP_SKIP())
+        return mc_orig_malloc(size);
+
+    mc_init();
+
+    if (mc_gwp_rate)
+        return (usrptr = mc_gwp_alloc(size, 0, 0)) ? usrptr : mc_orig_malloc(size);
+
+    if (do_not_hook || !mc_sample_allocation(size))
+        return mc_orig_malloc(size);
+
+    return __tracked_malloc(size);
+}
+
 void free(void *ptr)
 {
     void *buf_to_be_freed;
@@ -63,21 +110,34 @@ void free(void *ptr)
     if (!ptr)
         return;
 
-    HOOK_LOCK();
-
-    if (do_not_hook) {
-        HOOK_UNLOCK();
+    if (do_not_hook || (mc_gwp_rate && !mc_gwp_owns(ptr))) {
         mc_orig_free(ptr);
         return;
     }
 
-    HOOK_UNLOCK();
-
     mc_unregister_memblk(ptr, &buf_to_be_freed);
     if (buf_to_be_freed)
         mc_orig_free(buf_to_be_freed);
 }
 
+/* the new block of an unsampled one is sampled like a new allocation */
+static inline __attribute__((always_inline)) void *__realloc_unsampled(void *ptr, size_t size)
+{
+    size_t oldsize;
+    void *newptr;
+
+    if (!mc_sample_allocation(size))
+        return mc_orig_realloc(ptr, size);
+
+    newptr = __tracked_malloc(size);
+    if (newptr) {
+        oldsize = malloc_usable_size(ptr);
+        memcpy(newptr, ptr, size >= oldsize ? oldsize : size);
+        mc_orig_free(ptr);
+    }
+    return newptr;
+}
+
 void *realloc(void *ptr, size_t size)
 {
     size_t oldsize;
@@ -91,21 +151,20 @@ void *realloc(void *ptr, size_t size)
         return NULL;
     }
 
-    HOOK_LOCK();
+    if (do_not_hook || (mc_gwp_rate && !mc_gwp_owns(ptr)))
+        return mc_orig_realloc(ptr, size);
 
-    if (do_not_hook) {
-        HOOK_UNLOCK();
-        newptr = mc_orig_realloc(ptr, size);
-        return newptr;
-    }
+    if (!mc_sample_maybe_tracked(ptr))
+        return __realloc_unsampled(ptr, size);
 
-    HOOK_UNLOCK();
+    if (!mc_realloc_memblk(ptr, size, &newptr))
+        return newptr;
 
     oldsize = mc_handle_realloc_memblk(ptr);
+    if (oldsize == -1 && mc_is_unsampled_memblk(ptr))
+        return __realloc_unsampled(ptr, size);
     if (oldsize == -1) {
-        mc_disable_hook();
-        printf("realloc: oldsize = -1 for %p\n", ptr);
-        mc_enable_hook();
+        mc_report_illegal_realloc(ptr);
         return NULL;
     }
 
@@ -120,25 +179,29 @@ void *realloc(void *ptr, size_t size)
 
 void *calloc(size_t nmems, size_t size)
 {
-    void *ret;
+    size_t total;
+    void *usrptr;
 
-    if (nmems * size == 0)
+    if (__builtin_mul_overflow(nmems, size, &total) || total > SIZE_MAX - REDZONE_SIZE * 2) {
+        errno = ENOMEM;
         return NULL;
+    }
 
-    HOOK_LOCK();
+    if (!total)
+        return NULL;
 
-    if (do_not_hook) {
-        HOOK_UNLOCK();
+    if (GWP_SKIP())
         return mc_orig_calloc(nmems, size);
-    }
 
-    HOOK_UNLOCK();
+    mc_init();
 
-    ret = malloc(nmems * size);
-    if (ret)
-        memset(ret, 0, nmems * size);
+    if (mc_gwp_rate)
+        return (usrptr = mc_gwp_alloc(total, 0, MEMBLK_ZEROED)) ? usrptr : mc_orig_calloc(nmems, size);
 
-    return ret;
+    if (do_not_hook || !mc_sample_allocation(total))
+        return mc_orig_calloc(nmems, size);
+
+    return __tracked_calloc(total);
 }
 
 static int __is_power_of_2(size_t val)
@@ -153,18 +216,35 @@ static void *__align_addr(void *addr, size_t alignment)
     return (void *)(((uint64_t)addr + alignment - 1) & ~(alignment - 1));
 }
 
-static void *__aligned_allocator(size_t alignment, size_t size)
+static inline __attribute__((always_inline)) void *__aligned_allocator(size_t alignment, size_t size)
 {
     void *buf, *usrptr;
     size_t bufsize;
+    struct callstack *allocator = NULL;
+
+    if (GWP_SKIP())
+        return mc_orig_memalign(alignment, size);
+
+    if (mc_gwp_rate)
+        return (usrptr = mc_gwp_alloc(size, alignment, 0)) ? usrptr : mc_orig_memalign(alignment, size);
+
+    /* the leading red zone of a block is recorded in MEMBLK_LEAD_BITS bits */
+    if (do_not_hook || alignment > MEMBLK_MAX_LEAD / 2 || !mc_sample_allocation(size))
+        return mc_orig_memalign(alignment, size);
+
+    if (mc_guard_select(size, &allocator) && (usrptr = mc_guard_alloc(size, alignment, 0, allocator)))
+        return usrptr;
 
     bufsize = size + REDZONE_SIZE * 2 + alignment - 1;
     buf = mc_orig_malloc(bufsize);
-    if (!buf)
+    if (!buf) {
+        mc_put_callstack(allocator);
         return NULL;
+    }
 
     usrptr = (void *)__align_addr((void *)((uint8_t *)buf + REDZONE_SIZE), alignment);
-    mc_register_memblk(buf, usrptr, bufsize, size);
+    if (mc_register_memblk(buf, usrptr, bufsize, size, 0, allocator))
+        mc_put_callstack(allocator);
 
     return usrptr;
 }
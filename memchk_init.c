@@ -29,7 +29,14 @@ static void __mc_init(void)
 
     mc_alloc_blk_init();
     mc_log_init();
+    mc_unwind_init();
+    mc_symbol_init();
+    mc_sample_init();
+    mc_buffer_init();
+    mc_guard_init();
+    mc_quarantine_init();
     mc_signal_init();
+    mc_scrub_init();
     mc_enable_hook();
 }
 
@@ -1,4 +1,8 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <string.h>
+#include <malloc.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
@@ -15,18 +19,17 @@ static int num_alloc_memblk;
 static int num_alloc_cnt, num_free_cnt;
 static size_t allocated_size;
 static int histogram[HISTO_BINS];
+/* scaled by the sample weight in sampling mode */
+static double est_alloc_memblk, est_allocated_size;
+static double est_histogram[HISTO_BINS];
 
 static pthread_mutex_t __mtx = PTHREAD_MUTEX_INITIALIZER;
 
-struct memptr *mc_alloc_memptr_hashtable[ALLOC_MEMPTR_HASHTABLE_SIZE];
-struct memptr *mc_alloc_memptr_hashtable_copy[ALLOC_MEMPTR_HASHTABLE_SIZE];
-static struct memptr *alloc_memptr_hashtable_snapshot[ALLOC_MEMPTR_HASHTABLE_SIZE];
-static struct memptr *alloc_memptr_hashtable_snapshot_copy[ALLOC_MEMPTR_HASHTABLE_SIZE];
-static struct memptr *free_memptr_hashtable[FREE_MEMPTR_HASHTABLE_SIZE];
-#if FREE_FIFO_SIZE > 0
-static int free_fifo_idx;
-static struct free_memblk *free_memblk_array[FREE_FIFO_SIZE];
-#endif
+struct ptr_hashtable mc_alloc_memptr_hashtable = PTR_HASHTABLE_INITIALIZER;
+struct ptr_hashtable mc_alloc_memptr_hashtable_copy = PTR_HASHTABLE_INITIALIZER;
+static struct ptr_hashtable alloc_memptr_hashtable_snapshot = PTR_HASHTABLE_INITIALIZER;
+static struct ptr_hashtable alloc_memptr_hashtable_snapshot_copy = PTR_HASHTABLE_INITIALIZER;
+static struct ptr_hashtable free_memptr_hashtable = PTR_HASHTABLE_INITIALIZER;
 
 #ifdef ENABLE_CALLSTACK
 extern struct callstack *mc_callstack_hashtable[CALLSTACK_HASHTABLE_SIZE];
@@ -48,28 +51,32 @@ static void __update_histogram(size_t usrsize, int inc)
 {
     int i;
     size_t size = HISTO_MAGNIFICATION;
+    double weight = mc_sample_weight(usrsize);
 
     for (i = 0; i < HISTO_BINS; i++) {
-        if (usrsize <= size) {
-            if (inc)
-                histogram[i]++;
-            else
-                histogram[i]--;
+        if (usrsize <= size)
             break;
-        }
         size *= HISTO_MAGNIFICATION;
     }
-    if (i == HISTO_BINS) {
-        if (inc)
-            histogram[i-1]++;
-        else
-            histogram[i-1]--;
+    if (i == HISTO_BINS)
+        i--;
+
+    if (inc) {
+        histogram[i]++;
+        est_histogram[i] += weight;
+        est_alloc_memblk += weight;
+        est_allocated_size += usrsize * weight;
+    } else {
+        histogram[i]--;
+        est_histogram[i] -= weight;
+        est_alloc_memblk -= weight;
+        est_allocated_size -= usrsize * weight;
     }
 }
 
 static void __handle_illegally_freed_buffer(void *usrptr)
 {
-    struct memptr *memptr = mc_find_ptr_hashtable(free_memptr_hashtable, FREE_MEMPTR_HASHTABLE_SIZE, usrptr);
+    struct memptr *memptr = mc_find_ptr_hashtable(&free_memptr_hashtable, usrptr);
     struct timeval   now;
     struct tm        tm;
     #ifdef ENABLE_CALLSTACK
@@ -92,9 +99,9 @@ static void __handle_illegally_freed_buffer(void *usrptr)
         #ifdef ENABLE_CALLSTACK
         free_memblk = get_free_memblk_from_memptr(memptr);
         mc_log_print("This memory block was allocated from:\n");
-        mc_print_callstack(free_memblk->allocator->depth, free_memblk->allocator->trace, 2);
+        mc_print_callstack_by_id(free_memblk->memblk.allocator_id, 2);
         mc_log_print("\nfreed from:\n");
-        mc_print_callstack(free_memblk->freer->depth, free_memblk->freer->trace, 2);
+        mc_print_callstack_by_id(free_memblk->freer_id, 2);
         mc_log_print("\nand then is being freed from:\n");
         #else
         mc_log_print("This memory block is being freed from:\n");
@@ -107,10 +114,25 @@ static void __handle_illegally_freed_buffer(void *usrptr)
     mc_enable_hook();
 }
 
-int mc_register_memblk(void *buf, void *usrptr, size_t bufsize, size_t usrsize)
+/*
+ * MEMBLK_ZEROED in flags leaves the user area as it is.  allocator is the
+ * allocation callstack if the caller has already captured it, or NULL; the
+ * block takes over the caller's reference to it on success.
+ * The leading red zone must be at most MEMBLK_MAX_LEAD bytes, the trailing
+ * one smaller than 4 GB and usrsize at most MEMBLK_MAX_USRSIZE.
+ */
+int mc_register_memblk(void *buf, void *usrptr, size_t bufsize, size_t usrsize, int flags, struct callstack *allocator)
 {
-    struct alloc_memblk *alloc_memblk = mc_allocate_alloc_memblk();
+    struct alloc_memblk *alloc_memblk;
+    size_t lead = (uint8_t *)usrptr - (uint8_t *)buf;
+    #ifdef ENABLE_CALLSTACK
+    struct callstack *callstack;
+    #endif
 
+    if (lead > MEMBLK_MAX_LEAD || usrsize > MEMBLK_MAX_USRSIZE || bufsize - lead - usrsize > UINT32_MAX)
+        return -1;
+
+    alloc_memblk = mc_allocate_alloc_memblk();
     if (!alloc_memblk) {
         mc_disable_hook();
         printf("mc_allocate_alloc_memblk failed\n");
@@ -118,19 +140,24 @@ int mc_register_memblk(void *buf, void *usrptr, size_t bufsize, size_t usrsize)
         return -1;
     }
 
-    alloc_memblk->memblk.buf = buf;
     alloc_memblk->memblk.memptr.ptr = usrptr;
-    alloc_memblk->memblk.bufsize = bufsize;
-    alloc_memblk->memblk.usrsize = usrsize;
+    mc_memblk_set_usrsize(&alloc_memblk->memblk, usrsize);
+    alloc_memblk->memblk.lead = lead;
+    alloc_memblk->memblk.tail = bufsize - lead - usrsize;
+    alloc_memblk->memblk.flags = flags;
+    alloc_memblk->memblk.allocator_id = 0;
     #ifdef ENABLE_CALLSTACK
-    alloc_memblk->allocator = mc_get_callstack();
+    callstack = allocator ? allocator : mc_get_callstack();
+    if (callstack)
+        alloc_memblk->memblk.allocator_id = callstack->id;
     #endif
 
     #ifdef ENABLE_BUFFER_CHECK
-    mc_set_allocated_buffer(alloc_memblk, 1);
+    mc_set_allocated_buffer(alloc_memblk, !(flags & MEMBLK_ZEROED));
     #endif
 
-    mc_add_ptr_hashtable(mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE, &alloc_memblk->memblk.memptr);
+    mc_sample_track(usrptr);
+    mc_add_ptr_hashtable(&mc_alloc_memptr_hashtable, &alloc_memblk->memblk.memptr);
 
     MANAGE_LOCK();
     num_alloc_cnt++;
@@ -142,16 +169,60 @@ int mc_register_memblk(void *buf, void *usrptr, size_t bufsize, size_t usrsize)
     return 0;
 }
 
-int mc_unregister_memblk(void *usrptr, void **buf_to_be_freed)
+#if FREE_FIFO_SIZE > 0
+/* releases blocks evicted from the quarantine */
+static void __release_free_memblks(struct free_memblk *free_memblk)
+{
+    struct free_memblk *next;
+
+    for (; free_memblk; free_memblk = next) {
+        next = free_memblk->quarantine_next;
+
+        /* off the table first so that no concurrent check sees it being released */
+        mc_remove_ptr_hashtable(&free_memptr_hashtable, free_memblk->memblk.memptr.ptr);
+        mc_sample_untrack(free_memblk->memblk.memptr.ptr);
+
+        #ifdef ENABLE_BUFFER_CHECK
+        mc_check_freed_buffer(free_memblk);
+        #endif
+        if (free_memblk->memblk.flags & MEMBLK_GUARDED)
+            mc_guard_release(&free_memblk->memblk);
+        else
+            mc_orig_free(mc_memblk_buf(&free_memblk->memblk));
+        #ifdef ENABLE_CALLSTACK
+        mc_put_callstack_id(free_memblk->memblk.allocator_id);
+        mc_put_callstack_id(free_memblk->freer_id);
+        #endif
+        mc_free_free_memblk(free_memblk);
+    }
+}
+#endif
+
+/* inlined so that the freer callstack is captured at the same depth from realloc as from free */
+static inline __attribute__((always_inline)) int __unregister_memblk(void *usrptr, void **buf_to_be_freed)
 {
     struct memptr *memptr;
     struct alloc_memblk *alloc_memblk;
     size_t freed_usrsize;
     #if FREE_FIFO_SIZE > 0
-    struct free_memblk *free_memblk, *old_free_memblk;
+    struct free_memblk *free_memblk = NULL;
+    #ifdef ENABLE_CALLSTACK
+    struct callstack *callstack;
+    #endif
     #endif
 
-    memptr = mc_remove_ptr_hashtable(mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE, usrptr);
+    if (!mc_sample_maybe_tracked(usrptr)) {
+        /* was not sampled when allocated */
+        *buf_to_be_freed = usrptr;
+        return 0;
+    }
+
+    memptr = mc_remove_ptr_hashtable(&mc_alloc_memptr_hashtable, usrptr);
+    if (!memptr && mc_is_sampling() && !mc_find_ptr_hashtable(&free_memptr_hashtable, usrptr)) {
+        /* was not sampled when allocated */
+        *buf_to_be_freed = usrptr;
+        return 0;
+    }
     if (!memptr) {
         __handle_illegally_freed_buffer(usrptr);
         *buf_to_be_freed = NULL;
@@ -159,35 +230,59 @@ int mc_unregister_memblk(void *usrptr, void **buf_to_be_freed)
     }
 
     alloc_memblk = get_alloc_memblk_from_memptr(memptr);
-    freed_usrsize = alloc_memblk->memblk.usrsize;
+    freed_usrsize = mc_memblk_usrsize(&alloc_memblk->memblk);
 
     #ifdef ENABLE_BUFFER_CHECK
     mc_check_allocated_buffer(alloc_memblk, 1);
     #endif
 
+    *buf_to_be_freed = NULL;
     #if FREE_FIFO_SIZE > 0
-    free_memblk = mc_allocate_free_memblk();
-    if (!free_memblk) {
-        mc_free_alloc_memblk(alloc_memblk);
-        return -1;
-    }
-
-    memcpy(&free_memblk->memblk, &alloc_memblk->memblk, sizeof(struct memblk));
-    #ifdef ENABLE_CALLSTACK
-    free_memblk->allocator = alloc_memblk->allocator;
-    free_memblk->freer = mc_get_callstack();
-    #endif
+    if (mc_quarantine_accepts(mc_memblk_bufsize(&alloc_memblk->memblk))) {
+        free_memblk = mc_allocate_free_memblk();
+        if (!free_memblk) {
+            #ifdef ENABLE_CALLSTACK
+            mc_put_callstack_id(alloc_memblk->memblk.allocator_id);
+            #endif
+            mc_sample_untrack(usrptr);
+            mc_free_alloc_memblk(alloc_memblk);
+            return -1;
+        }
 
-    #ifdef ENABLE_BUFFER_CHECK
-    mc_set_freed_buffer(free_memblk);
-    #endif
+        memcpy(&free_memblk->memblk, &alloc_memblk->memblk, sizeof(struct memblk));
+        #ifdef ENABLE_CALLSTACK
+        callstack = mc_get_callstack();
+        free_memblk->freer_id = callstack ? callstack->id : 0;
+        #endif
 
-    mc_add_ptr_hashtable(free_memptr_hashtable, FREE_MEMPTR_HASHTABLE_SIZE, &free_memblk->memblk.memptr);
+        #ifdef ENABLE_BUFFER_CHECK
+        mc_set_freed_buffer(free_memblk);
+        #endif
 
+        mc_add_ptr_hashtable(&free_memptr_hashtable, &free_memblk->memblk.memptr);
+    } else if (alloc_memblk->memblk.flags & MEMBLK_GUARDED)
+        mc_guard_release(&alloc_memblk->memblk);
+    else
+        *buf_to_be_freed = mc_memblk_buf(&alloc_memblk->memblk);
     #else
-    *buf_to_be_freed = alloc_memblk->memblk.buf;
+    if (alloc_memblk->memblk.flags & MEMBLK_GUARDED)
+        mc_guard_release(&alloc_memblk->memblk);
+    else
+        *buf_to_be_freed = mc_memblk_buf(&alloc_memblk->memblk);
     #endif
 
+    /* a quarantined block takes over the reference to its allocation callstack */
+    #ifdef ENABLE_CALLSTACK
+    #if FREE_FIFO_SIZE > 0
+    if (!free_memblk)
+    #endif
+        mc_put_callstack_id(alloc_memblk->memblk.allocator_id);
+    #endif
+
+    #if FREE_FIFO_SIZE > 0
+    if (!free_memblk)
+    #endif
+        mc_sample_untrack(usrptr);
     mc_free_alloc_memblk(alloc_memblk);
 
     MANAGE_LOCK();
@@ -195,72 +290,312 @@ int mc_unregister_memblk(void *usrptr, void **buf_to_be_freed)
     num_alloc_memblk--;
     allocated_size -= freed_usrsize;
     __update_histogram(freed_usrsize, 0);
-    #if FREE_FIFO_SIZE > 0
-    old_free_memblk = free_memblk_array[free_fifo_idx];
-    free_memblk_array[free_fifo_idx++] = free_memblk;
-    if (free_fifo_idx == FREE_FIFO_SIZE)
-        free_fifo_idx = 0;
-    #endif
     MANAGE_UNLOCK();
 
     #if FREE_FIFO_SIZE > 0
-    if (old_free_memblk) {
-        struct memblk *old_memblk = &old_free_memblk->memblk;
+    if (free_memblk)
+        __release_free_memblks(mc_quarantine_put(free_memblk));
+    #endif
 
-        #ifdef ENABLE_BUFFER_CHECK
-        mc_check_freed_buffer(old_free_memblk);
-        #endif
+    return 0;
+}
 
-        mc_remove_ptr_hashtable(free_memptr_hashtable, FREE_MEMPTR_HASHTABLE_SIZE, old_memblk->memptr.ptr);
-        *buf_to_be_freed = old_memblk->buf;
-        mc_free_free_memblk(old_free_memblk);
-    } else
-        *buf_to_be_freed = NULL;
+int mc_unregister_memblk(void *usrptr, void **buf_to_be_freed)
+{
+    return __unregister_memblk(usrptr, buf_to_be_freed);
+}
+
+/*
+ * Moves a block that is being resized by realloc to a new buffer, keeping
+ * its allocation callstack.  A block that has moved before gets headroom
+ * for further growth, so a buffer grown step by step moves O(log n) times.
+ * The old block goes through the quarantine like a freed one.  Called with
+ * memptr off the table; puts it back.
+ */
+static inline __attribute__((always_inline)) int __move_memblk(struct memptr *memptr, size_t size, void **newptr)
+{
+    struct alloc_memblk *alloc_memblk = get_alloc_memblk_from_memptr(memptr);
+    void *usrptr = memptr->ptr, *buf, *buf_to_be_freed;
+    size_t old_usrsize = mc_memblk_usrsize(&alloc_memblk->memblk);
+    size_t bufsize = size + REDZONE_SIZE * 2, headroom;
+    struct callstack *allocator = NULL;
+
+    if ((alloc_memblk->memblk.flags & MEMBLK_REALLOCED) && size > old_usrsize) {
+        headroom = size / 2 < REALLOC_MAX_HEADROOM ? size / 2 : REALLOC_MAX_HEADROOM;
+        if (bufsize <= SIZE_MAX - headroom)
+            bufsize += headroom;
+    }
+
+    buf = mc_orig_malloc(bufsize);
+    if (!buf) {
+        mc_add_ptr_hashtable(&mc_alloc_memptr_hashtable, memptr);
+        *newptr = NULL;
+        return 0;
+    }
+
+    #ifdef ENABLE_CALLSTACK
+    allocator = mc_get_callstack_by_id(alloc_memblk->memblk.allocator_id);
+    if (allocator)
+        mc_hold_callstack_id(allocator->id);
+    #endif
+    if (mc_register_memblk(buf, (uint8_t *)buf + REDZONE_SIZE, bufsize, size, MEMBLK_REALLOCED, allocator)) {
+        if (allocator)
+            mc_put_callstack(allocator);
+        mc_orig_free(buf);
+        mc_add_ptr_hashtable(&mc_alloc_memptr_hashtable, memptr);
+        return -1;
+    }
+    memcpy((uint8_t *)buf + REDZONE_SIZE, usrptr, size < old_usrsize ? size : old_usrsize);
+
+    mc_add_ptr_hashtable(&mc_alloc_memptr_hashtable, memptr);
+    __unregister_memblk(usrptr, &buf_to_be_freed);
+    if (buf_to_be_freed)
+        mc_orig_free(buf_to_be_freed);
+
+    *newptr = (uint8_t *)buf + REDZONE_SIZE;
+    return 0;
+}
+
+/*
+ * Resizes a registered block, keeping its allocation callstack.  It stays
+ * where it is while the new size fits its buffer, taking in the bytes the
+ * original allocator rounded the buffer up to; only the bytes between the
+ * old and the new end are checked and rewritten.  Otherwise it is moved by
+ * __move_memblk().  Only blocks laid out by malloc (one leading red zone)
+ * are handled; returns -1 for anything else, leaving the block as it was.
+ * On success *newptr is the block's pointer, or NULL if it had to move and
+ * no new buffer could be allocated.
+ */
+int mc_realloc_memblk(void *usrptr, size_t size, void **newptr)
+{
+    struct memptr *memptr;
+    struct alloc_memblk *alloc_memblk;
+    uint8_t *buf;
+    size_t old_usrsize, bufsize, capacity, usable;
+
+    if (size > MEMBLK_MAX_USRSIZE)
+        return -1;
+
+    memptr = mc_remove_ptr_hashtable(&mc_alloc_memptr_hashtable, usrptr);
+    if (!memptr)
+        return -1;
+
+    alloc_memblk = get_alloc_memblk_from_memptr(memptr);
+    if ((alloc_memblk->memblk.flags & MEMBLK_GUARDED) || alloc_memblk->memblk.lead != REDZONE_SIZE) {
+        mc_add_ptr_hashtable(&mc_alloc_memptr_hashtable, memptr);
+        return -1;
+    }
+
+    buf = mc_memblk_buf(&alloc_memblk->memblk);
+    bufsize = size + REDZONE_SIZE * 2;
+    capacity = mc_memblk_bufsize(&alloc_memblk->memblk);
+    if (bufsize > capacity) {
+        usable = malloc_usable_size(buf);
+        if (bufsize <= usable && usable - REDZONE_SIZE - size <= UINT32_MAX) {
+            #ifdef ENABLE_BUFFER_CHECK
+            memset(buf + capacity, REDZONE_PATTERN, usable - capacity);
+            #endif
+            alloc_memblk->memblk.tail += usable - capacity;
+            capacity = usable;
+        }
+    }
+    if (bufsize > capacity || bufsize < capacity / 2 || capacity - REDZONE_SIZE - size > UINT32_MAX)
+        return __move_memblk(memptr, size, newptr);
+
+    #ifdef ENABLE_BUFFER_CHECK
+    if (mc_check_resized_buffer(alloc_memblk, size))
+        mc_set_allocated_buffer(alloc_memblk, 0);
     #endif
 
+    old_usrsize = mc_memblk_usrsize(&alloc_memblk->memblk);
+    mc_memblk_set_usrsize(&alloc_memblk->memblk, size);
+    alloc_memblk->memblk.tail = capacity - REDZONE_SIZE - size;
+
+    #ifdef ENABLE_BUFFER_CHECK
+    mc_resize_allocated_buffer(alloc_memblk, old_usrsize);
+    #endif
+
+    mc_add_ptr_hashtable(&mc_alloc_memptr_hashtable, memptr);
+
+    MANAGE_LOCK();
+    allocated_size += size - old_usrsize;
+    __update_histogram(old_usrsize, 0);
+    __update_histogram(size, 1);
+    MANAGE_UNLOCK();
+
+    *newptr = usrptr;
     return 0;
 }
 
 size_t mc_handle_realloc_memblk(void *usrptr)
 {
-    struct memptr *memptr = mc_find_ptr_hashtable(mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE, usrptr);
+    struct memptr *memptr = mc_find_ptr_hashtable(&mc_alloc_memptr_hashtable, usrptr);
     struct memblk *memblk;
 
     if (!memptr)
         return -1;
 
     memblk = container_of(memptr, struct memblk, memptr);
-    return memblk->usrsize;
+    return mc_memblk_usrsize(memblk);
 }
 
-int mc_check_all_memblk(void)
+/* reports realloc of a block that is not allocated like such a free, see __handle_illegally_freed_buffer() */
+void mc_report_illegal_realloc(void *usrptr)
 {
-    struct memptr *memptr;
-    struct alloc_memblk *alloc_memblk;
-    struct free_memblk *free_memblk;
-    int ret = 0, rc;
+    __handle_illegally_freed_buffer(usrptr);
+}
 
-    MANAGE_LOCK();
+/*
+ * Distance from addr to the user area of a guarded block if addr is within
+ * its pages or the guard pages around them, -1 otherwise.
+ */
+static ssize_t __get_guard_fault_distance(struct memblk *memblk, void *addr)
+{
+    uint8_t *ptr = (uint8_t *)addr, *buf = (uint8_t *)mc_memblk_buf(memblk), *usrptr = (uint8_t *)memblk->memptr.ptr;
+
+    if (!(memblk->flags & MEMBLK_GUARDED) || ptr < buf - PAGE_SIZE || ptr >= buf + mc_memblk_bufsize(memblk) + PAGE_SIZE)
+        return -1;
+    if (ptr < usrptr)
+        return usrptr - ptr;
+    if (ptr >= usrptr + mc_memblk_usrsize(memblk))
+        return ptr - (usrptr + mc_memblk_usrsize(memblk)) + 1;
+    return 0;
+}
+
+/*
+ * Called from the SIGSEGV handler.  Finds the guarded block of addr and
+ * reports the access made at pc; returns -1 without taking any lock if
+ * addr is not in a guarded block's pages.
+ */
+int mc_report_guard_fault(void *addr, int is_write, void *pc)
+{
+    struct memptr *memptr;
+    struct alloc_memblk *alloc_memblk = NULL;
+    struct free_memblk *free_memblk = NULL;
+    const char *access = is_write < 0 ? "Access" : is_write ? "Write" : "Read";
+    struct memblk *memblk;
+    uint8_t *usrptr;
+    void *guard_usrptr;
 
-    for_each_hashnode(memptr, mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE) {
+    if (!(guard_usrptr = mc_guard_find(addr)))
+        return -1;
+    if ((memptr = mc_find_ptr_hashtable(&mc_alloc_memptr_hashtable, guard_usrptr)))
         alloc_memblk = get_alloc_memblk_from_memptr(memptr);
-        rc = mc_check_allocated_buffer(alloc_memblk, 0);
-        if (rc)
-            mc_set_allocated_buffer(alloc_memblk, 0);
-        ret |= rc;
+    else if ((memptr = mc_find_ptr_hashtable(&free_memptr_hashtable, guard_usrptr)))
+        free_memblk = get_free_memblk_from_memptr(memptr);
+    else
+        return -1;
+    if (__get_guard_fault_distance(container_of(memptr, struct memblk, memptr), addr) < 0)
+        return -1;
+
+    memblk = alloc_memblk ? &alloc_memblk->memblk : &free_memblk->memblk;
+    usrptr = (uint8_t *)memblk->memptr.ptr;
+
+    mc_disable_hook();
+    mc_init_filemaps_from_procmap();
+    mc_enable_hook();
+
+    mc_log_print("\n-------------------------------------------------\n");
+    if (alloc_memblk && (uint8_t *)addr < usrptr)
+        mc_log_print("%s at %p, %ld bytes before the start of (%p:%lu) !!!\n\n", access, addr,
+                     usrptr - (uint8_t *)addr, usrptr, mc_memblk_usrsize(memblk));
+    else if (alloc_memblk)
+        mc_log_print("%s at %p, %ld bytes beyond the end of (%p:%lu) !!!\n\n", access, addr,
+                     (uint8_t *)addr - (usrptr + mc_memblk_usrsize(memblk)), usrptr, mc_memblk_usrsize(memblk));
+    else
+        mc_log_print("%s at %p, offset %ld of FREED area (%p:%lu) !!!\n\n", access, addr,
+                     (uint8_t *)addr - usrptr, usrptr, mc_memblk_usrsize(memblk));
+    #ifdef ENABLE_CALLSTACK
+    mc_log_print("This memory block was allocated from:\n");
+    mc_print_callstack_by_id(memblk->allocator_id, 2);
+    if (free_memblk) {
+        mc_log_print("\nfreed from:\n");
+        mc_print_callstack_by_id(free_memblk->freer_id, 2);
     }
+    mc_log_print("\nand is being accessed from:\n");
+    mc_print_signal_callstack(pc);
+    #endif
 
-    for_each_hashnode(memptr, free_memptr_hashtable, FREE_MEMPTR_HASHTABLE_SIZE) {
-        free_memblk = get_free_memblk_from_memptr(memptr);
-        rc = mc_check_freed_buffer(free_memblk);
-        if (rc)
-            mc_set_freed_buffer(free_memblk);
-        ret |= rc;
+    mc_disable_hook();
+    mc_term_filemaps();
+    mc_enable_hook();
+
+    return 0;
+}
+
+/*
+ * In sampling mode a pointer that is neither allocated nor freed through
+ * memchk is taken to be an unsampled block of the original allocator.
+ */
+int mc_is_unsampled_memblk(void *usrptr)
+{
+    if (!mc_is_sampling())
+        return 0;
+    if (!mc_sample_maybe_tracked(usrptr))
+        return 1;
+    return !mc_find_ptr_hashtable(&mc_alloc_memptr_hashtable, usrptr) && !mc_find_ptr_hashtable(&free_memptr_hashtable, usrptr);
+}
+
+/* buckets walked per shard lock while checking blocks */
+#define CHECK_LOCK_BUCKETS 64
+
+static void __check_alloc_memptr(struct memptr *memptr, void *arg)
+{
+    struct memblk_check_cursor *cursor = (struct memblk_check_cursor *)arg;
+    struct alloc_memblk *alloc_memblk = get_alloc_memblk_from_memptr(memptr);
+
+    cursor->num_checked++;
+    if (mc_check_allocated_buffer(alloc_memblk, 0)) {
+        mc_set_allocated_buffer(alloc_memblk, 0);
+        cursor->num_errors++;
     }
+}
 
-    MANAGE_UNLOCK();
+static void __check_free_memptr(struct memptr *memptr, void *arg)
+{
+    struct memblk_check_cursor *cursor = (struct memblk_check_cursor *)arg;
+    struct free_memblk *free_memblk = get_free_memblk_from_memptr(memptr);
 
-    return ret;
+    cursor->num_checked++;
+    if (mc_check_freed_buffer(free_memblk)) {
+        mc_set_freed_buffer(free_memblk);
+        cursor->num_errors++;
+    }
+}
+
+/*
+ * Checks about max_blocks allocated and freed blocks from cursor, which
+ * starts zeroed, holding a shard lock for at most CHECK_LOCK_BUCKETS
+ * buckets at a time.  Returns 1 once every block has been checked.
+ */
+int mc_check_memblk_step(struct memblk_check_cursor *cursor, size_t max_blocks)
+{
+    struct ptr_hashtable *hashtable;
+    size_t checked = 0;
+
+    while (cursor->table < 2 && checked < max_blocks) {
+        hashtable = cursor->table == 0 ? &mc_alloc_memptr_hashtable : &free_memptr_hashtable;
+        if (cursor->pos.shard >= PTR_HASHTABLE_SHARDS) {
+            cursor->table++;
+            memset(&cursor->pos, 0, sizeof(cursor->pos));
+            continue;
+        }
+        checked += mc_walk_ptr_hashtable(hashtable, &cursor->pos, CHECK_LOCK_BUCKETS,
+                                         cursor->table == 0 ? __check_alloc_memptr : __check_free_memptr, cursor);
+    }
+
+    return cursor->table == 2;
+}
+
+int mc_check_all_memblk(void)
+{
+    struct memblk_check_cursor cursor;
+
+    memset(&cursor, 0, sizeof(cursor));
+    while (!mc_check_memblk_step(&cursor, SIZE_MAX))
+        ;
+
+    return cursor.num_errors ? -1 : 0;
 }
 
 int mc_get_alloc_memblk_cnt(void)
@@ -283,6 +618,16 @@ int mc_get_free_cnt(void)
     return num_free_cnt;
 }
 
+double mc_get_estimated_alloc_memblk_cnt(void)
+{
+    return est_alloc_memblk;
+}
+
+double mc_get_estimated_allocated_size(void)
+{
+    return est_allocated_size;
+}
+
 void mc_print_histogram_alloc_memblk(void)
 {
     int i;
@@ -291,40 +636,56 @@ void mc_print_histogram_alloc_memblk(void)
     size = 1;
     for (i = 0; i < HISTO_BINS; i++) {
         if (i < HISTO_BINS - 1) {
-            mc_log_print("block size (%d - %d): %d\n", i == 0 ? 1 : size + 1, size * HISTO_MAGNIFICATION, histogram[i]);
+            mc_log_print("block size (%d - %d): %d", i == 0 ? 1 : size + 1, size * HISTO_MAGNIFICATION, histogram[i]);
             size *= HISTO_MAGNIFICATION;
         } else
-            mc_log_print("block size (%d - ): %d\n", i == 0 ? 1 : size + 1, histogram[i]);
+            mc_log_print("block size (%d - ): %d", i == 0 ? 1 : size + 1, histogram[i]);
+        if (mc_is_sampling())
+            mc_log_print(" (estimated %.0f)", est_histogram[i]);
+        mc_log_print("\n");
     }
     mc_log_print("\n");
 }
 
-int __print_all_memblk_on_hashtable(struct memptr *hashtable[], size_t hash_size)
+void mc_print_hashtable_status(void)
+{
+    mc_print_ptr_hashtable_stat("allocated block table", &mc_alloc_memptr_hashtable);
+    mc_print_ptr_hashtable_stat("freed block table", &free_memptr_hashtable);
+    #ifdef ENABLE_CALLSTACK
+    mc_print_callstack_hashtable_stat("callstack table", mc_callstack_hashtable, CALLSTACK_HASHTABLE_SIZE);
+    #endif
+}
+
+int __print_all_memblk_on_hashtable(struct ptr_hashtable *hashtable)
 {
     struct memptr *memptr;
     struct alloc_memblk *alloc_memblk;
     int cnt = 0, total_blks = 0;
 
-    for_each_hashnode(memptr, hashtable, hash_size) {
-        total_blks++;
-    }
+    mc_lock_ptr_hashtable(hashtable);
+
+    total_blks = mc_count_ptr_hashtable(hashtable);
     struct alloc_memblk **alloc_memblk_array = (struct alloc_memblk **)mc_allocate_sort_buffer(total_blks);
-    if (!alloc_memblk_array)
+    if (!alloc_memblk_array) {
+        mc_unlock_ptr_hashtable(hashtable);
         return -1;
+    }
 
     int i = 0;
-    for_each_hashnode(memptr, hashtable, hash_size) {
+    for_each_ptr_hashnode(memptr, hashtable) {
         alloc_memblk = get_alloc_memblk_from_memptr(memptr);
         alloc_memblk_array[i++] = alloc_memblk;
     }
 
+    mc_unlock_ptr_hashtable(hashtable);
+
     mc_sort_by_alloc_memblk(alloc_memblk_array, total_blks);
 
     for (i = 0; i < total_blks; i++) {
         alloc_memblk = alloc_memblk_array[i];
-        mc_log_print("block %d: 0x%p (%lu bytes)\n---\n", cnt++, alloc_memblk->memblk.memptr.ptr, alloc_memblk->memblk.usrsize);
+        mc_log_print("block %d: 0x%p (%lu bytes)\n---\n", cnt++, alloc_memblk->memblk.memptr.ptr, mc_memblk_usrsize(&alloc_memblk->memblk));
         #ifdef ENABLE_CALLSTACK
-        mc_print_callstack(alloc_memblk->allocator->depth, alloc_memblk->allocator->trace, 2);
+        mc_print_callstack_by_id(alloc_memblk->memblk.allocator_id, 2);
         #endif
         mc_log_print("\n");
     }
@@ -338,7 +699,7 @@ int mc_print_all_memblk(void)
 {
     int ret;
 
-    ret = mc_duplicate_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    ret = mc_duplicate_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy, &mc_alloc_memptr_hashtable);
     if (ret != 0)
         return ret;
 
@@ -346,28 +707,28 @@ int mc_print_all_memblk(void)
     mc_init_filemaps_from_procmap();
     mc_enable_hook();
 
-    __print_all_memblk_on_hashtable(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    __print_all_memblk_on_hashtable(&mc_alloc_memptr_hashtable_copy);
 
     mc_disable_hook();
     mc_term_filemaps();
     mc_enable_hook();
 
-    mc_destroy_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_destroy_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy);
     return 0;
 }
 
 #ifdef ENABLE_CALLSTACK
 int __print_all_memblk_per_callstack(int link_index)
 {
-    struct alloc_memblk *alloc_memblk;
+    struct report_memblk *report_memblk;
     struct callstack *callstack;
     int cnt = 0, total_callstacks = 0, i = 0;
 
     mc_lock_callstack_hashtable();
 
     for_each_hashnode(callstack, mc_callstack_hashtable, CALLSTACK_HASHTABLE_SIZE) {
-        alloc_memblk = callstack->same_callstack_group_next[link_index];
-        if (!alloc_memblk)
+        report_memblk = callstack->same_callstack_group_next[link_index];
+        if (!report_memblk)
             continue;
         total_callstacks++;
     }
@@ -379,12 +740,12 @@ int __print_all_memblk_per_callstack(int link_index)
 
     for_each_hashnode(callstack, mc_callstack_hashtable, CALLSTACK_HASHTABLE_SIZE) {
         callstack->total_size = 0;
-        alloc_memblk = callstack->same_callstack_group_next[link_index];
-        if (!alloc_memblk)
+        report_memblk = callstack->same_callstack_group_next[link_index];
+        if (!report_memblk)
             continue;
-        while (alloc_memblk) {
-            callstack->total_size += (int64_t)alloc_memblk->memblk.usrsize;
-            alloc_memblk = alloc_memblk->same_callstack_group_next;
+        while (report_memblk) {
+            callstack->total_size += mc_sample_estimate(mc_memblk_usrsize(&report_memblk->alloc_memblk.memblk));
+            report_memblk = report_memblk->same_callstack_group_next;
         }
         callstack_array[i++] = callstack;
     }
@@ -392,16 +753,17 @@ int __print_all_memblk_per_callstack(int link_index)
     mc_unlock_callstack_hashtable();
 
     mc_sort_per_callstack(callstack_array, total_callstacks);
+    mc_resolve_callstack_symbols(callstack_array, total_callstacks, 2);
 
     for (i = 0; i < total_callstacks; i++) {
         callstack = callstack_array[i];
-        alloc_memblk = callstack->same_callstack_group_next[link_index];
+        report_memblk = callstack->same_callstack_group_next[link_index];
         mc_log_print("group %d: ", cnt++);
-        while (alloc_memblk) {
-            mc_log_print("%lu ", alloc_memblk->memblk.usrsize);
-            alloc_memblk = alloc_memblk->same_callstack_group_next;
+        while (report_memblk) {
+            mc_log_print("%lu ", mc_memblk_usrsize(&report_memblk->alloc_memblk.memblk));
+            report_memblk = report_memblk->same_callstack_group_next;
         }
-        mc_log_print(" (total %ld bytes)\n---\n", callstack->total_size);
+        mc_log_print(mc_is_sampling() ? " (estimated total %ld bytes)\n---\n" : " (total %ld bytes)\n---\n", callstack->total_size);
         mc_print_callstack(callstack->depth, callstack->trace, 2);
         mc_log_print("\n");
     }
@@ -416,17 +778,12 @@ int mc_print_all_memblk_per_callstack(void)
 {
     #ifdef ENABLE_CALLSTACK
     int ret;
-    struct memptr *memptr;
-    struct alloc_memblk *alloc_memblk;
 
-    ret = mc_duplicate_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    ret = mc_duplicate_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy, &mc_alloc_memptr_hashtable);
     if (ret != 0)
         return ret;
 
-    for_each_hashnode(memptr, mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE) {
-        alloc_memblk = get_alloc_memblk_from_memptr(memptr);
-        mc_link_memblk_to_callstack(alloc_memblk, alloc_memblk->allocator, LINK_CURRENT);
-    }
+    mc_link_same_callstack_group(&mc_alloc_memptr_hashtable_copy, LINK_CURRENT);
 
     mc_disable_hook();
     mc_init_filemaps_from_procmap();
@@ -439,7 +796,7 @@ int mc_print_all_memblk_per_callstack(void)
     mc_enable_hook();
 
     mc_reset_same_callstack_group(mc_callstack_hashtable, CALLSTACK_HASHTABLE_SIZE, LINK_CURRENT);
-    mc_destroy_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_destroy_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy);
     return 0;
     #else
     mc_log_print("No callstack due to ENABLE_CALLSTACK disabled\n");
@@ -449,31 +806,31 @@ int mc_print_all_memblk_per_callstack(void)
 
 int mc_create_snapshot(void)
 {
-    mc_destroy_all_alloc_memblk(alloc_memptr_hashtable_snapshot, ALLOC_MEMPTR_HASHTABLE_SIZE);
-    return mc_duplicate_all_alloc_memblk(alloc_memptr_hashtable_snapshot, ALLOC_MEMPTR_HASHTABLE_SIZE, mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_destroy_all_alloc_memblk(&alloc_memptr_hashtable_snapshot);
+    return mc_duplicate_all_alloc_memblk(&alloc_memptr_hashtable_snapshot, &mc_alloc_memptr_hashtable);
 }
 
 void mc_destroy_snapshot(void)
 {
-    mc_destroy_all_alloc_memblk(alloc_memptr_hashtable_snapshot, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_destroy_all_alloc_memblk(&alloc_memptr_hashtable_snapshot);
 }
 
 int mc_compare_with_snapshot(void)
 {
     int ret;
 
-    ret = mc_duplicate_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    ret = mc_duplicate_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy, &mc_alloc_memptr_hashtable);
     if (ret != 0)
         return ret;
 
-    ret = mc_duplicate_all_alloc_memblk(alloc_memptr_hashtable_snapshot_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, alloc_memptr_hashtable_snapshot, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    ret = mc_duplicate_all_alloc_memblk(&alloc_memptr_hashtable_snapshot_copy, &alloc_memptr_hashtable_snapshot);
     if (ret != 0)
         return ret;
 
-    mc_compare_snapshot_and_current_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, alloc_memptr_hashtable_snapshot_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_compare_snapshot_and_current_alloc_memblk(&mc_alloc_memptr_hashtable_copy, &alloc_memptr_hashtable_snapshot_copy);
 
-    mc_destroy_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
-    mc_destroy_all_alloc_memblk(alloc_memptr_hashtable_snapshot_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_destroy_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy);
+    mc_destroy_all_alloc_memblk(&alloc_memptr_hashtable_snapshot_copy);
 
     return 0;
 }
@@ -483,18 +840,18 @@ int mc_compare_with_snapshot_per_callstack(void)
     #ifdef ENABLE_CALLSTACK
     int ret;
 
-    ret = mc_duplicate_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    ret = mc_duplicate_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy, &mc_alloc_memptr_hashtable);
     if (ret != 0)
         return ret;
 
-    ret = mc_duplicate_all_alloc_memblk(alloc_memptr_hashtable_snapshot_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, alloc_memptr_hashtable_snapshot, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    ret = mc_duplicate_all_alloc_memblk(&alloc_memptr_hashtable_snapshot_copy, &alloc_memptr_hashtable_snapshot);
     if (ret != 0)
         return ret;
 
-    mc_compare_snapshot_and_current_alloc_memblk_per_callstack(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, alloc_memptr_hashtable_snapshot_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_compare_snapshot_and_current_alloc_memblk_per_callstack(&mc_alloc_memptr_hashtable_copy, &alloc_memptr_hashtable_snapshot_copy);
 
-    mc_destroy_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
-    mc_destroy_all_alloc_memblk(alloc_memptr_hashtable_snapshot_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_destroy_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy);
+    mc_destroy_all_alloc_memblk(&alloc_memptr_hashtable_snapshot_copy);
 
     return 0;
     #else
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "memchk.h"
+
+/*
+ * Freed blocks are kept in a FIFO quarantine, filled with FREEDBUF_PATTERN,
+ * until it holds more than MEMCHK_QUARANTINE_ENTRIES blocks or
+ * MEMCHK_QUARANTINE_BYTES bytes; the oldest blocks are then evicted and
+ * checked.  Blocks larger than MEMCHK_QUARANTINE_MAX_BLOCK bytes (default:
+ * the byte limit) are released at once without being filled.
+ *
+ * Each thread stages up to QUARANTINE_BATCH blocks and appends them to the
+ * FIFO under one lock.  Staged blocks are already on the freed table, so
+ * double frees and buffer checks see them.
+ */
+#define QUARANTINE_BATCH 16
+
+#define QUARANTINE_LOCK() pthread_mutex_lock(&__mtx)
+#define QUARANTINE_UNLOCK() pthread_mutex_unlock(&__mtx)
+
+struct quarantine_stage {
+    struct free_memblk *head, *tail;
+    size_t num_entries, num_bytes;
+};
+
+static pthread_mutex_t __mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t __max_entries = FREE_FIFO_SIZE;
+static size_t __max_bytes = FREE_FIFO_BYTES;
+static size_t __max_block = FREE_FIFO_BYTES;
+
+static struct free_memblk *__head, *__tail;
+static size_t __num_entries, __num_bytes;
+static size_t __num_evicted, __num_bypassed;
+
+static pthread_key_t __stage_key;
+static pthread_once_t __stage_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct quarantine_stage __stage __attribute__((tls_model("initial-exec")));
+static __thread int __stage_registered __attribute__((tls_model("initial-exec")));
+
+void mc_quarantine_init(void)
+{
+    char *env;
+
+    /* in sampled pool mode only slots are quarantined */
+    if (mc_gwp_get_num_slots())
+        __max_entries = mc_gwp_get_num_slots() / 2;
+    if ((env = getenv("MEMCHK_QUARANTINE_ENTRIES")))
+        __max_entries = strtoul(env, NULL, 0);
+    if ((env = getenv("MEMCHK_QUARANTINE_BYTES")))
+        __max_block = __max_bytes = strtoul(env, NULL, 0);
+    if ((env = getenv("MEMCHK_QUARANTINE_MAX_BLOCK")))
+        __max_block = strtoul(env, NULL, 0);
+
+    mc_log_print("quarantine = %lu blocks, %lu bytes, blocks up to %lu bytes\n", __max_entries, __max_bytes, __max_block);
+}
+
+/* caller holds the lock */
+static void __splice_stage(struct quarantine_stage *stage)
+{
+    if (!stage->head)
+        return;
+
+    if (__tail)
+        __tail->quarantine_next = stage->head;
+    else
+        __head = stage->head;
+    __tail = stage->tail;
+    __num_entries += stage->num_entries;
+    __num_bytes += stage->num_bytes;
+    memset(stage, 0, sizeof(*stage));
+}
+
+/* blocks staged by an exiting thread are evicted by the next flush of another thread */
+static void __release_stage(void *arg)
+{
+    QUARANTINE_LOCK();
+    __splice_stage((struct quarantine_stage *)arg);
+    QUARANTINE_UNLOCK();
+
+    /* frees from later destructors register the stage again */
+    __stage_registered = 0;
+}
+
+static void __create_stage_key(void)
+{
+    pthread_key_create(&__stage_key, __release_stage);
+}
+
+static void __register_stage(void)
+{
+    __stage_registered = 1;
+
+    /* pthread_setspecific() may allocate */
+    mc_disable_hook();
+    pthread_once(&__stage_key_once, __create_stage_key);
+    pthread_setspecific(__stage_key, &__stage);
+    mc_enable_hook();
+}
+
+/* returns 0 if a freed buffer of bufsize bytes is to be released without quarantine */
+int mc_quarantine_accepts(size_t bufsize)
+{
+    if (__max_entries && __max_bytes && bufsize <= __max_block)
+        return 1;
+
+    __atomic_fetch_add(&__num_bypassed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Puts free_memblk into the quarantine and returns the blocks evicted to
+ * make room for it, linked by quarantine_next, or NULL.
+ */
+struct free_memblk *mc_quarantine_put(struct free_memblk *free_memblk)
+{
+    struct quarantine_stage *stage = &__stage;
+    struct free_memblk *evicted = NULL, **evicted_tail = &evicted;
+
+    if (!__stage_registered)
+        __register_stage();
+
+    free_memblk->quarantine_next = NULL;
+    if (stage->tail)
+        stage->tail->quarantine_next = free_memblk;
+    else
+        stage->head = free_memblk;
+    stage->tail = free_memblk;
+    stage->num_entries++;
+    stage->num_bytes += mc_memblk_bufsize(&free_memblk->memblk);
+
+    /* guarded blocks are few and hold pages of their own, so they are not staged */
+    if (stage->num_entries < QUARANTINE_BATCH && stage->num_bytes < __max_bytes / QUARANTINE_BATCH &&
+        !(free_memblk->memblk.flags & MEMBLK_GUARDED))
+        return NULL;
+
+    QUARANTINE_LOCK();
+    __splice_stage(stage);
+    while (__head && (__num_entries > __max_entries || __num_bytes > __max_bytes)) {
+        struct free_memblk *oldest = __head;
+
+        __head = oldest->quarantine_next;
+        if (!__head)
+            __tail = NULL;
+        __num_entries--;
+        __num_bytes -= mc_memblk_bufsize(&oldest->memblk);
+        __num_evicted++;
+
+        oldest->quarantine_next = NULL;
+        *evicted_tail = oldest;
+        evicted_tail = &oldest->quarantine_next;
+    }
+    QUARANTINE_UNLOCK();
+
+    return evicted;
+}
+
+void mc_print_quarantine_status(void)
+{
+    char unit[3];
+    float val = mc_change_unit(__num_bytes, unit);
+
+    mc_log_print("quarantine: %lu blocks (limit %lu), %lu bytes (%.2f %s, limit %lu)\n", __num_entries, __max_entries, __num_bytes, val, unit, __max_bytes);
+    mc_log_print("  %lu evicted, %lu released without quarantine\n", __num_evicted, __num_bypassed);
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "memchk.h"
+
+/*
+ * Sampling mode (MEMCHK_SAMPLE_RATE=<bytes>).  Allocations are picked by a
+ * Poisson process over the allocated bytes with a mean of one sample every
+ * <bytes> bytes, like the heap sampler of tcmalloc.  Only picked blocks are
+ * registered; the others go to the original allocator untouched.
+ *
+ * A block of size s is picked with probability 1 - exp(-s / rate), so each
+ * sampled block stands for 1 / (1 - exp(-s / rate)) blocks of that size and
+ * reports scaled by this weight are unbiased estimates.
+ *
+ * Most frees are of unsampled blocks.  A counting filter of the pointers of
+ * tracked blocks, allocated or quarantined, tells them apart without a
+ * lock: a zero count means the block is not in any table.
+ */
+#define TRACKED_FILTER_BITS 20
+#define TRACKED_FILTER_SIZE (1UL << TRACKED_FILTER_BITS)
+
+static size_t __sample_rate;
+static uint32_t *__tracked_filter;
+
+/* bytes left until the next sample, 0 until the thread draws its first interval */
+static __thread size_t __bytes_until_sample __attribute__((tls_model("initial-exec")));
+static __thread uint64_t __rnd __attribute__((tls_model("initial-exec")));
+
+/* xorshift64* seeded per thread, also used for the GWP sampling of memchk_guard.c */
+uint64_t mc_sample_random(void)
+{
+    struct timespec ts;
+
+    if (!__rnd) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        __rnd = ((uint64_t)mc_gettid() << 32) ^ ts.tv_nsec ^ (uint64_t)&ts;
+        if (!__rnd)
+            __rnd = 1;
+    }
+    __rnd ^= __rnd >> 12;
+    __rnd ^= __rnd << 25;
+    __rnd ^= __rnd >> 27;
+    return __rnd * 0x2545f4914f6cdd1dUL;
+}
+
+static size_t __next_sample_interval(void)
+{
+    /* uniform in (0, 1] */
+    double u = ((mc_sample_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double interval = -log(u) * __sample_rate;
+
+    return interval < 1.0 ? 1 : (size_t)interval;
+}
+
+void mc_sample_init(void)
+{
+    char *env = getenv("MEMCHK_SAMPLE_RATE");
+
+    if (env)
+        __sample_rate = strtoul(env, NULL, 0);
+    if (!__sample_rate)
+        return;
+    mc_log_print("sampling 1 in %lu bytes\n", __sample_rate);
+
+    __tracked_filter = mmap(NULL, TRACKED_FILTER_SIZE * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (__tracked_filter == MAP_FAILED) {
+        mc_log_print("sampling: failed to map the tracked block filter\n");
+        __tracked_filter = NULL;
+    }
+}
+
+int mc_is_sampling(void)
+{
+    return __sample_rate != 0;
+}
+
+size_t mc_get_sample_rate(void)
+{
+    return __sample_rate;
+}
+
+/* returns 1 if an allocation of size bytes is to be tracked */
+int mc_sample_allocation(size_t size)
+{
+    if (!__sample_rate)
+        return 1;
+
+    if (!__bytes_until_sample)
+        __bytes_until_sample = __next_sample_interval();
+
+    if (__bytes_until_sample > size) {
+        __bytes_until_sample -= size;
+        return 0;
+    }
+    __bytes_until_sample = __next_sample_interval();
+    return 1;
+}
+
+static size_t __hash_usrptr(void *usrptr)
+{
+    return ((uintptr_t)usrptr >> 4) * 0x9e3779b97f4a7c15UL >> (64 - TRACKED_FILTER_BITS);
+}
+
+/* counts a block in before it is added to a table */
+void mc_sample_track(void *usrptr)
+{
+    if (__tracked_filter)
+        __atomic_add_fetch(&__tracked_filter[__hash_usrptr(usrptr)], 1, __ATOMIC_RELEASE);
+}
+
+/* counts a block out after it has left the tables */
+void mc_sample_untrack(void *usrptr)
+{
+    if (__tracked_filter)
+        __atomic_sub_fetch(&__tracked_filter[__hash_usrptr(usrptr)], 1, __ATOMIC_RELEASE);
+}
+
+/* returns 0 only if usrptr is surely not a tracked block */
+int mc_sample_maybe_tracked(void *usrptr)
+{
+    if (!__tracked_filter)
+        return 1;
+    return __atomic_load_n(&__tracked_filter[__hash_usrptr(usrptr)], __ATOMIC_ACQUIRE) != 0;
+}
+
+/* number of blocks a sampled block of usrsize bytes stands for */
+double mc_sample_weight(size_t usrsize)
+{
+    if (!__sample_rate)
+        return 1.0;
+    return 1.0 / -expm1(-(double)(usrsize ? usrsize : 1) / __sample_rate);
+}
+
+/* estimated number of bytes a sampled block of usrsize bytes stands for */
+int64_t mc_sample_estimate(size_t usrsize)
+{
+    if (!__sample_rate)
+        return usrsize;
+    return (int64_t)(usrsize * mc_sample_weight(usrsize) + 0.5);
+}
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "memchk.h"
+
+/*
+ * The scrubber thread checks the red zones of allocated blocks and the
+ * freed blocks in the quarantine in the background, MEMCHK_SCRUB_RATE
+ * blocks per second in ticks of MEMCHK_SCRUB_INTERVAL milliseconds.  Every
+ * tick resumes the walk where the previous one stopped, and a shard lock
+ * is never held for more than a few buckets, so a scan of a large table
+ * does not hold up allocating threads.
+ */
+#define SCRUB_DEFAULT_INTERVAL_MS 100
+
+static size_t __rate;
+static long __interval_ms = SCRUB_DEFAULT_INTERVAL_MS;
+
+static struct memblk_check_cursor __cursor;
+static size_t __num_passes, __num_checked, __num_errors;
+static double __last_pass_sec;
+
+static double __now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *scrub_thread(void *data)
+{
+    size_t budget = __rate * __interval_ms / 1000;
+    struct timespec ts = { __interval_ms / 1000, (__interval_ms % 1000) * 1000000 };
+    double pass_start = __now_sec(), now;
+    int done;
+
+    if (budget == 0)
+        budget = 1;
+
+    mc_log_print("scrub_thread tid = %d\n", mc_gettid());
+    while (1) {
+        nanosleep(&ts, NULL);
+
+        done = mc_check_memblk_step(&__cursor, budget);
+        __num_checked += __cursor.num_checked;
+        __num_errors += __cursor.num_errors;
+        __cursor.num_checked = __cursor.num_errors = 0;
+        if (done) {
+            now = __now_sec();
+            __last_pass_sec = now - pass_start;
+            pass_start = now;
+            __num_passes++;
+            memset(&__cursor, 0, sizeof(__cursor));
+        }
+    }
+    return NULL;
+}
+
+void mc_scrub_init(void)
+{
+    pthread_t pth;
+    char *env;
+
+    if ((env = getenv("MEMCHK_SCRUB_RATE")))
+        __rate = strtoul(env, NULL, 0);
+    if ((env = getenv("MEMCHK_SCRUB_INTERVAL")))
+        __interval_ms = strtol(env, NULL, 0);
+    if (__interval_ms <= 0)
+        __interval_ms = SCRUB_DEFAULT_INTERVAL_MS;
+
+    if (!__rate)
+        return;
+
+    mc_log_print("scrubber = %lu blocks/s every %ld ms\n", __rate, __interval_ms);
+    pthread_create(&pth, NULL, scrub_thread, NULL);
+}
+
+void mc_print_scrub_status(void)
+{
+    if (!__rate)
+        return;
+
+    mc_log_print("scrubber: %lu blocks/s, %lu full passes (last %.2f s), %lu blocks checked, %lu corrupted\n",
+                 __rate, __num_passes, __last_pass_sec, __num_checked, __num_errors);
+}
@@ -1,9 +1,15 @@
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
+#include <time.h>
 #include "memchk.h"
 
+/* interval of the housekeeping done by the work thread while idle */
+#define HOUSEKEEPING_INTERVAL_SEC 1
+
 enum {
     GET_ALL_MEMBLK = 1,
     GET_ALL_MEMBLK_PER_CALLSTACK,
@@ -14,10 +20,11 @@ enum {
     DESTROY_SNAPSHOT,
     GET_HISTOGRAM_MEMBLK,
     GET_VIRTUAL_MEMORY_STATUS,
+    GET_HASHTABLE_STATUS,
 };
 
-static pthread_mutex_t __mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t __cond = PTHREAD_COND_INITIALIZER;
+/* posted from the signal handlers, so no lock is shared with them */
+static sem_t __sem;
 static int __cmd;
 
 static void mc_get_virtual_memory_status(void)
@@ -35,14 +42,20 @@ static void mc_get_virtual_memory_status(void)
 
 static void *work_thread(void *data)
 {
-    int ret;
+    int ret, cmd;
+    struct timespec ts;
 
     mc_log_print("work_thread tid = %d\n", mc_gettid());
-    pthread_mutex_lock(&__mtx);
     while (1) {
-        if (__cmd == 0)
-            pthread_cond_wait(&__cond, &__mtx);
-        switch (__cmd) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += HOUSEKEEPING_INTERVAL_SEC;
+        while (sem_timedwait(&__sem, &ts) && errno == EINTR)
+            ;
+        mc_reclaim_callstacks();
+        mc_allocator_release_empty_batches();
+
+        cmd = __atomic_exchange_n(&__cmd, 0, __ATOMIC_ACQ_REL);
+        switch (cmd) {
         case GET_ALL_MEMBLK:
             mc_print_all_memblk();
             break;
@@ -79,21 +92,20 @@ static void *work_thread(void *data)
         case GET_VIRTUAL_MEMORY_STATUS:
             mc_get_virtual_memory_status();
             break;
+        case GET_HASHTABLE_STATUS:
+            mc_print_hashtable_status();
+            break;
         default:
             break;
         }
-        __cmd = 0;
     }
-    pthread_mutex_unlock(&__mtx);
     return NULL;
 }
 
 static void notify(int cmd)
 {
-    pthread_mutex_lock(&__mtx);
-    __cmd = cmd;
-    pthread_cond_signal(&__cond);
-    pthread_mutex_unlock(&__mtx);
+    __atomic_store_n(&__cmd, cmd, __ATOMIC_RELEASE);
+    sem_post(&__sem);
 }
 
 static void get_status(int sig)
@@ -108,7 +120,28 @@ static void get_status(int sig)
         float val = mc_change_unit(allocated_size, unit);
         mc_log_print(" (%.2f %s)", val, unit);
     }
-    mc_log_print("\n\n");
+    mc_log_print("\n");
+    if (mc_is_sampling()) {
+        double est_size = mc_get_estimated_allocated_size();
+
+        mc_log_print("sampling 1 in %lu bytes\n", mc_get_sample_rate());
+        mc_log_print("estimated allocated blocks: %.0f\n", mc_get_estimated_alloc_memblk_cnt());
+        mc_log_print("estimated allocated size: %.0f bytes", est_size);
+        if (est_size > 1024) {
+            char unit[3];
+            float val = mc_change_unit(est_size, unit);
+            mc_log_print(" (%.2f %s)", val, unit);
+        }
+        mc_log_print("\n");
+    }
+    mc_print_quarantine_status();
+    mc_print_guard_status();
+    mc_print_scrub_status();
+    mc_print_callstack_status();
+    mc_print_symbol_status();
+    mc_print_alloc_blk_status();
+    mc_print_unwinder_status();
+    mc_log_print("\n");
 }
 
 static void get_virtual_memory_status(int sig)
@@ -156,10 +189,16 @@ static void get_histogram_memblk(int sig)
     notify(GET_HISTOGRAM_MEMBLK);
 }
 
+static void get_hashtable_status(int sig)
+{
+    notify(GET_HASHTABLE_STATUS);
+}
+
 void mc_signal_init(void)
 {
     pthread_t pth;
 
+    sem_init(&__sem, 0, 0);
     signal(SIGRTMIN, get_status);
     signal(SIGRTMIN + 1, get_all_memblk);
     signal(SIGRTMIN + 2, get_all_memblk_per_callstack);
@@ -170,5 +209,6 @@ void mc_signal_init(void)
     signal(SIGRTMIN + 7, destroy_snapshot);
     signal(SIGRTMIN + 8, get_histogram_memblk);
     signal(SIGRTMIN + 9, get_virtual_memory_status);
+    signal(SIGRTMIN + 10, get_hashtable_status);
     pthread_create(&pth, NULL, work_thread, NULL);
 }
@@ -7,153 +7,165 @@
 extern struct callstack *mc_callstack_hashtable[CALLSTACK_HASHTABLE_SIZE];
 #endif
 
-static void __copy_alloc_memblk(struct alloc_memblk *dest, struct alloc_memblk *src)
+/* copies are report_memblk so that reports can link them into call stack groups */
+static void __copy_alloc_memblk(struct report_memblk *dest, struct alloc_memblk *src)
 {
-    memcpy(dest, src, sizeof(struct alloc_memblk));
-    dest->memblk.memptr.hash_next = NULL;
+    memcpy(&dest->alloc_memblk, src, sizeof(struct alloc_memblk));
+    dest->alloc_memblk.memblk.memptr.hash_next = NULL;
 
     #ifdef ENABLE_CALLSTACK
     dest->same_callstack_group_prev = NULL;
     dest->same_callstack_group_next = NULL;
+    mc_hold_callstack_id(src->memblk.allocator_id);
     #endif
 }
 
-int mc_duplicate_all_alloc_memblk(struct memptr *dest_hashtable[], size_t dest_size, struct memptr *src_hashtable[], size_t src_size)
+static void __free_report_memblk(struct report_memblk *report_memblk)
+{
+    #ifdef ENABLE_CALLSTACK
+    mc_put_callstack_id(report_memblk->alloc_memblk.memblk.allocator_id);
+    #endif
+    mc_free_report_memblk(report_memblk);
+}
+
+int mc_duplicate_all_alloc_memblk(struct ptr_hashtable *dest_hashtable, struct ptr_hashtable *src_hashtable)
 {
     struct memptr *memptr;
-    struct alloc_memblk *alloc_memblk, *new_memblk;
+    struct alloc_memblk *alloc_memblk;
+    struct report_memblk *new_memblk;
 
-    mc_lock_ptr_hashtable();
+    mc_lock_ptr_hashtable(src_hashtable);
 
-    for_each_hashnode(memptr, src_hashtable, src_size) {
+    for_each_ptr_hashnode(memptr, src_hashtable) {
         alloc_memblk = get_alloc_memblk_from_memptr(memptr);
-        new_memblk = mc_allocate_alloc_memblk();
+        new_memblk = mc_allocate_report_memblk();
         if (!new_memblk) {
-            mc_unlock_ptr_hashtable();
+            mc_unlock_ptr_hashtable(src_hashtable);
             return -1;
         }
         __copy_alloc_memblk(new_memblk, alloc_memblk);
-        mc_add_ptr_hashtable(dest_hashtable, dest_size, &new_memblk->memblk.memptr);
+        mc_add_ptr_hashtable(dest_hashtable, &new_memblk->alloc_memblk.memblk.memptr);
     }
 
-    mc_unlock_ptr_hashtable();
+    mc_unlock_ptr_hashtable(src_hashtable);
 
     return 0;
 }
 
-void mc_destroy_all_alloc_memblk(struct memptr *hashtable[], size_t size)
+void mc_destroy_all_alloc_memblk(struct ptr_hashtable *hashtable)
 {
     struct memptr *memptr;
-    struct alloc_memblk *alloc_memblk, *prev_memblk = NULL;
+    struct report_memblk *report_memblk, *prev_memblk = NULL;
 
-    mc_lock_ptr_hashtable();
+    mc_lock_ptr_hashtable(hashtable);
 
-    for_each_hashnode(memptr, hashtable, size) {
-        alloc_memblk = get_alloc_memblk_from_memptr(memptr);
+    for_each_ptr_hashnode(memptr, hashtable) {
+        report_memblk = get_report_memblk_from_memptr(memptr);
         if (prev_memblk)
-            mc_free_alloc_memblk(prev_memblk);
-        prev_memblk = alloc_memblk;
+            __free_report_memblk(prev_memblk);
+        prev_memblk = report_memblk;
     }
     if (prev_memblk)
-        mc_free_alloc_memblk(prev_memblk);
-    memset(hashtable, 0, sizeof(struct memptr *) * size);
+        __free_report_memblk(prev_memblk);
 
-    mc_unlock_ptr_hashtable();
+    mc_unlock_ptr_hashtable(hashtable);
+
+    mc_clear_ptr_hashtable(hashtable);
 }
 
-static void __free_alloc_memblk_if_not_null(struct alloc_memblk *alloc_memblk)
+static void __free_report_memblk_if_not_null(struct report_memblk *report_memblk)
 {
-    if (alloc_memblk)
-        mc_free_alloc_memblk(alloc_memblk);
+    if (report_memblk)
+        __free_report_memblk(report_memblk);
 }
 
-static struct memptr *__find_snapshot_alloc_memptr_for_current_memptr(struct memptr *snapshot_hashtable[], size_t snapshot_size, struct memptr *current_memptr)
+static struct memptr *__find_snapshot_alloc_memptr_for_current_memptr(struct ptr_hashtable *snapshot_hashtable, struct memptr *current_memptr)
 {
-    struct alloc_memblk *current_alloc_memblk, *snapshot_alloc_memblk;
+    struct report_memblk *current_report_memblk, *snapshot_report_memblk;
+    struct memblk *current_memblk, *snapshot_memblk;
     struct memptr *snapshot_memptr;
 
-    current_alloc_memblk = get_alloc_memblk_from_memptr(current_memptr);
-    snapshot_memptr = mc_find_ptr_hashtable(snapshot_hashtable, snapshot_size, current_memptr->ptr);
+    current_report_memblk = get_report_memblk_from_memptr(current_memptr);
+    current_memblk = &current_report_memblk->alloc_memblk.memblk;
+    snapshot_memptr = mc_find_ptr_hashtable(snapshot_hashtable, current_memptr->ptr);
     if (snapshot_memptr) {
-        snapshot_alloc_memblk = get_alloc_memblk_from_memptr(snapshot_memptr);
+        snapshot_memblk = &get_report_memblk_from_memptr(snapshot_memptr)->alloc_memblk.memblk;
 
-        #ifdef ENABLE_CALLSTACK
-        if (current_alloc_memblk->memblk.usrsize == snapshot_alloc_memblk->memblk.usrsize &&
-            mc_match_callstack(current_alloc_memblk->allocator, snapshot_alloc_memblk->allocator) == 0)
-            return snapshot_memptr;
-        #else
-        if (current_alloc_memblk->memblk.usrsize == snapshot_alloc_memblk->memblk.usrsize)
+        /* interned call stacks are equal if their ids are */
+        if (mc_memblk_usrsize(current_memblk) == mc_memblk_usrsize(snapshot_memblk) &&
+            current_memblk->allocator_id == snapshot_memblk->allocator_id)
             return snapshot_memptr;
-        #endif
     }
     #ifdef ENABLE_CALLSTACK
-    struct callstack *callstack = current_alloc_memblk->allocator;
-    snapshot_alloc_memblk = callstack->same_callstack_group_next[LINK_SNAPSHOT];
-    while (snapshot_alloc_memblk) {
-        if (current_alloc_memblk->memblk.usrsize == snapshot_alloc_memblk->memblk.usrsize)
-            return &snapshot_alloc_memblk->memblk.memptr;
-        snapshot_alloc_memblk = snapshot_alloc_memblk->same_callstack_group_next;
+    struct callstack *callstack = mc_get_callstack_by_id(current_memblk->allocator_id);
+    snapshot_report_memblk = callstack ? callstack->same_callstack_group_next[LINK_SNAPSHOT] : NULL;
+    while (snapshot_report_memblk) {
+        if (mc_memblk_usrsize(current_memblk) == mc_memblk_usrsize(&snapshot_report_memblk->alloc_memblk.memblk))
+            return &snapshot_report_memblk->alloc_memblk.memblk.memptr;
+        snapshot_report_memblk = snapshot_report_memblk->same_callstack_group_next;
     }
     #endif
     return NULL;
 }
 
-static void offset_snapshot_against_current_alloc_memblk(struct memptr *current_hashtable[], size_t current_size, int *num_remainings_current, struct memptr *snapshot_hashtable[], size_t snapshot_size, int *num_remainings_snapshot)
+static void offset_snapshot_against_current_alloc_memblk(struct ptr_hashtable *current_hashtable, int *num_remainings_current, struct ptr_hashtable *snapshot_hashtable, int *num_remainings_snapshot)
 {
     struct memptr *current_memptr, *snapshot_memptr;
-    struct alloc_memblk *current_alloc_memblk, *snapshot_alloc_memblk;
-    struct alloc_memblk *prev_current_alloc_memblk = NULL, *prev_snapshot_alloc_memblk = NULL;
+    struct report_memblk *current_report_memblk, *snapshot_report_memblk;
+    struct report_memblk *prev_current_report_memblk = NULL, *prev_snapshot_report_memblk = NULL;
 
-    *num_remainings_current = 0;
-    *num_remainings_snapshot = 0;
+    *num_remainings_current = mc_count_ptr_hashtable(current_hashtable);
+    *num_remainings_snapshot = mc_count_ptr_hashtable(snapshot_hashtable);
 
-    for_each_hashnode(current_memptr, current_hashtable, current_size) {
-        (*num_remainings_current)++;
-    }
+    /* removing entries while walking is fine, but rehashing must not move them */
+    mc_lock_ptr_hashtable(current_hashtable);
+    mc_lock_ptr_hashtable(snapshot_hashtable);
 
-    for_each_hashnode(snapshot_memptr, snapshot_hashtable, snapshot_size) {
-        (*num_remainings_snapshot)++;
-    }
-
-    for_each_hashnode(current_memptr, current_hashtable, current_size) {
-        __free_alloc_memblk_if_not_null(prev_snapshot_alloc_memblk);
-        __free_alloc_memblk_if_not_null(prev_current_alloc_memblk);
-        snapshot_memptr =  __find_snapshot_alloc_memptr_for_current_memptr(snapshot_hashtable, snapshot_size, current_memptr);
+    for_each_ptr_hashnode(current_memptr, current_hashtable) {
+        __free_report_memblk_if_not_null(prev_snapshot_report_memblk);
+        __free_report_memblk_if_not_null(prev_current_report_memblk);
+        snapshot_memptr =  __find_snapshot_alloc_memptr_for_current_memptr(snapshot_hashtable, current_memptr);
         if (snapshot_memptr) {
-            mc_remove_ptr_hashtable(snapshot_hashtable, snapshot_size, snapshot_memptr->ptr);
-            mc_remove_ptr_hashtable(current_hashtable, current_size, current_memptr->ptr);
+            mc_remove_ptr_hashtable(snapshot_hashtable, snapshot_memptr->ptr);
+            mc_remove_ptr_hashtable(current_hashtable, current_memptr->ptr);
 
-            snapshot_alloc_memblk = get_alloc_memblk_from_memptr(snapshot_memptr);
-            current_alloc_memblk = get_alloc_memblk_from_memptr(current_memptr);
+            snapshot_report_memblk = get_report_memblk_from_memptr(snapshot_memptr);
+            current_report_memblk = get_report_memblk_from_memptr(current_memptr);
 
             #ifdef ENABLE_CALLSTACK
-            mc_unlink_memblk_from_callstack(snapshot_alloc_memblk, snapshot_alloc_memblk->allocator, LINK_SNAPSHOT);
-            mc_unlink_memblk_from_callstack(current_alloc_memblk, current_alloc_memblk->allocator, LINK_CURRENT);
+            /* copies without a call stack were never linked */
+            if (snapshot_report_memblk->alloc_memblk.memblk.allocator_id) {
+                mc_unlink_memblk_from_callstack(snapshot_report_memblk, mc_get_callstack_by_id(snapshot_report_memblk->alloc_memblk.memblk.allocator_id), LINK_SNAPSHOT);
+                mc_unlink_memblk_from_callstack(current_report_memblk, mc_get_callstack_by_id(current_report_memblk->alloc_memblk.memblk.allocator_id), LINK_CURRENT);
+            }
             #endif
 
             (*num_remainings_current)--;
             (*num_remainings_snapshot)--;
-            prev_snapshot_alloc_memblk = snapshot_alloc_memblk;
-            prev_current_alloc_memblk = current_alloc_memblk;
+            prev_snapshot_report_memblk = snapshot_report_memblk;
+            prev_current_report_memblk = current_report_memblk;
         } else {
-            prev_snapshot_alloc_memblk = NULL;
-            prev_current_alloc_memblk = NULL;
+            prev_snapshot_report_memblk = NULL;
+            prev_current_report_memblk = NULL;
         }
     }
-    __free_alloc_memblk_if_not_null(prev_snapshot_alloc_memblk);
-    __free_alloc_memblk_if_not_null(prev_current_alloc_memblk);
+    __free_report_memblk_if_not_null(prev_snapshot_report_memblk);
+    __free_report_memblk_if_not_null(prev_current_report_memblk);
+
+    mc_unlock_ptr_hashtable(snapshot_hashtable);
+    mc_unlock_ptr_hashtable(current_hashtable);
 }
 
-int mc_compare_snapshot_and_current_alloc_memblk(struct memptr *current_hashtable[], size_t current_size, struct memptr *snapshot_hashtable[], size_t snapshot_size)
+int mc_compare_snapshot_and_current_alloc_memblk(struct ptr_hashtable *current_hashtable, struct ptr_hashtable *snapshot_hashtable)
 {
     int num_remainings_current, num_remainings_snapshot;
 
     #ifdef ENABLE_CALLSTACK
-    mc_link_same_callstack_group(current_hashtable, current_size, LINK_CURRENT);
-    mc_link_same_callstack_group(snapshot_hashtable, snapshot_size, LINK_SNAPSHOT);
+    mc_link_same_callstack_group(current_hashtable, LINK_CURRENT);
+    mc_link_same_callstack_group(snapshot_hashtable, LINK_SNAPSHOT);
     #endif
 
-    offset_snapshot_against_current_alloc_memblk(current_hashtable, current_size, &num_remainings_current, snapshot_hashtable, snapshot_size, &num_remainings_snapshot);
+    offset_snapshot_against_current_alloc_memblk(current_hashtable, &num_remainings_current, snapshot_hashtable, &num_remainings_snapshot);
 
     mc_disable_hook();
     mc_init_filemaps_from_procmap();
@@ -161,13 +173,13 @@ int mc_compare_snapshot_and_current_alloc_memblk(struct memptr *current_hashtabl
 
     if (num_remainings_current) {
         mc_log_print("%d blocks increased:\n\n", num_remainings_current);
-        __print_all_memblk_on_hashtable(current_hashtable, current_size);
+        __print_all_memblk_on_hashtable(current_hashtable);
     } else
         mc_log_print("no block increased\n");
 
     if (num_remainings_snapshot) {
         mc_log_print("%d blocks decreased:\n\n", num_remainings_snapshot);
-        __print_all_memblk_on_hashtable(snapshot_hashtable, snapshot_size);
+        __print_all_memblk_on_hashtable(snapshot_hashtable);
     } else
         mc_log_print("no block deceased\n");
 
@@ -184,16 +196,16 @@ int mc_compare_snapshot_and_current_alloc_memblk(struct memptr *current_hashtabl
 }
 
 #ifdef ENABLE_CALLSTACK
-int mc_compare_snapshot_and_current_alloc_memblk_per_callstack(struct memptr *current_hashtable[], size_t current_size, struct memptr *snapshot_hashtable[], size_t snapshot_size)
+int mc_compare_snapshot_and_current_alloc_memblk_per_callstack(struct ptr_hashtable *current_hashtable, struct ptr_hashtable *snapshot_hashtable)
 {
     int num_remainings_current, num_remainings_snapshot, cnt = 0;
-    struct alloc_memblk *alloc_memblk;
+    struct report_memblk *report_memblk;
     struct callstack *callstack;
 
-    mc_link_same_callstack_group(current_hashtable, current_size, LINK_CURRENT);
-    mc_link_same_callstack_group(snapshot_hashtable, snapshot_size, LINK_SNAPSHOT);
+    mc_link_same_callstack_group(current_hashtable, LINK_CURRENT);
+    mc_link_same_callstack_group(snapshot_hashtable, LINK_SNAPSHOT);
 
-    offset_snapshot_against_current_alloc_memblk(current_hashtable, current_size, &num_remainings_current, snapshot_hashtable, snapshot_size, &num_remainings_snapshot);
+    offset_snapshot_against_current_alloc_memblk(current_hashtable, &num_remainings_current, snapshot_hashtable, &num_remainings_snapshot);
 
     if (num_remainings_current + num_remainings_snapshot == 0) {
         mc_log_print("no block changed\n");
@@ -226,16 +238,16 @@ int mc_compare_snapshot_and_current_alloc_memblk_per_callstack(struct memptr *cu
             continue;
 
         callstack->total_size = 0;
-        alloc_memblk = callstack->same_callstack_group_next[LINK_CURRENT];
-        while (alloc_memblk) {
-            callstack->total_size += (int64_t)alloc_memblk->memblk.usrsize;
-            alloc_memblk = alloc_memblk->same_callstack_group_next;
+        report_memblk = callstack->same_callstack_group_next[LINK_CURRENT];
+        while (report_memblk) {
+            callstack->total_size += mc_sample_estimate(mc_memblk_usrsize(&report_memblk->alloc_memblk.memblk));
+            report_memblk = report_memblk->same_callstack_group_next;
         }
 
-        alloc_memblk = callstack->same_callstack_group_next[LINK_SNAPSHOT];
-        while (alloc_memblk) {
-            callstack->total_size -= (int64_t)alloc_memblk->memblk.usrsize;
-            alloc_memblk = alloc_memblk->same_callstack_group_next;
+        report_memblk = callstack->same_callstack_group_next[LINK_SNAPSHOT];
+        while (report_memblk) {
+            callstack->total_size -= mc_sample_estimate(mc_memblk_usrsize(&report_memblk->alloc_memblk.memblk));
+            report_memblk = report_memblk->same_callstack_group_next;
         }
         callstack_array[i++] = callstack;
     }
@@ -243,23 +255,24 @@ int mc_compare_snapshot_and_current_alloc_memblk_per_callstack(struct memptr *cu
     mc_unlock_callstack_hashtable();
 
     mc_sort_per_callstack(callstack_array, total_callstacks);
+    mc_resolve_callstack_symbols(callstack_array, total_callstacks, 2);
 
     for (i = 0; i < total_callstacks; i++) {
         callstack = callstack_array[i];
 
         mc_log_print("group %d: ", cnt++);
-        alloc_memblk = callstack->same_callstack_group_next[LINK_CURRENT];
-        while (alloc_memblk) {
-            mc_log_print("%lu ", alloc_memblk->memblk.usrsize);
-            alloc_memblk = alloc_memblk->same_callstack_group_next;
+        report_memblk = callstack->same_callstack_group_next[LINK_CURRENT];
+        while (report_memblk) {
+            mc_log_print("%lu ", mc_memblk_usrsize(&report_memblk->alloc_memblk.memblk));
+            report_memblk = report_memblk->same_callstack_group_next;
         }
 
-        alloc_memblk = callstack->same_callstack_group_next[LINK_SNAPSHOT];
-        while (alloc_memblk) {
-                mc_log_print("-%lu ", alloc_memblk->memblk.usrsize);
-                alloc_memblk = alloc_memblk->same_callstack_group_next;
+        report_memblk = callstack->same_callstack_group_next[LINK_SNAPSHOT];
+        while (report_memblk) {
+                mc_log_print("-%lu ", mc_memblk_usrsize(&report_memblk->alloc_memblk.memblk));
+                report_memblk = report_memblk->same_callstack_group_next;
         }
-        mc_log_print(" (total %ld bytes)\n---\n", callstack->total_size);
+        mc_log_print(mc_is_sampling() ? " (estimated total %ld bytes)\n---\n" : " (total %ld bytes)\n---\n", callstack->total_size);
         mc_print_callstack(callstack->depth, callstack->trace, 2);
         mc_log_print("\n");
     }
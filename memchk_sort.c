@@ -22,9 +22,9 @@ static int __compare_by_alloc_memblk(const void *n1, const void *n2)
     struct alloc_memblk *alloc_memblk2 = *(struct alloc_memblk **)n2;
 
     #ifdef SORT_BY_ASCENDING_ORDER
-    return (int)alloc_memblk1->memblk.usrsize - (int)alloc_memblk2->memblk.usrsize;
+    return (int)mc_memblk_usrsize(&alloc_memblk1->memblk) - (int)mc_memblk_usrsize(&alloc_memblk2->memblk);
     #else
-    return (int)alloc_memblk2->memblk.usrsize - (int)alloc_memblk1->memblk.usrsize;
+    return (int)mc_memblk_usrsize(&alloc_memblk2->memblk) - (int)mc_memblk_usrsize(&alloc_memblk1->memblk);
     #endif
 }
 
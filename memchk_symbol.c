@@ -1,101 +1,572 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <pthread.h>
-#include <bfd.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
 #include "memchk.h"
+#include "memchk_alloc.h"
 
 #define SYMBOL_LOCK() pthread_mutex_lock(&__mtx)
 #define SYMBOL_UNLOK() pthread_mutex_unlock(&__mtx)
+/* serializes the use of the BFDs in the module table */
+#define BFD_LOCK() pthread_mutex_lock(&__bfd_mtx)
+#define BFD_UNLOCK() pthread_mutex_unlock(&__bfd_mtx)
 
+#ifdef ENABLE_BFD
 #define DMGL_PARAMS (1 << 0)
 #define DMGL_ANSI   (1 << 1)
 
-static asymbol **__symbols;
-static const char *__filename;
-static const char *__funcname;
-static unsigned int __line;
-static bfd_boolean __found;
-static off_t __offset;
+/* state of one mc_get_symbol_from_offset() call */
+struct symbol_lookup {
+    asymbol **symbols;
+    off_t offset;
+    bfd_boolean found;
+    const char *filename;
+    const char *funcname;
+    unsigned int line;
+};
+
+static pthread_mutex_t __bfd_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int __offline;
+#else
+/* without libbfd return addresses can only be resolved by memchk-symbolize */
+static int __offline = 1;
+#endif
 
 static pthread_mutex_t __mtx = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Symbolized return addresses are cached, so a report resolves every
+ * distinct frame in BFD once however many callstacks share it.  Function
+ * and file names are interned, an inline chain or a file shared by many
+ * frames is stored once.  Entries and strings are carved out of mmap()ed
+ * chunks and only released all together: when the module table is
+ * reloaded, and after every report if MEMCHK_SYMBOL_CACHE is 0.
+ */
+#define SYMCACHE_HASH_BITS  14
+#define SYMCACHE_HASH_SIZE  (1 << SYMCACHE_HASH_BITS)
+#define SYMCACHE_CHUNK_SIZE (64 * 1024)
+#define MAX_UNWIND_INLINE   10
+
+/*
+ * Large reports resolve their distinct uncached addresses up front with
+ * MEMCHK_SYMBOL_THREADS workers.  Each worker takes runs of addresses in
+ * address order, which keeps a run within one module, and opens its own
+ * BFD for every module it meets.
+ */
+#define SYMBOL_DEFAULT_MAX_THREADS  8
+#define SYMBOL_PARALLEL_MIN         256
+#define SYMBOL_WORKER_RUN           64
+#define SYMBOL_WORKER_MAX_BFDS      32
+
+struct symcache_string {
+    struct symcache_string *next;
+    unsigned int hash;
+    char str[];
+};
+
+struct symcache_chunk {
+    struct symcache_chunk *next;
+    size_t used;
+};
+
+static struct symcache_entry *__symcache[SYMCACHE_HASH_SIZE];
+static struct symcache_string *__symcache_string[SYMCACHE_HASH_SIZE];
+static struct symcache_chunk *__symcache_chunk;
+static size_t __num_symcache_entries, __num_symcache_strings, __num_symcache_chunks;
+static size_t __num_symcache_hits, __num_symcache_misses;
+static int __keep_symcache = 1;
+static int __num_threads = 1;
+
+static void *__symcache_alloc(size_t size)
+{
+    struct symcache_chunk *chunk = __symcache_chunk;
+    void *ptr;
+
+    size = __get_aligned_size(size, sizeof(void *));
+    if (size > SYMCACHE_CHUNK_SIZE - sizeof(struct symcache_chunk))
+        return NULL;
+
+    if (!chunk || chunk->used + size > SYMCACHE_CHUNK_SIZE) {
+        chunk = (struct symcache_chunk *)mmap(NULL, SYMCACHE_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == (struct symcache_chunk *)MAP_FAILED)
+            return NULL;
+        chunk->next = __symcache_chunk;
+        chunk->used = sizeof(struct symcache_chunk);
+        __symcache_chunk = chunk;
+        __num_symcache_chunks++;
+    }
+
+    ptr = (uint8_t *)chunk + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+static inline unsigned int __symcache_hash(void *addr)
+{
+    return ((uintptr_t)addr * 0x9e3779b97f4a7c15ULL) >> (64 - SYMCACHE_HASH_BITS);
+}
+
+static const char *__intern_string(const char *str)
+{
+    struct symcache_string *string;
+    unsigned int hash = 2166136261u;
+    const char *c;
+    size_t len;
+
+    for (c = str; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    len = c - str;
+
+    for (string = __symcache_string[hash & (SYMCACHE_HASH_SIZE - 1)]; string; string = string->next) {
+        if (string->hash == hash && !strcmp(string->str, str))
+            return string->str;
+    }
+
+    string = (struct symcache_string *)__symcache_alloc(sizeof(*string) + len + 1);
+    if (!string)
+        return NULL;
+    string->hash = hash;
+    memcpy(string->str, str, len + 1);
+    string->next = __symcache_string[hash & (SYMCACHE_HASH_SIZE - 1)];
+    __symcache_string[hash & (SYMCACHE_HASH_SIZE - 1)] = string;
+    __num_symcache_strings++;
+
+    return string->str;
+}
+
+static struct symcache_entry *__find_symcache(void *addr)
+{
+    struct symcache_entry *entry;
+
+    for (entry = __symcache[__symcache_hash(addr)]; entry; entry = entry->next) {
+        if (entry->addr == addr)
+            return entry;
+    }
+    return NULL;
+}
+
+static struct symcache_entry *__add_symcache(void *addr, const char *filemapname, off_t offset, struct funcsymbol funcsymbol[], int num_inline)
+{
+    struct symcache_entry *entry;
+    int i;
+
+    if ((entry = __find_symcache(addr)))
+        return entry;
+
+    entry = (struct symcache_entry *)__symcache_alloc(sizeof(*entry) + sizeof(entry->frame[0]) * num_inline);
+    if (!entry)
+        return NULL;
+
+    entry->addr = addr;
+    entry->filemapname = filemapname ? __intern_string(filemapname) : NULL;
+    entry->offset = offset;
+    entry->num_inline = num_inline;
+    for (i = 0; i < num_inline; i++) {
+        entry->frame[i].funcname = __intern_string(funcsymbol[i].funcname);
+        entry->frame[i].srcfilename = __intern_string(funcsymbol[i].srcfilename);
+        entry->frame[i].line = funcsymbol[i].line;
+        if (!entry->frame[i].funcname || !entry->frame[i].srcfilename)
+            return NULL;
+    }
+    if (filemapname && !entry->filemapname)
+        return NULL;
+
+    entry->next = __symcache[__symcache_hash(addr)];
+    __symcache[__symcache_hash(addr)] = entry;
+    __num_symcache_entries++;
+
+    return entry;
+}
+
+static void __flush_symcache(void)
+{
+    struct symcache_chunk *chunk, *next;
+
+    for (chunk = __symcache_chunk; chunk; chunk = next) {
+        next = chunk->next;
+        munmap(chunk, SYMCACHE_CHUNK_SIZE);
+    }
+    __symcache_chunk = NULL;
+    memset(__symcache, 0, sizeof(__symcache));
+    memset(__symcache_string, 0, sizeof(__symcache_string));
+    __num_symcache_entries = __num_symcache_strings = __num_symcache_chunks = 0;
+}
+
+/* called when the module table is reloaded */
+void mc_flush_symbol_cache(void)
+{
+    SYMBOL_LOCK();
+    __flush_symcache();
+    SYMBOL_UNLOK();
+}
+
+/* called when the last report using the module table has finished */
+void mc_release_symbol_cache(void)
+{
+    if (__keep_symcache)
+        return;
+
+    SYMBOL_LOCK();
+    __flush_symcache();
+    SYMBOL_UNLOK();
+}
+
+void mc_symbol_init(void)
+{
+    char *env;
+
+    if ((env = getenv("MEMCHK_SYMBOL_CACHE")))
+        __keep_symcache = strtol(env, NULL, 0) != 0;
+    #ifdef ENABLE_BFD
+    if ((env = getenv("MEMCHK_SYMBOLIZE")))
+        __offline = !strcmp(env, "offline");
+    #endif
+    __num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (__num_threads > SYMBOL_DEFAULT_MAX_THREADS)
+        __num_threads = SYMBOL_DEFAULT_MAX_THREADS;
+    if ((env = getenv("MEMCHK_SYMBOL_THREADS")))
+        __num_threads = strtol(env, NULL, 0);
+    if (__num_threads < 1)
+        __num_threads = 1;
+    if (__offline)
+        mc_log_print("symbols = offline, resolve the logs with memchk-symbolize\n");
+}
+
+int mc_is_offline_symbol(void)
+{
+    return __offline;
+}
+
+void mc_print_symbol_status(void)
+{
+    if (__offline)
+        return;
+
+    mc_log_print("symbol cache: %lu addresses, %lu strings, %lu KB, %lu hits, %lu misses\n",
+                 __num_symcache_entries, __num_symcache_strings, __num_symcache_chunks * SYMCACHE_CHUNK_SIZE / 1024,
+                 __num_symcache_hits, __num_symcache_misses);
+}
+
 int mc_prepare_symbol(void)
 {
     return mc_init_filemaps_from_procmap();
 }
 
-static void find_address_in_section (bfd *abfd, asection *section, void *data ATTRIBUTE_UNUSED)
+#ifdef ENABLE_BFD
+static void find_address_in_section (bfd *abfd, asection *section, void *data)
 {
+    struct symbol_lookup *lookup = (struct symbol_lookup *)data;
     bfd_vma vma;
     bfd_size_type size;
 
-    if (__found)
+    if (lookup->found)
         return;
 
     if ((bfd_section_flags(section) & SEC_ALLOC) == 0)
         return;
 
     vma = bfd_section_vma(section);
-    if (__offset < vma)
+    if (lookup->offset < vma)
         return;
 
     size = bfd_section_size(section);
-    if (__offset >= vma + size)
+    if (lookup->offset >= vma + size)
         return;
 
-    __found = bfd_find_nearest_line(abfd, section, __symbols, __offset - bfd_section_vma(section), &__filename, &__funcname, &__line);
+    lookup->found = bfd_find_nearest_line(abfd, section, lookup->symbols, lookup->offset - vma, &lookup->filename, &lookup->funcname, &lookup->line);
 }
 
+/* reentrant, but abfd must not be used by another thread meanwhile */
 int mc_get_symbol_from_offset(bfd *abfd, asymbol **symbols, off_t offset, int do_demangle, struct funcsymbol funcsymbol[], int max_unwind_inline)
 {
+    struct symbol_lookup lookup = { .symbols = symbols, .offset = offset };
     int i = 0;
 
-    __found = FALSE;
-    __symbols = symbols;
-    __offset = offset;
+    bfd_map_over_sections(abfd, find_address_in_section, &lookup);
+    if (!lookup.found || !lookup.funcname)
+        return 0;
 
-    SYMBOL_LOCK();
-    bfd_map_over_sections(abfd, find_address_in_section, NULL);
-    if (__found && __funcname) {
-        while (1) {
-            if (__filename)
-                strncpy(funcsymbol[i].srcfilename, __filename, MAX_SYMFILENAME_LEN - 1);
-            else
-                funcsymbol[i].srcfilename[0] = 0;
-            if (do_demangle) {
-                mc_disable_hook();
-                char *alloc = bfd_demangle(abfd, __funcname, DMGL_ANSI | DMGL_PARAMS);
-                mc_enable_hook();
-                if (alloc) {
-                    strncpy(funcsymbol[i].funcname, alloc, MAX_SYMFUNCNAME_LEN - 1);
-                    mc_orig_free(alloc);
-                } else
-                    strncpy(funcsymbol[i].funcname, __funcname, MAX_SYMFUNCNAME_LEN - 1);
+    while (1) {
+        if (lookup.filename)
+            strncpy(funcsymbol[i].srcfilename, lookup.filename, MAX_SYMFILENAME_LEN - 1);
+        else
+            funcsymbol[i].srcfilename[0] = 0;
+        if (do_demangle) {
+            mc_disable_hook();
+            char *alloc = bfd_demangle(abfd, lookup.funcname, DMGL_ANSI | DMGL_PARAMS);
+            mc_enable_hook();
+            if (alloc) {
+                strncpy(funcsymbol[i].funcname, alloc, MAX_SYMFUNCNAME_LEN - 1);
+                mc_orig_free(alloc);
             } else
-                strncpy(funcsymbol[i].funcname, __funcname, MAX_SYMFUNCNAME_LEN - 1);
-            funcsymbol[i].line = __line;
-            i++;
-            if (!(i < max_unwind_inline && bfd_find_inliner_info(abfd, &__filename, &__funcname, &__line)))
-                break;
+                strncpy(funcsymbol[i].funcname, lookup.funcname, MAX_SYMFUNCNAME_LEN - 1);
+        } else
+            strncpy(funcsymbol[i].funcname, lookup.funcname, MAX_SYMFUNCNAME_LEN - 1);
+        funcsymbol[i].funcname[MAX_SYMFUNCNAME_LEN - 1] = 0;
+        funcsymbol[i].srcfilename[MAX_SYMFILENAME_LEN - 1] = 0;
+        funcsymbol[i].line = lookup.line;
+        i++;
+        if (!(i < max_unwind_inline && bfd_find_inliner_info(abfd, &lookup.filename, &lookup.funcname, &lookup.line)))
+            break;
+    }
+    return i;
+}
+#endif
+
+/*
+ * Returns the demangled symbolization of addr, or NULL if it cannot be
+ * stored.  The entry stays valid until mc_term_filemaps() of the report.
+ */
+const struct symcache_entry *mc_lookup_symbol(void *addr)
+{
+    struct symcache_entry *entry;
+    struct filemap *filemap;
+    struct funcsymbol funcsymbol[MAX_UNWIND_INLINE];
+    off_t offset = 0;
+    int num_inline = 0;
+
+    SYMBOL_LOCK();
+    entry = __find_symcache(addr);
+    if (entry)
+        __num_symcache_hits++;
+    else
+        __num_symcache_misses++;
+    SYMBOL_UNLOK();
+    if (entry)
+        return entry;
+
+    #ifdef ENABLE_BFD
+    filemap = mc_find_and_init_bfd_filemap(addr);
+    if (filemap) {
+        offset = (off_t)(addr - filemap->start_addr) + filemap->file_offset;
+        BFD_LOCK();
+        num_inline = mc_get_symbol_from_offset(filemap->abfd, filemap->symbols, offset, 1, funcsymbol, MAX_UNWIND_INLINE);
+        BFD_UNLOCK();
+    }
+    #else
+    filemap = mc_find_filemap(addr);
+    if (filemap)
+        offset = (off_t)(addr - filemap->start_addr) + filemap->file_offset;
+    #endif
+
+    SYMBOL_LOCK();
+    entry = __add_symcache(addr, filemap ? filemap->name : NULL, offset, funcsymbol, num_inline);
+    SYMBOL_UNLOK();
+
+    return entry;
+}
+
+#ifdef ENABLE_BFD
+struct symbol_job {
+    void **addrs;
+    size_t num;
+    size_t next;
+};
+
+struct symbol_worker_bfd {
+    struct filemap *filemap;
+    bfd *abfd;
+    asymbol **symbols;
+};
+
+static struct symbol_worker_bfd *__get_worker_bfd(struct symbol_worker_bfd bfds[], int *num_bfds, struct filemap *filemap)
+{
+    struct symbol_worker_bfd *wbfd;
+    int i;
+
+    for (i = *num_bfds - 1; i >= 0; i--) {
+        if (bfds[i].filemap == filemap)
+            return bfds[i].abfd ? &bfds[i] : NULL;
+    }
+
+    if (*num_bfds == SYMBOL_WORKER_MAX_BFDS) {
+        for (i = 0; i < *num_bfds; i++)
+            mc_close_bfd(bfds[i].abfd, bfds[i].symbols);
+        *num_bfds = 0;
+    }
+
+    wbfd = &bfds[(*num_bfds)++];
+    wbfd->filemap = filemap;
+    wbfd->abfd = NULL;
+    wbfd->symbols = NULL;
+    if (filemap->no_symbols || mc_open_bfd(filemap->name, &wbfd->abfd, &wbfd->symbols) < 0)
+        return NULL;
+    return wbfd;
+}
+
+static void *__symbol_worker(void *data)
+{
+    struct symbol_job *job = (struct symbol_job *)data;
+    struct symbol_worker_bfd bfds[SYMBOL_WORKER_MAX_BFDS], *wbfd;
+    struct funcsymbol funcsymbol[MAX_UNWIND_INLINE];
+    struct filemap *filemap;
+    size_t i, start, end;
+    int num_bfds = 0, num_inline;
+    off_t offset;
+
+    mc_disable_hook();
+    while ((start = __atomic_fetch_add(&job->next, SYMBOL_WORKER_RUN, __ATOMIC_RELAXED)) < job->num) {
+        end = start + SYMBOL_WORKER_RUN < job->num ? start + SYMBOL_WORKER_RUN : job->num;
+        for (i = start; i < end; i++) {
+            /* left to mc_lookup_symbol(), which records the failure */
+            if (!(filemap = mc_find_filemap(job->addrs[i])))
+                continue;
+            if (!(wbfd = __get_worker_bfd(bfds, &num_bfds, filemap)))
+                continue;
+
+            offset = (off_t)(job->addrs[i] - filemap->start_addr) + filemap->file_offset;
+            num_inline = mc_get_symbol_from_offset(wbfd->abfd, wbfd->symbols, offset, 1, funcsymbol, MAX_UNWIND_INLINE);
+
+            SYMBOL_LOCK();
+            __add_symcache(job->addrs[i], filemap->name, offset, funcsymbol, num_inline);
+            SYMBOL_UNLOK();
         }
-        SYMBOL_UNLOK();
-        return i;
-    } else {
-        SYMBOL_UNLOK();
-        return 0;
     }
+
+    for (i = 0; i < num_bfds; i++)
+        mc_close_bfd(bfds[i].abfd, bfds[i].symbols);
+    mc_enable_hook();
+
+    return NULL;
+}
+
+/*
+ * libbfd keeps global state (the cache of open files, bfd_error) that is
+ * only protected since binutils 2.42, when the caller hands it a lock
+ * through bfd_thread_init().  With an older libbfd, or one built without
+ * thread support, reports are resolved by the reporting thread alone; use
+ * memchk-symbolize to resolve large reports out of process instead.
+ */
+typedef bool (*bfd_lock_fn)(void *);
+
+static pthread_mutex_t __bfd_global_mtx = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_once_t __bfd_thread_once = PTHREAD_ONCE_INIT;
+static int __bfd_thread_safe;
+
+static bool __bfd_global_lock(void *data)
+{
+    return pthread_mutex_lock(&__bfd_global_mtx) == 0;
+}
+
+static bool __bfd_global_unlock(void *data)
+{
+    return pthread_mutex_unlock(&__bfd_global_mtx) == 0;
+}
+
+static void __init_bfd_thread(void)
+{
+    bool (*thread_init)(bfd_lock_fn, bfd_lock_fn, void *);
+
+    thread_init = (bool (*)(bfd_lock_fn, bfd_lock_fn, void *))dlsym(RTLD_DEFAULT, "bfd_thread_init");
+    __bfd_thread_safe = thread_init && thread_init(__bfd_global_lock, __bfd_global_unlock, NULL);
+    if (!__bfd_thread_safe)
+        mc_log_print("libbfd is not thread-safe, symbols are resolved by one thread\n");
+}
+
+static int __compare_addr(const void *a, const void *b)
+{
+    uintptr_t addr1 = (uintptr_t)*(void **)a, addr2 = (uintptr_t)*(void **)b;
+
+    return addr1 < addr2 ? -1 : addr1 > addr2;
+}
+#endif
+
+/*
+ * Resolves the addresses in addrs[] that are not cached yet in parallel, so
+ * that printing the report only hits the cache.  addrs[] is reordered.
+ * Must be called between mc_init_filemaps_*() and mc_term_filemaps().
+ */
+void mc_resolve_symbols(void *addrs[], size_t num)
+{
+    #ifdef ENABLE_BFD
+    pthread_t pth[SYMBOL_DEFAULT_MAX_THREADS * 8];
+    struct symbol_job job = { .addrs = addrs };
+    size_t i;
+    int num_threads, n;
+
+    if (__offline || __num_threads < 2 || num < SYMBOL_PARALLEL_MIN)
+        return;
+
+    mc_disable_hook();
+    pthread_once(&__bfd_thread_once, __init_bfd_thread);
+    mc_enable_hook();
+    if (!__bfd_thread_safe)
+        return;
+
+    mc_disable_hook();
+    qsort(addrs, num, sizeof(addrs[0]), __compare_addr);
+    mc_enable_hook();
+
+    SYMBOL_LOCK();
+    for (i = 0; i < num; i++) {
+        if ((job.num && addrs[i] == addrs[job.num - 1]) || __find_symcache(addrs[i]))
+            continue;
+        addrs[job.num++] = addrs[i];
+    }
+    SYMBOL_UNLOK();
+
+    if (job.num < SYMBOL_PARALLEL_MIN)
+        return;
+
+    num_threads = __num_threads;
+    if (num_threads > sizeof(pth) / sizeof(pth[0]))
+        num_threads = sizeof(pth) / sizeof(pth[0]);
+    if (num_threads > job.num / SYMBOL_WORKER_RUN)
+        num_threads = job.num / SYMBOL_WORKER_RUN;
+
+    mc_disable_hook();
+    for (n = 0; n < num_threads; n++) {
+        if (pthread_create(&pth[n], NULL, __symbol_worker, &job))
+            break;
+    }
+    /* whatever is left over is resolved while printing */
+    while (n > 0)
+        pthread_join(pth[--n], NULL);
+    mc_enable_hook();
+    #endif
 }
 
+#ifdef ENABLE_BFD
 int mc_get_symbol(void *addr, int do_demangle, char *filemapname, int max_name_len, off_t *offset, struct funcsymbol funcsymbol[], int max_unwind_inline)
 {
-    struct filemap *filemap = mc_find_and_init_bfd_filemap(addr);
+    const struct symcache_entry *entry;
+    struct filemap *filemap;
+    int i;
+
+    if (do_demangle && (entry = mc_lookup_symbol(addr))) {
+        if (!entry->filemapname)
+            return -1;
+
+        strncpy(filemapname, entry->filemapname, max_name_len > MAX_FILEMAPNAME_LEN ? MAX_FILEMAPNAME_LEN - 1 : max_name_len - 1);
+        *offset = entry->offset;
+        for (i = 0; i < entry->num_inline && i < max_unwind_inline; i++) {
+            strncpy(funcsymbol[i].funcname, entry->frame[i].funcname, MAX_SYMFUNCNAME_LEN - 1);
+            strncpy(funcsymbol[i].srcfilename, entry->frame[i].srcfilename, MAX_SYMFILENAME_LEN - 1);
+            funcsymbol[i].line = entry->frame[i].line;
+        }
+        return i;
+    }
 
+    filemap = mc_find_and_init_bfd_filemap(addr);
     if (!filemap)
         return -1;
 
     strncpy(filemapname, filemap->name, max_name_len > MAX_FILEMAPNAME_LEN ? MAX_FILEMAPNAME_LEN - 1 : max_name_len - 1);
 
     *offset = (off_t)(addr - filemap->start_addr) + filemap->file_offset;
-    return mc_get_symbol_from_offset(filemap->abfd, filemap->symbols, *offset, do_demangle, funcsymbol, max_unwind_inline);
+    BFD_LOCK();
+    i = mc_get_symbol_from_offset(filemap->abfd, filemap->symbols, *offset, do_demangle, funcsymbol, max_unwind_inline);
+    BFD_UNLOCK();
+
+    return i;
 }
+#endif
 
 int mc_get_symbol_offset(void *addr, char *filemapname, int max_name_len, off_t *offset)
 {
@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bfd.h>
+
+/*
+ * memchk-symbolize resolves the logs of a target run with
+ * MEMCHK_SYMBOLIZE=offline, which carry "#PC <addr>" lines instead of
+ * symbols and "#MODULE" lines describing the executable mappings.  Objects
+ * are looked up by build-id under /usr/lib/debug first, and the symbols of
+ * an object are loaded and its addresses resolved once per build-id, however
+ * many processes or reports use it.
+ */
+#define DMGL_PARAMS (1 << 0)
+#define DMGL_ANSI   (1 << 1)
+
+#define MAX_LINE_LEN       4096
+#define MAX_PATH_LEN       1024
+#define MAX_BUILD_ID_LEN   20
+#define MAX_UNWIND_INLINE  10
+#define RESULT_HASH_SIZE   1024
+#define DEBUG_FILE_DIR     "/usr/lib/debug/.build-id"
+
+struct result {
+    struct result *next;
+    bfd_vma vma;
+    char *funcname;     /* NULL if no symbol was found */
+    char *inlines;      /* the "  |- " lines */
+};
+
+struct object {
+    struct object *next;
+    char key[MAX_PATH_LEN];     /* build-id, or the path if there is none */
+    bfd *abfd;
+    asymbol **symbols;
+    struct result *results[RESULT_HASH_SIZE];
+};
+
+struct module {
+    unsigned long start, end, file_offset, load_base;
+    int has_base;
+    char build_id[MAX_BUILD_ID_LEN * 2 + 1];
+    char path[MAX_PATH_LEN];
+    struct object *object;
+};
+
+struct lookup {
+    asymbol **symbols;
+    bfd_vma vma;
+    int found;
+    const char *filename;
+    const char *funcname;
+    unsigned int line;
+};
+
+static struct object *__objects;
+static struct module *__modules;
+static int __num_modules, __max_modules;
+
+static void find_address_in_section(bfd *abfd, asection *section, void *data)
+{
+    struct lookup *lookup = (struct lookup *)data;
+    bfd_vma vma;
+
+    if (lookup->found)
+        return;
+
+    if ((bfd_section_flags(section) & SEC_ALLOC) == 0)
+        return;
+
+    vma = bfd_section_vma(section);
+    if (lookup->vma < vma || lookup->vma >= vma + bfd_section_size(section))
+        return;
+
+    lookup->found = bfd_find_nearest_line(abfd, section, lookup->symbols, lookup->vma - vma,
+                                          &lookup->filename, &lookup->funcname, &lookup->line);
+}
+
+static int __get_file_build_id(bfd *abfd, char *build_id)
+{
+    asection *section = bfd_get_section_by_name(abfd, ".note.gnu.build-id");
+    bfd_byte buf[256];
+    unsigned int namesz, descsz, i;
+    bfd_size_type size;
+
+    build_id[0] = 0;
+    if (!section)
+        return -1;
+    size = bfd_section_size(section);
+    if (size < 16 || size > sizeof(buf) || !bfd_get_section_contents(abfd, section, buf, 0, size))
+        return -1;
+
+    namesz = bfd_get_32(abfd, buf);
+    descsz = bfd_get_32(abfd, buf + 4);
+    if (12 + ((namesz + 3) & ~3) + descsz > size)
+        return -1;
+    if (descsz > MAX_BUILD_ID_LEN)
+        descsz = MAX_BUILD_ID_LEN;
+    for (i = 0; i < descsz; i++)
+        sprintf(build_id + i * 2, "%02x", buf[12 + ((namesz + 3) & ~3) + i]);
+    return 0;
+}
+
+static bfd *__open_bfd(const char *path)
+{
+    bfd *abfd = bfd_openr(path, NULL);
+
+    if (!abfd)
+        return NULL;
+    abfd->flags |= BFD_DECOMPRESS;
+    if (!bfd_check_format(abfd, bfd_object)) {
+        bfd_close(abfd);
+        return NULL;
+    }
+    return abfd;
+}
+
+static int __load_symbols(struct object *object)
+{
+    long storage, num_sym;
+
+    storage = bfd_get_symtab_upper_bound(object->abfd);
+    if (storage > 0) {
+        object->symbols = (asymbol **)malloc(storage);
+        num_sym = bfd_canonicalize_symtab(object->abfd, object->symbols);
+        if (num_sym > 0)
+            return 0;
+        free(object->symbols);
+    }
+
+    storage = bfd_get_dynamic_symtab_upper_bound(object->abfd);
+    if (storage <= 0)
+        return -1;
+    object->symbols = (asymbol **)malloc(storage);
+    num_sym = bfd_canonicalize_dynamic_symtab(object->abfd, object->symbols);
+    if (num_sym < 0) {
+        free(object->symbols);
+        object->symbols = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static struct object *__get_object(struct module *module)
+{
+    struct object *object;
+    char path[MAX_PATH_LEN + 64], build_id[MAX_BUILD_ID_LEN * 2 + 1];
+    const char *key = module->build_id[0] ? module->build_id : module->path;
+
+    for (object = __objects; object; object = object->next) {
+        if (!strcmp(object->key, key))
+            return object;
+    }
+
+    object = (struct object *)calloc(1, sizeof(*object));
+    strncpy(object->key, key, sizeof(object->key) - 1);
+    object->next = __objects;
+    __objects = object;
+
+    if (module->build_id[0]) {
+        snprintf(path, sizeof(path), "%s/%.2s/%s.debug", DEBUG_FILE_DIR, module->build_id, module->build_id + 2);
+        object->abfd = __open_bfd(path);
+    }
+    if (!object->abfd && module->path[0] != '[')
+        object->abfd = __open_bfd(module->path);
+    if (!object->abfd)
+        return object;
+
+    if (module->build_id[0] && !__get_file_build_id(object->abfd, build_id) && strcmp(build_id, module->build_id)) {
+        fprintf(stderr, "%s: build-id %s does not match %s of the target, not resolved\n", module->path, build_id, module->build_id);
+        bfd_close(object->abfd);
+        object->abfd = NULL;
+        return object;
+    }
+
+    if (__load_symbols(object) < 0) {
+        bfd_close(object->abfd);
+        object->abfd = NULL;
+    }
+    return object;
+}
+
+static char *__append(char *str, const char *add)
+{
+    size_t len = str ? strlen(str) : 0;
+
+    str = (char *)realloc(str, len + strlen(add) + 1);
+    strcpy(str + len, add);
+    return str;
+}
+
+static char *__demangle(bfd *abfd, const char *name)
+{
+    char *alloc = bfd_demangle(abfd, name, DMGL_ANSI | DMGL_PARAMS);
+
+    return alloc ? alloc : strdup(name);
+}
+
+static struct result *__resolve(struct object *object, bfd_vma vma)
+{
+    struct result *result, **head = &object->results[vma % RESULT_HASH_SIZE];
+    struct lookup lookup = { object->symbols, vma };
+    char line[MAX_LINE_LEN];
+    char *funcname;
+    int i = 0;
+
+    for (result = *head; result; result = result->next) {
+        if (result->vma == vma)
+            return result;
+    }
+
+    result = (struct result *)calloc(1, sizeof(*result));
+    result->vma = vma;
+    result->next = *head;
+    *head = result;
+
+    bfd_map_over_sections(object->abfd, find_address_in_section, &lookup);
+    if (!lookup.found || !lookup.funcname)
+        return result;
+
+    while (1) {
+        funcname = __demangle(object->abfd, lookup.funcname);
+        if (!i)
+            result->funcname = strdup(funcname);
+        if (lookup.filename && lookup.line) {
+            snprintf(line, sizeof(line), "  |- %s in %s:%d\n", funcname, lookup.filename, lookup.line);
+            result->inlines = __append(result->inlines, line);
+        }
+        free(funcname);
+        if (!(++i < MAX_UNWIND_INLINE && bfd_find_inliner_info(object->abfd, &lookup.filename, &lookup.funcname, &lookup.line)))
+            break;
+    }
+    return result;
+}
+
+static struct module *__find_module(unsigned long addr)
+{
+    int lo = 0, hi = __num_modules - 1, mid;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (addr < __modules[mid].start)
+            hi = mid - 1;
+        else if (addr >= __modules[mid].end)
+            lo = mid + 1;
+        else
+            return &__modules[mid];
+    }
+    return NULL;
+}
+
+static void __add_module(const char *line)
+{
+    struct module *module;
+    char base[32], build_id[64];
+    int n = 0;
+
+    if (__num_modules == __max_modules) {
+        __max_modules = __max_modules ? __max_modules * 2 : 64;
+        __modules = (struct module *)realloc(__modules, sizeof(*__modules) * __max_modules);
+    }
+    module = &__modules[__num_modules];
+    memset(module, 0, sizeof(*module));
+
+    if (sscanf(line, "#MODULE %lx-%lx %lx %31s %63s %n", &module->start, &module->end, &module->file_offset, base, build_id, &n) < 5)
+        return;
+    if (strcmp(base, "-")) {
+        module->load_base = strtoul(base, NULL, 16);
+        module->has_base = 1;
+    }
+    if (strcmp(build_id, "-"))
+        strncpy(module->build_id, build_id, sizeof(module->build_id) - 1);
+    strncpy(module->path, line + n, sizeof(module->path) - 1);
+    module->path[strcspn(module->path, "\n")] = 0;
+
+    /* the target logs the modules in address order */
+    __num_modules++;
+}
+
+static void __print_frame(unsigned long addr)
+{
+    struct module *module = __find_module(addr);
+    struct result *result;
+    unsigned long offset;
+
+    if (!module) {
+        printf("UNKNOWN FILE\n");
+        return;
+    }
+
+    offset = addr - module->start + module->file_offset;
+    if (!module->object)
+        module->object = __get_object(module);
+    if (!module->object->abfd) {
+        printf("UNKNOWN SYMBOL [%p (%lx)]\n", (void *)addr, offset);
+        return;
+    }
+
+    result = __resolve(module->object, module->has_base ? addr - module->load_base : offset);
+    if (!result->funcname)
+        printf("UNKNOWN SYMBOL [%p (%lx)]\n", (void *)addr, offset);
+    else
+        printf("%s @ %s [%p (%lx)]\n%s", result->funcname, module->path, (void *)addr, offset, result->inlines ? result->inlines : "");
+}
+
+static void __symbolize(FILE *fp)
+{
+    char line[MAX_LINE_LEN];
+    unsigned long addr;
+
+    __num_modules = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (!strncmp(line, "#MODULES ", 9))
+            __num_modules = 0;
+        else if (!strncmp(line, "#MODULE ", 8))
+            __add_module(line);
+        else if (!strncmp(line, "#PC ", 4) && sscanf(line, "#PC %lx", &addr) == 1)
+            __print_frame(addr);
+        else
+            fputs(line, stdout);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    int i;
+
+    bfd_init();
+
+    if (argc == 1) {
+        __symbolize(stdin);
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h")) {
+            printf("memchk-symbolize [log file...]\n");
+            printf("          resolve the call stacks of logs written with MEMCHK_SYMBOLIZE=offline to stdout\n");
+            return 0;
+        }
+        fp = fopen(argv[i], "r");
+        if (!fp) {
+            perror(argv[i]);
+            return 1;
+        }
+        __symbolize(fp);
+        fclose(fp);
+    }
+    return 0;
+}
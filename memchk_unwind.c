@@ -0,0 +1,772 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include "memchk.h"
+
+/*
+ * Callstack unwinders.  All of them fill trace[] with return addresses the
+ * same way backtrace() does: trace[0] is the address in the caller of
+ * mc_unwind().  The unwinder is selected at startup with MEMCHK_UNWINDER:
+ *
+ *   backtrace : glibc backtrace() (default)
+ *   fp        : walk the frame pointer chain.  Only frames built with
+ *               -fno-omit-frame-pointer are followed correctly.
+ *   cfi       : walk the .eh_frame rules like backtrace() does, but memoize
+ *               the rule of each return address so that a known pc costs a
+ *               cache lookup instead of a CFI interpretation.  x86-64 only;
+ *               backtrace is used instead on other architectures.
+ */
+
+#define UNWIND_SAMPLE_INTERVAL 1024    /* must be a power of two */
+
+enum {
+    UNWINDER_BACKTRACE,
+    UNWINDER_FP,
+    UNWINDER_CFI,
+    UNWINDER_MAX
+};
+
+struct unwinder {
+    const char *name;
+    int (*unwind)(void *trace[], int max_depth, int skip);
+};
+
+#if defined(__x86_64__)
+#define UNWIND_CACHE_BITS 14
+#define UNWIND_CACHE_SIZE (1 << UNWIND_CACHE_BITS)
+
+/* x86-64 DWARF register numbers */
+#define DWARF_REG_RBP 6
+#define DWARF_REG_RSP 7
+
+/* unwind rule of one return address, packed so that it is read in one load */
+union unwind_rule {
+    struct {
+        int32_t cfa_off;
+        int16_t rbp_off;    /* where rbp is saved, relative to CFA */
+        int8_t ra_off;      /* where the return address is saved, relative to CFA */
+        uint8_t flags;
+    };
+    uint64_t val;
+};
+
+#define RULE_CFA_RBP   0x01    /* CFA = rbp + cfa_off (otherwise rsp + cfa_off) */
+#define RULE_RBP_SAVED 0x02
+#define RULE_END       0x04    /* outermost frame */
+#define RULE_NONE      0x08    /* not expressible, fall back to backtrace() */
+#define RULE_VALID     0x80
+
+/* direct mapped; seq is odd while the entry is being written */
+struct unwind_cache_entry {
+    unsigned int seq;
+    uintptr_t pc;
+    uint64_t rule;
+};
+
+static struct unwind_cache_entry __unwind_cache[UNWIND_CACHE_SIZE];
+#endif
+
+static __thread uintptr_t __stack_lo __attribute__((tls_model("initial-exec")));
+static __thread uintptr_t __stack_hi __attribute__((tls_model("initial-exec")));
+static __thread unsigned int __sample_cnt __attribute__((tls_model("initial-exec")));
+
+static int __active = UNWINDER_BACKTRACE;
+
+static uint64_t __sampled_cnt[UNWINDER_MAX];
+static uint64_t __sampled_ns[UNWINDER_MAX];
+static uint64_t __sampled_frames[UNWINDER_MAX];
+static uint64_t __cfi_cache_miss;
+static uint64_t __cfi_fallback;
+
+
+/*
+ * Every load done by the fp and cfi walkers is checked against the part of
+ * the current thread's stack that is above the walker's own frame, so a
+ * broken chain ends the walk instead of faulting.
+ */
+static int __get_stack_bounds(uintptr_t sp, uintptr_t *hi)
+{
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    if (!__stack_hi) {
+        __stack_hi = 1;
+        if (!pthread_getattr_np(pthread_self(), &attr)) {
+            if (!pthread_attr_getstack(&attr, &addr, &size)) {
+                __stack_lo = (uintptr_t)addr;
+                __stack_hi = (uintptr_t)addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    /* unknown stack or running on an alternate signal stack */
+    if (sp < __stack_lo || sp >= __stack_hi)
+        return -1;
+    *hi = __stack_hi;
+    return 0;
+}
+
+static int __attribute__((noinline)) __unwind_backtrace(void *trace[], int max_depth, int skip)
+{
+    void *buf[MAX_CALLSTACK_DEPTH + 8];
+    int depth;
+
+    /* drop our own frame too */
+    skip++;
+    if (max_depth + skip > sizeof(buf) / sizeof(buf[0]))
+        max_depth = sizeof(buf) / sizeof(buf[0]) - skip;
+
+    depth = backtrace(buf, max_depth + skip);
+    if (depth <= skip)
+        return 0;
+    memcpy(trace, buf + skip, sizeof(void *) * (depth - skip));
+    return depth - skip;
+}
+
+static int __attribute__((noinline)) __unwind_fp(void *trace[], int max_depth, int skip)
+{
+    uintptr_t *frame = __builtin_frame_address(0);
+    uintptr_t lo = (uintptr_t)frame, hi;
+    int depth = 0;
+
+    if (__get_stack_bounds(lo, &hi))
+        return __unwind_backtrace(trace, max_depth, skip + 1);
+
+    while (depth < max_depth) {
+        if ((uintptr_t)frame < lo || (uintptr_t)frame + 2 * sizeof(uintptr_t) > hi || ((uintptr_t)frame & (sizeof(uintptr_t) - 1)))
+            break;
+        if (!frame[1])
+            break;
+        if (skip)
+            skip--;
+        else
+            trace[depth++] = (void *)frame[1];
+        /* the chain must go up the stack */
+        if (frame[0] <= (uintptr_t)frame)
+            break;
+        frame = (uintptr_t *)frame[0];
+    }
+    return depth;
+}
+
+#if defined(__x86_64__)
+/* not in a public header, but exported by libgcc_s since GCC 3.0 */
+struct dwarf_eh_bases {
+    void *tbase;
+    void *dbase;
+    void *func;
+};
+extern const void *_Unwind_Find_FDE(void *pc, struct dwarf_eh_bases *bases);
+
+static uint64_t __read_uleb128(const uint8_t **p)
+{
+    uint64_t val = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = *(*p)++;
+        if (shift < 64)
+            val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return val;
+}
+
+static int64_t __read_sleb128(const uint8_t **p)
+{
+    int64_t val = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = *(*p)++;
+        if (shift < 64)
+            val |= (int64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40))
+        val |= -((int64_t)1 << shift);
+    return val;
+}
+
+/* reads the value part of a DW_EH_PE_* encoded pointer, the application part is ignored */
+static int __read_encoded(const uint8_t **p, uint8_t enc, uint64_t *val)
+{
+    const uint8_t *q = *p;
+
+    if (enc == 0xff) {          /* DW_EH_PE_omit */
+        *val = 0;
+        return 0;
+    }
+    if ((enc & 0x70) == 0x50)   /* DW_EH_PE_aligned */
+        return -1;
+
+    switch (enc & 0x0f) {
+    case 0x00:                  /* absptr */
+        memcpy(val, q, sizeof(uintptr_t));
+        q += sizeof(uintptr_t);
+        break;
+    case 0x01:                  /* uleb128 */
+        *val = __read_uleb128(&q);
+        break;
+    case 0x09:                  /* sleb128 */
+        *val = __read_sleb128(&q);
+        break;
+    case 0x02:                  /* udata2 */
+    case 0x0a: {                /* sdata2 */
+        uint16_t v;
+        memcpy(&v, q, sizeof(v));
+        *val = v;
+        q += sizeof(v);
+        break;
+    }
+    case 0x03:                  /* udata4 */
+    case 0x0b: {                /* sdata4 */
+        uint32_t v;
+        memcpy(&v, q, sizeof(v));
+        *val = v;
+        q += sizeof(v);
+        break;
+    }
+    case 0x04:                  /* udata8 */
+    case 0x0c:                  /* sdata8 */
+        memcpy(val, q, sizeof(uint64_t));
+        q += sizeof(uint64_t);
+        break;
+    default:
+        return -1;
+    }
+    *p = q;
+    return 0;
+}
+
+enum {
+    REG_SAME,
+    REG_OFFSET,
+    REG_UNDEF,
+    REG_OTHER
+};
+
+struct cfi_state {
+    int cfa_reg;            /* -1 if CFA is a DWARF expression */
+    int64_t cfa_off;
+    int rbp_how;
+    int64_t rbp_off;
+    int ra_how;
+    int64_t ra_off;
+};
+
+struct cfi_cie {
+    uint64_t code_align;
+    int64_t data_align;
+    uint64_t ra_reg;
+    uint8_t fde_enc;
+    int aug_z;
+    const uint8_t *insn;
+    const uint8_t *insn_end;
+};
+
+#define CFI_STATE_STACK 8
+
+static void __set_reg_rule(struct cfi_state *state, struct cfi_cie *cie, uint64_t reg, int how, int64_t off)
+{
+    if (reg == DWARF_REG_RBP) {
+        state->rbp_how = how;
+        state->rbp_off = off;
+    } else if (reg == cie->ra_reg) {
+        state->ra_how = how;
+        state->ra_off = off;
+    }
+}
+
+static void __restore_reg_rule(struct cfi_state *state, struct cfi_state *init, struct cfi_cie *cie, uint64_t reg)
+{
+    if (reg == DWARF_REG_RBP) {
+        state->rbp_how = init->rbp_how;
+        state->rbp_off = init->rbp_off;
+    } else if (reg == cie->ra_reg) {
+        state->ra_how = init->ra_how;
+        state->ra_off = init->ra_off;
+    }
+}
+
+/*
+ * Interpret CFA instructions until the location passes target.  Only the
+ * rules for CFA, rbp and the return address are tracked.
+ */
+static int __run_cfi(const uint8_t *p, const uint8_t *end, struct cfi_cie *cie, uintptr_t loc, uintptr_t target, struct cfi_state *state, struct cfi_state *init)
+{
+    struct cfi_state stack[CFI_STATE_STACK];
+    int sp = 0;
+    uint64_t reg, delta, len;
+    uint8_t op;
+
+    while (p < end) {
+        op = *p++;
+        delta = 0;
+
+        switch (op & 0xc0) {
+        case 0x40:      /* DW_CFA_advance_loc */
+            delta = (op & 0x3f) * cie->code_align;
+            break;
+        case 0x80:      /* DW_CFA_offset */
+            __set_reg_rule(state, cie, op & 0x3f, REG_OFFSET, (int64_t)__read_uleb128(&p) * cie->data_align);
+            continue;
+        case 0xc0:      /* DW_CFA_restore */
+            __restore_reg_rule(state, init, cie, op & 0x3f);
+            continue;
+        default:
+            break;
+        }
+
+        if (op & 0xc0) {
+            if (loc + delta > target)
+                return 0;
+            loc += delta;
+            continue;
+        }
+
+        switch (op) {
+        case 0x00:      /* DW_CFA_nop */
+            break;
+        case 0x02:      /* DW_CFA_advance_loc1 */
+            delta = *p * cie->code_align;
+            p += 1;
+            break;
+        case 0x03: {    /* DW_CFA_advance_loc2 */
+            uint16_t v;
+            memcpy(&v, p, sizeof(v));
+            delta = v * cie->code_align;
+            p += sizeof(v);
+            break;
+        }
+        case 0x04: {    /* DW_CFA_advance_loc4 */
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            delta = v * cie->code_align;
+            p += sizeof(v);
+            break;
+        }
+        case 0x05:      /* DW_CFA_offset_extended */
+            reg = __read_uleb128(&p);
+            __set_reg_rule(state, cie, reg, REG_OFFSET, (int64_t)__read_uleb128(&p) * cie->data_align);
+            break;
+        case 0x06:      /* DW_CFA_restore_extended */
+            __restore_reg_rule(state, init, cie, __read_uleb128(&p));
+            break;
+        case 0x07:      /* DW_CFA_undefined */
+            __set_reg_rule(state, cie, __read_uleb128(&p), REG_UNDEF, 0);
+            break;
+        case 0x08:      /* DW_CFA_same_value */
+            __set_reg_rule(state, cie, __read_uleb128(&p), REG_SAME, 0);
+            break;
+        case 0x09:      /* DW_CFA_register */
+            reg = __read_uleb128(&p);
+            __read_uleb128(&p);
+            __set_reg_rule(state, cie, reg, REG_OTHER, 0);
+            break;
+        case 0x0a:      /* DW_CFA_remember_state */
+            if (sp == CFI_STATE_STACK)
+                return -1;
+            stack[sp++] = *state;
+            break;
+        case 0x0b:      /* DW_CFA_restore_state */
+            if (sp == 0)
+                return -1;
+            *state = stack[--sp];
+            break;
+        case 0x0c:      /* DW_CFA_def_cfa */
+            state->cfa_reg = __read_uleb128(&p);
+            state->cfa_off = __read_uleb128(&p);
+            break;
+        case 0x0d:      /* DW_CFA_def_cfa_register */
+            state->cfa_reg = __read_uleb128(&p);
+            break;
+        case 0x0e:      /* DW_CFA_def_cfa_offset */
+            state->cfa_off = __read_uleb128(&p);
+            break;
+        case 0x0f:      /* DW_CFA_def_cfa_expression */
+            len = __read_uleb128(&p);
+            p += len;
+            state->cfa_reg = -1;
+            break;
+        case 0x10:      /* DW_CFA_expression */
+        case 0x16:      /* DW_CFA_val_expression */
+            reg = __read_uleb128(&p);
+            len = __read_uleb128(&p);
+            p += len;
+            __set_reg_rule(state, cie, reg, REG_OTHER, 0);
+            break;
+        case 0x11:      /* DW_CFA_offset_extended_sf */
+            reg = __read_uleb128(&p);
+            __set_reg_rule(state, cie, reg, REG_OFFSET, __read_sleb128(&p) * cie->data_align);
+            break;
+        case 0x12:      /* DW_CFA_def_cfa_sf */
+            state->cfa_reg = __read_uleb128(&p);
+            state->cfa_off = __read_sleb128(&p) * cie->data_align;
+            break;
+        case 0x13:      /* DW_CFA_def_cfa_offset_sf */
+            state->cfa_off = __read_sleb128(&p) * cie->data_align;
+            break;
+        case 0x14:      /* DW_CFA_val_offset */
+            reg = __read_uleb128(&p);
+            __read_uleb128(&p);
+            __set_reg_rule(state, cie, reg, REG_OTHER, 0);
+            break;
+        case 0x15:      /* DW_CFA_val_offset_sf */
+            reg = __read_uleb128(&p);
+            __read_sleb128(&p);
+            __set_reg_rule(state, cie, reg, REG_OTHER, 0);
+            break;
+        case 0x2e:      /* DW_CFA_GNU_args_size */
+            __read_uleb128(&p);
+            break;
+        case 0x2f:      /* DW_CFA_GNU_negative_offset_extended */
+            reg = __read_uleb128(&p);
+            __set_reg_rule(state, cie, reg, REG_OFFSET, -(int64_t)__read_uleb128(&p) * cie->data_align);
+            break;
+        default:        /* DW_CFA_set_loc and anything unknown */
+            return -1;
+        }
+
+        if (delta) {
+            if (loc + delta > target)
+                return 0;
+            loc += delta;
+        }
+    }
+    return 0;
+}
+
+static int __parse_cie(const uint8_t *cie_start, struct cfi_cie *cie)
+{
+    const uint8_t *p = cie_start, *end, *aug_end;
+    const char *aug;
+    uint32_t len;
+    uint64_t val, aug_len;
+    uint8_t version, enc;
+
+    memcpy(&len, p, sizeof(len));
+    if (len == 0xffffffff)
+        return -1;
+    end = p + sizeof(len) + len;
+    p += sizeof(len) + sizeof(uint32_t);
+
+    version = *p++;
+    aug = (const char *)p;
+    p += strlen(aug) + 1;
+    if (strstr(aug, "eh"))
+        return -1;
+
+    cie->code_align = __read_uleb128(&p);
+    cie->data_align = __read_sleb128(&p);
+    cie->ra_reg = version == 1 ? *p++ : __read_uleb128(&p);
+    cie->fde_enc = 0;
+    cie->aug_z = aug[0] == 'z';
+
+    if (cie->aug_z) {
+        aug_len = __read_uleb128(&p);
+        aug_end = p + aug_len;
+        for (aug++; *aug; aug++) {
+            if (*aug == 'R')
+                cie->fde_enc = *p++;
+            else if (*aug == 'P') {
+                enc = *p++;
+                if (__read_encoded(&p, enc, &val))
+                    return -1;
+            } else if (*aug == 'L')
+                p++;
+            else if (*aug != 'S' && *aug != 'B')
+                break;
+        }
+        p = aug_end;
+    } else if (aug[0])
+        return -1;
+
+    cie->insn = p;
+    cie->insn_end = end;
+    return 0;
+}
+
+static uint64_t __calc_unwind_rule(void *pc)
+{
+    struct dwarf_eh_bases bases;
+    const uint8_t *fde, *p, *end;
+    struct cfi_cie cie;
+    struct cfi_state init, state;
+    union unwind_rule rule = { .val = 0 };
+    uint32_t len, cie_off;
+    uint64_t val;
+    uintptr_t target = (uintptr_t)pc - 1;
+
+    rule.flags = RULE_VALID | RULE_NONE;
+
+    fde = _Unwind_Find_FDE((void *)target, &bases);
+    if (!fde) {
+        /* no unwind info at all: treat as the end of the stack */
+        rule.flags = RULE_VALID | RULE_END;
+        return rule.val;
+    }
+
+    memcpy(&len, fde, sizeof(len));
+    if (len == 0xffffffff)
+        return rule.val;
+    end = fde + sizeof(len) + len;
+    p = fde + sizeof(len);
+    memcpy(&cie_off, p, sizeof(cie_off));
+    if (__parse_cie(p - cie_off, &cie))
+        return rule.val;
+    p += sizeof(cie_off);
+
+    /* pc_begin is taken from bases.func, pc_range is not needed */
+    if (__read_encoded(&p, cie.fde_enc, &val) || __read_encoded(&p, cie.fde_enc & 0x0f, &val))
+        return rule.val;
+    if (cie.aug_z) {
+        val = __read_uleb128(&p);
+        p += val;
+    }
+
+    memset(&init, 0, sizeof(init));
+    init.cfa_reg = -1;
+    if (__run_cfi(cie.insn, cie.insn_end, &cie, 0, UINTPTR_MAX, &init, &init))
+        return rule.val;
+    state = init;
+    if (__run_cfi(p, end, &cie, (uintptr_t)bases.func, target, &state, &init))
+        return rule.val;
+
+    if (state.ra_how == REG_UNDEF) {
+        rule.flags = RULE_VALID | RULE_END;
+        return rule.val;
+    }
+    if (state.cfa_reg != DWARF_REG_RSP && state.cfa_reg != DWARF_REG_RBP)
+        return rule.val;
+    if (state.cfa_off != (int32_t)state.cfa_off)
+        return rule.val;
+    if (state.ra_how != REG_OFFSET || state.ra_off != (int8_t)state.ra_off)
+        return rule.val;
+    if (state.rbp_how == REG_OTHER || (state.rbp_how == REG_OFFSET && state.rbp_off != (int16_t)state.rbp_off))
+        return rule.val;
+
+    rule.flags = RULE_VALID;
+    if (state.cfa_reg == DWARF_REG_RBP)
+        rule.flags |= RULE_CFA_RBP;
+    rule.cfa_off = state.cfa_off;
+    rule.ra_off = state.ra_off;
+    if (state.rbp_how == REG_OFFSET) {
+        rule.flags |= RULE_RBP_SAVED;
+        rule.rbp_off = state.rbp_off;
+    }
+    return rule.val;
+}
+
+static uint64_t __get_unwind_rule(void *pc)
+{
+    struct unwind_cache_entry *entry = &__unwind_cache[((uintptr_t)pc * 0x9e3779b97f4a7c15UL) >> (64 - UNWIND_CACHE_BITS)];
+    unsigned int seq, seq2;
+    uintptr_t cached_pc;
+    uint64_t rule;
+
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+        cached_pc = __atomic_load_n(&entry->pc, __ATOMIC_RELAXED);
+        rule = __atomic_load_n(&entry->rule, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+        if (seq == seq2 && cached_pc == (uintptr_t)pc && rule)
+            return rule;
+    }
+
+    __atomic_add_fetch(&__cfi_cache_miss, 1, __ATOMIC_RELAXED);
+    rule = __calc_unwind_rule(pc);
+
+    /* whoever loses the race for the entry simply does not cache */
+    seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if (!(seq & 1) && __atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&entry->pc, (uintptr_t)pc, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->rule, rule, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+    return rule;
+}
+
+static int __attribute__((noinline)) __unwind_cfi(void *trace[], int max_depth, int skip)
+{
+    uintptr_t *frame = __builtin_frame_address(0);
+    uintptr_t lo = (uintptr_t)frame, hi;
+    uintptr_t pc, rsp, rbp, cfa, addr;
+    union unwind_rule rule;
+    int depth = 0, orig_skip = skip;
+
+    if (__get_stack_bounds(lo, &hi))
+        return __unwind_backtrace(trace, max_depth, skip + 1);
+
+    /* state of our caller right after we return, from our own frame */
+    pc = frame[1];
+    rbp = frame[0];
+    rsp = (uintptr_t)(frame + 2);
+
+    while (depth < max_depth && pc) {
+        if (skip)
+            skip--;
+        else
+            trace[depth++] = (void *)pc;
+
+        rule.val = __get_unwind_rule((void *)pc);
+        if (rule.flags & RULE_END)
+            break;
+        if (rule.flags & RULE_NONE) {
+            __atomic_add_fetch(&__cfi_fallback, 1, __ATOMIC_RELAXED);
+            return __unwind_backtrace(trace, max_depth, orig_skip + 1);
+        }
+
+        cfa = ((rule.flags & RULE_CFA_RBP) ? rbp : rsp) + rule.cfa_off;
+        if (cfa <= rsp || cfa > hi)
+            break;
+        addr = cfa + rule.ra_off;
+        if (addr < lo || addr + sizeof(uintptr_t) > hi)
+            break;
+        pc = *(uintptr_t *)addr;
+        if (rule.flags & RULE_RBP_SAVED) {
+            addr = cfa + rule.rbp_off;
+            if (addr < lo || addr + sizeof(uintptr_t) > hi)
+                break;
+            rbp = *(uintptr_t *)addr;
+        }
+        rsp = cfa;
+    }
+    return depth;
+}
+
+#else
+/* the rules are only interpreted for the x86-64 registers */
+#define __unwind_cfi __unwind_backtrace
+#endif
+
+static struct unwinder __unwinders[UNWINDER_MAX] = {
+    [UNWINDER_BACKTRACE] = { "backtrace", __unwind_backtrace },
+    [UNWINDER_FP] = { "fp", __unwind_fp },
+    [UNWINDER_CFI] = { "cfi", __unwind_cfi },
+};
+
+static uint64_t __get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Run every unwinder on the same stack and account the time each one took.
+ * Only the result of the active unwinder is kept.
+ */
+static int __attribute__((noinline)) __sample_unwinders(void *trace[], int max_depth, int skip)
+{
+    void *buf[MAX_CALLSTACK_DEPTH];
+    uint64_t start, ns;
+    int i, depth, ret = 0;
+
+    if (max_depth > MAX_CALLSTACK_DEPTH)
+        max_depth = MAX_CALLSTACK_DEPTH;
+
+    for (i = 0; i < UNWINDER_MAX; i++) {
+        start = __get_ns();
+        depth = __unwinders[i].unwind(i == __active ? trace : buf, max_depth, skip + 1);
+        ns = __get_ns() - start;
+        if (i == __active)
+            ret = depth;
+        __atomic_add_fetch(&__sampled_cnt[i], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&__sampled_ns[i], ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&__sampled_frames[i], depth, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
+
+int __attribute__((noinline)) mc_unwind(void *trace[], int max_depth)
+{
+    int depth;
+
+    if ((++__sample_cnt & (UNWIND_SAMPLE_INTERVAL - 1)) == 0)
+        depth = __sample_unwinders(trace, max_depth, 1);
+    else
+        depth = __unwinders[__active].unwind(trace, max_depth, 1);
+
+    /* keep our frame: the unwinders were told to skip exactly one caller */
+    __asm__ volatile("" ::: "memory");
+    return depth;
+}
+
+/*
+ * Unwinds from a signal handler.  Only backtrace() steps over the signal
+ * frame, so it is used whatever the unwinder is.  The trace starts at the
+ * frame that took the signal at pc; it is empty if pc is not found.
+ */
+int mc_unwind_signal(void *trace[], int max_depth, void *pc)
+{
+    void *buf[MAX_CALLSTACK_DEPTH + 8];
+    int depth, i;
+
+    if (!pc)
+        return 0;
+    if (max_depth > MAX_CALLSTACK_DEPTH)
+        max_depth = MAX_CALLSTACK_DEPTH;
+
+    depth = backtrace(buf, sizeof(buf) / sizeof(buf[0]));
+    for (i = 0; i < depth && buf[i] != pc; i++)
+        ;
+    if (i == depth)
+        return 0;
+    depth -= i;
+    if (depth > max_depth)
+        depth = max_depth;
+    memcpy(trace, buf + i, sizeof(void *) * depth);
+    return depth;
+}
+
+void mc_unwind_init(void)
+{
+    char *env = getenv("MEMCHK_UNWINDER");
+    int i;
+
+    if (env) {
+        for (i = 0; i < UNWINDER_MAX; i++) {
+            if (!strcmp(env, __unwinders[i].name)) {
+                __active = i;
+                break;
+            }
+        }
+        if (i == UNWINDER_MAX)
+            mc_log_print("unknown unwinder \"%s\", using %s\n", env, __unwinders[__active].name);
+    }
+    #if !defined(__x86_64__)
+    if (__active == UNWINDER_CFI) {
+        mc_log_print("the cfi unwinder is only supported on x86-64, using backtrace\n");
+        __active = UNWINDER_BACKTRACE;
+    }
+    #endif
+    mc_log_print("unwinder = %s\n", __unwinders[__active].name);
+}
+
+void mc_print_unwinder_status(void)
+{
+    uint64_t cnt;
+    int i;
+
+    mc_log_print("unwinder: %s (cost sampled every %d callstacks)\n", __unwinders[__active].name, UNWIND_SAMPLE_INTERVAL);
+    for (i = 0; i < UNWINDER_MAX; i++) {
+        cnt = __sampled_cnt[i];
+        if (!cnt)
+            continue;
+        mc_log_print("  %-9s: %lu ns/callstack, %.1f frames/callstack\n", __unwinders[i].name,
+                     __sampled_ns[i] / cnt, (float)__sampled_frames[i] / cnt);
+    }
+    if (__active == UNWINDER_CFI)
+        mc_log_print("  cfi rule cache misses: %lu, fallbacks to backtrace: %lu\n", __cfi_cache_miss, __cfi_fallback);
+}
@@ -1,3 +1,4 @@
+#include <string.h>
 #include <sys/mman.h>
 #include "memchk.h"
 #include "memchk_hashtable.h"
@@ -10,8 +11,8 @@ static struct pageregion *pageregion_cand, *prev_pageregion_cand;
 static struct vmarea *vmarea_array;
 static int __cnt;
 
-extern struct memptr *mc_alloc_memptr_hashtable[ALLOC_MEMPTR_HASHTABLE_SIZE];
-extern struct memptr *mc_alloc_memptr_hashtable_copy[ALLOC_MEMPTR_HASHTABLE_SIZE];
+extern struct ptr_hashtable mc_alloc_memptr_hashtable;
+extern struct ptr_hashtable mc_alloc_memptr_hashtable_copy;
 
 static struct pageregion *__allocate_pageregion(unsigned long start, unsigned long end)
 {
@@ -250,25 +251,27 @@ uint64_t mc_get_virtual_memory_usage(void)
     struct memptr *memptr;
     struct alloc_memblk *alloc_memblk;
 
-    rc = mc_duplicate_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE, mc_alloc_memptr_hashtable, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    rc = mc_duplicate_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy, &mc_alloc_memptr_hashtable);
     if (rc) {
         return (uint64_t)-1;
     }
 
     pageregion_head.next = NULL;
-    for_each_hashnode(memptr, mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE) {
+    mc_lock_ptr_hashtable(&mc_alloc_memptr_hashtable_copy);
+    for_each_ptr_hashnode(memptr, &mc_alloc_memptr_hashtable_copy) {
         alloc_memblk = get_alloc_memblk_from_memptr(memptr);
         #ifdef VIRTUAL_MEMORY_USAGE_DEBUG
-        mc_log_print("\nregistering 0x%lx (%lu)\n", (unsigned long)alloc_memblk->memblk.buf, alloc_memblk->memblk.bufsize);
+        mc_log_print("\nregistering 0x%lx (%lu)\n", (unsigned long)mc_memblk_buf(&alloc_memblk->memblk), mc_memblk_bufsize(&alloc_memblk->memblk));
         #endif
-        __register_block((unsigned long)alloc_memblk->memblk.buf, alloc_memblk->memblk.bufsize);
+        __register_block((unsigned long)mc_memblk_buf(&alloc_memblk->memblk), mc_memblk_bufsize(&alloc_memblk->memblk));
         #ifdef VIRTUAL_MEMORY_USAGE_DEBUG
         __print_all_pageregions();
         mc_log_print("\n");
         #endif
     }
+    mc_unlock_ptr_hashtable(&mc_alloc_memptr_hashtable_copy);
 
-    mc_destroy_all_alloc_memblk(mc_alloc_memptr_hashtable_copy, ALLOC_MEMPTR_HASHTABLE_SIZE);
+    mc_destroy_all_alloc_memblk(&mc_alloc_memptr_hashtable_copy);
 
     __init_filemaps_from_procmap();
     ret = __count_virtual_memory_size();